@@ -0,0 +1,188 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/*
+    Warm simulator state. -save_checkpoint writes it when the victim reaches -checkpoint_at,
+    -restore_checkpoint skips the victim up to the same point and continues from it, so a sweep
+    simulates the victim's start-up (GMP set-up, key generation, printf) only once.
+
+    File:    a CheckpointHeader, then sections in the order the simulator saves its state.
+    Section: an 8-byte payload size, then the payload, padded to CHECKPOINT_ALIGN. Every payload
+             starts CHECKPOINT_ALIGN aligned in the file, so cache arrays are copied straight from
+             the mapping. The reader checks each size against what it restores into.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+#define CHECKPOINT_MAGIC "SHARPCKP"
+#define CHECKPOINT_VERSION 7
+#define CHECKPOINT_ALIGN 64
+
+typedef struct Checkpoint_Header {
+    char magic[8];
+    unsigned int version;
+    unsigned int sections;
+    unsigned long fingerprint; /* Cache shapes, cores and spies the state belongs to */
+    unsigned long event_addr; /* Probe instruction the state was saved at */
+    unsigned long square_addr; /* Eviction sets were built for these */
+    unsigned long multiply_addr;
+    unsigned long instructions; /* Victim instructions simulated before the event */
+    char pad[CHECKPOINT_ALIGN - 56];
+} CheckpointHeader;
+
+static inline unsigned long checkpoint_mix(unsigned long hash, unsigned long value){
+    /* Fingerprints: every value changes the whole hash (splitmix64 finalizer) */
+    unsigned long z = hash ^ (value + 0x9e3779b97f4a7c15UL + (hash << 6) + (hash >> 2));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    return z ^ (z >> 31);
+}
+
+class CheckpointWriter {
+public:
+    FILE *file;
+    CheckpointHeader header;
+    bool failed;
+
+    bool open(const char *path){
+        file = fopen(path, "wb");
+        if (file == NULL) return false;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        header.version = CHECKPOINT_VERSION;
+        failed = fwrite(&header, sizeof(header), 1, file) != 1;
+        return !failed;
+    }
+
+    void section(const void *data, unsigned long bytes){
+        static const char zeros[CHECKPOINT_ALIGN] = {0};
+        unsigned long pad = (CHECKPOINT_ALIGN - bytes % CHECKPOINT_ALIGN) % CHECKPOINT_ALIGN;
+        /* The size sits at the end of its own aligned block, right before the payload */
+        if (fwrite(zeros, CHECKPOINT_ALIGN - sizeof(bytes), 1, file) != 1 || fwrite(&bytes, sizeof(bytes), 1, file) != 1) failed = true;
+        if (bytes > 0 && fwrite(data, bytes, 1, file) != 1) failed = true;
+        if (pad > 0 && fwrite(zeros, pad, 1, file) != 1) failed = true;
+        header.sections++;
+    }
+
+    template <class T>
+    void value(const T &v){
+        section(&v, sizeof(T));
+    }
+
+    template <class T>
+    void values(const std::vector<T> &v){
+        section(v.data(), v.size() * sizeof(T));
+    }
+
+    bool close(){
+        if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) failed = true;
+        if (fclose(file) != 0) failed = true;
+        file = NULL;
+        return !failed;
+    }
+};
+
+class CheckpointReader {
+public:
+    int fd;
+    const unsigned char *map;
+    size_t size;
+    CheckpointHeader header;
+    const unsigned char *pos;
+    unsigned int sections;
+    bool corrupt; /* A section did not have the size expected */
+
+    bool open(const char *path){
+        map = NULL;
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CheckpointHeader)){
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED){
+            ::close(fd);
+            return false;
+        }
+        map = (const unsigned char *) m;
+        memcpy(&header, map, sizeof(header));
+        if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.version != CHECKPOINT_VERSION){
+            close();
+            return false;
+        }
+        rewind();
+        return true;
+    }
+
+    void rewind(){
+        /* Every instance of a grid restores the same state */
+        pos = map + sizeof(header);
+        sections = 0;
+        corrupt = false;
+    }
+
+    const void *view(unsigned long *bytes){
+        /* Next payload in place, NULL past the end */
+        if (sections == header.sections || (size_t) (map + size - pos) < CHECKPOINT_ALIGN){
+            corrupt = true;
+            return NULL;
+        }
+        memcpy(bytes, pos + CHECKPOINT_ALIGN - sizeof(*bytes), sizeof(*bytes));
+        pos += CHECKPOINT_ALIGN;
+        if ((size_t) (map + size - pos) < *bytes){
+            corrupt = true;
+            return NULL;
+        }
+        const void *data = pos;
+        pos += (*bytes + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+        if (pos > map + size) pos = map + size;
+        sections++;
+        return data;
+    }
+
+    bool section(void *data, unsigned long bytes){
+        unsigned long stored;
+        const void *payload = view(&stored);
+        if (payload == NULL || stored != bytes){
+            corrupt = true;
+            return false;
+        }
+        memcpy(data, payload, bytes);
+        return true;
+    }
+
+    template <class T>
+    bool value(T *v){
+        return section(v, sizeof(T));
+    }
+
+    template <class T>
+    bool values(std::vector<T> *v){
+        unsigned long bytes;
+        const void *payload = view(&bytes);
+        if (payload == NULL || bytes % sizeof(T) != 0){
+            corrupt = true;
+            return false;
+        }
+        const T *first = (const T *) payload;
+        v->assign(first, first + bytes / sizeof(T));
+        return true;
+    }
+
+    void close(){
+        if (map != NULL) munmap((void *) map, size);
+        ::close(fd);
+        map = NULL;
+    }
+};
+
+#endif
@@ -0,0 +1,77 @@
+/*
+    Renders an event log written with -event_log. Does not need Pin.
+
+    Text follows the lines the simulator used to print, prefixed with the victim clock (and the
+    instance, for grids). CSV has one row per event: instance, clock, event, source, value0, value1.
+
+    Build and run with:
+        make event_decode && ./event_decode [-csv] <log>
+*/
+
+#include <iostream>
+#include <string.h>
+#include "event_log.h"
+
+using namespace std;
+
+static void print_text(const EventLogReader &log, const EventRecord &r){
+    if (log.header.instances > 1) cout << "[" << r.instance << "] ";
+    cout << r.clock << ": ";
+    switch (r.kind){
+        case EVENT_ALARM:
+            cout << "!!!!!!! WARNING !!!!!!! You have triggered the alarm for core " << r.source << " in slice " << r.value[0] << " (" << r.value[1] << " events)";
+            break;
+        case EVENT_ITERATION:
+            cout << "Leaked that iteration started " << r.value[0] << " " << log.instances[r.instance].miss_penalty << " "
+                 << log.instances[r.instance].cache_noise << " " << r.value[1];
+            break;
+        case EVENT_EXPONENT:
+            cout << "Leaked that exponent is " << r.value[0] << " " << r.value[1];
+            break;
+        case EVENT_SQUARE:
+        case EVENT_MULTIPLY:
+        case EVENT_SIGN:
+            cout << event_name(r.kind) << " " << r.value[0];
+            break;
+        case EVENT_PROBE:
+            cout << "SPY " << r.source << " hit: " << r.value[0] << " (" << r.value[1] << " cycles)";
+            break;
+        default:
+            cout << event_name(r.kind) << " " << r.source << " " << r.value[0] << " " << r.value[1];
+            break;
+    }
+    cout << "\n";
+}
+
+int main(int argc, char **argv){
+    bool csv = argc == 3 && strcmp(argv[1], "-csv") == 0;
+    if (argc != 2 && !csv){
+        cerr << "Usage: ./event_decode [-csv] <log written with -event_log>" << endl;
+        return 1;
+    }
+    EventLogReader log;
+    if (!log.open(argv[argc - 1])){
+        cerr << "Could not read the event log " << argv[argc - 1] << endl;
+        return 1;
+    }
+
+    if (csv) cout << "instance,clock,event,source,value0,value1\n";
+    else{
+        cout << "Events up to level " << log.header.level << ", " << log.header.records << " logged, " << log.header.dropped << " dropped\n";
+        for (unsigned int n = 0; n < log.header.instances; n++){
+            cout << "Instance " << n << ": cache_noise " << log.instances[n].cache_noise << ", wait_time " << log.instances[n].wait_time << "\n";
+        }
+    }
+    for (unsigned long i = 0; i < log.count; i++){
+        const EventRecord &r = log.records[i];
+        if (r.instance >= log.header.instances){
+            cerr << "Event " << i << " belongs to no instance, the log is damaged" << endl;
+            return 1;
+        }
+        if (csv) cout << r.instance << "," << r.clock << "," << event_name(r.kind) << "," << r.source << "," << r.value[0] << "," << r.value[1] << "\n";
+        else print_text(log, r);
+    }
+    if (log.count < log.header.records) cerr << "The log ends after " << log.count << " of " << log.header.records << " events" << endl;
+    log.close();
+    return 0;
+}
@@ -0,0 +1,213 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+/*
+    Per-event output of the simulator (spy probes, leaked bits, victim calls, alarms) as fixed-size
+    binary records. Simulation threads push them into a lock-free ring and never wait: a background
+    writer drains the ring to the file, and a record that finds the ring full is counted as dropped.
+    event_decode renders a log as text or CSV.
+
+    File: an EventLogHeader, <instances> EventInstance, then EventRecords in the order they were
+          drained (per instance, in victim clock order).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EVENT_LOG_MAGIC "SHARPEVT"
+#define EVENT_LOG_VERSION 2
+#define EVENT_DRAIN 4096 /* Records the writer moves to the file at once */
+
+/* Verbosity: each level adds the events of the ones below */
+enum EventLevel {
+    EVENT_LEVEL_LEAK = 1, /* Leaked bits, iteration starts and alarms */
+    EVENT_LEVEL_VICTIM, /* Calls to square, multiply and sign */
+    EVENT_LEVEL_PROBE /* Every spy probe */
+};
+
+enum EventKind {
+    EVENT_ALARM, /* source: core, value: slice, alarm count */
+    EVENT_ITERATION, /* source: spy, value: load latency, spy steps since the last one */
+    EVENT_EXPONENT, /* source: spy, value: leaked bit, spy steps since the last one */
+    EVENT_SQUARE, /* value: steps of spy 0 */
+    EVENT_MULTIPLY,
+    EVENT_SIGN,
+    EVENT_PROBE /* source: spy, value: hit, load latency */
+};
+
+static inline const char *event_name(unsigned int kind){
+    switch (kind){
+        case EVENT_ALARM: return "alarm";
+        case EVENT_ITERATION: return "iteration";
+        case EVENT_EXPONENT: return "exponent";
+        case EVENT_SQUARE: return "square";
+        case EVENT_MULTIPLY: return "multiply";
+        case EVENT_SIGN: return "sign";
+        case EVENT_PROBE: return "probe";
+    }
+    return "unknown";
+}
+
+typedef struct Event_Record {
+    unsigned long clock; /* Victim instructions executed */
+    unsigned short kind; /* EventKind */
+    unsigned short instance;
+    unsigned int source;
+    unsigned long value[2];
+} EventRecord;
+
+typedef struct Event_Log_Header {
+    char magic[8];
+    unsigned int version;
+    unsigned int record_bytes;
+    unsigned int level;
+    unsigned int instances;
+    unsigned long records;
+    unsigned long dropped; /* Records that found the ring full */
+} EventLogHeader;
+
+typedef struct Event_Instance {
+    unsigned long cache_noise;
+    long wait_time;
+    unsigned long miss_penalty; /* LLC miss penalty the spies compare latencies with */
+} EventInstance;
+
+typedef struct Event_Slot {
+    volatile unsigned long sequence; /* Position the slot is free for, + 1 once written */
+    EventRecord record;
+} EventSlot;
+
+class EventLog {
+    /*
+        Bounded ring for many producers (the simulation threads) and one consumer (the writer).
+            A producer claims a position with a CAS on <tail>, fills the slot and publishes it
+            through its sequence; the writer takes slots in order until it finds one unpublished
+    */
+public:
+    FILE *file;
+    EventLogHeader header;
+    EventSlot *slots;
+    unsigned long mask;
+    volatile unsigned long tail; /* Next position to claim */
+    unsigned long head; /* Next position to drain, writer only */
+    EventRecord drained[EVENT_DRAIN];
+    volatile bool stopping;
+    bool failed;
+
+    bool open(const char *path, unsigned int level, unsigned long ring, const EventInstance *instances, unsigned int count){
+        /* <ring> records, a power of two */
+        file = fopen(path, "wb");
+        if (file == NULL) return false;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic));
+        header.version = EVENT_LOG_VERSION;
+        header.record_bytes = sizeof(EventRecord);
+        header.level = level;
+        header.instances = count;
+        failed = fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(instances, sizeof(EventInstance), count, file) != count;
+        slots = new EventSlot[ring];
+        for (unsigned long pos = 0; pos < ring; pos++) slots[pos].sequence = pos;
+        mask = ring - 1;
+        tail = head = 0;
+        stopping = false;
+        return !failed;
+    }
+
+    void push(const EventRecord &record){
+        unsigned long pos = tail;
+        EventSlot *slot;
+        while (true){
+            slot = &slots[pos & mask];
+            long distance = (long) (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+            if (distance == 0){
+                if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+            }
+            else if (distance < 0){
+                /* The writer is a whole ring behind */
+                __sync_fetch_and_add(&header.dropped, 1);
+                return;
+            }
+            else pos = tail;
+        }
+        slot->record = record;
+        __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    }
+
+    unsigned long drain(){
+        /* Writer: moves what is published to the file, returns how many records */
+        unsigned long count = 0;
+        while (count < EVENT_DRAIN){
+            EventSlot *slot = &slots[head & mask];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + 1) break;
+            drained[count++] = slot->record;
+            __atomic_store_n(&slot->sequence, head + mask + 1, __ATOMIC_RELEASE);
+            head++;
+        }
+        if (count > 0 && fwrite(drained, sizeof(EventRecord), count, file) != count) failed = true;
+        header.records += count;
+        return count;
+    }
+
+    bool close(){
+        /* Once no thread pushes any more: drains the rest, then the counts go in the header */
+        while (drain() > 0);
+        if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) failed = true;
+        if (fclose(file) != 0) failed = true;
+        file = NULL;
+        delete[] slots;
+        return !failed;
+    }
+};
+
+class EventLogReader {
+public:
+    int fd;
+    const unsigned char *map;
+    size_t size;
+    EventLogHeader header;
+    const EventInstance *instances;
+    const EventRecord *records;
+    unsigned long count; /* Records in the file, fewer than header.records if it was cut short */
+
+    bool open(const char *path){
+        map = NULL;
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(EventLogHeader)){
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED){
+            ::close(fd);
+            return false;
+        }
+        map = (const unsigned char *) m;
+        madvise(m, size, MADV_SEQUENTIAL);
+        memcpy(&header, map, sizeof(header));
+        size_t first = sizeof(header) + header.instances * sizeof(EventInstance);
+        if (memcmp(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic)) != 0 || header.version != EVENT_LOG_VERSION ||
+            header.record_bytes != sizeof(EventRecord) || first > size){
+            close();
+            return false;
+        }
+        instances = (const EventInstance *) (map + sizeof(header));
+        records = (const EventRecord *) (map + first);
+        count = (size - first) / sizeof(EventRecord);
+        return true;
+    }
+
+    void close(){
+        if (map != NULL) munmap((void *) map, size);
+        ::close(fd);
+        map = NULL;
+    }
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef KEY_H
+#define KEY_H
+
+/*
+    Key bits inferred while the victim runs. Each observation of a bit by the spies moves the bit's
+    log-odds by +-weight, the log-odds of an observation being right. A bit is known once its
+    posterior passes the confidence threshold. The defaults (80% accuracy, 99% confidence) need four
+    more agreeing than conflicting observations, so no single probe decides a bit. A run observes
+    each bit once: the spies' rounds of one victim iteration fold into a single observation, the
+    others come from earlier runs (-key_state).
+
+    State file: a KeyStateHeader, then <bits> doubles, the log-odds of each bit (> 0 leans to 1).
+    Bit i is the exponent bit of the victim's iteration i (its i-th call to square).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#define KEY_STATE_MAGIC "SHARPKEY"
+#define KEY_STATE_VERSION 2
+
+typedef struct Key_State_Header {
+    char magic[8];
+    unsigned int version;
+    unsigned int runs; /* Runs merged into the estimates */
+    unsigned long bits;
+} KeyStateHeader;
+
+class KeyInference {
+public:
+    std::vector<double> log_odds;
+    double weight; /* Evidence of one observation */
+    double threshold; /* Log-odds a known bit reaches */
+    unsigned long known;
+    unsigned long pending_bit; /* Iteration whose rounds are being folded */
+    int pending_value; /* Their observation so far, -2 while none */
+
+    void init(unsigned int accuracy, unsigned int confidence, const std::vector<double> &prior){
+        /* <accuracy> and <confidence> in percent, above 50 */
+        weight = log(accuracy / (100.0 - accuracy));
+        threshold = log(confidence / (100.0 - confidence));
+        log_odds = prior;
+        known = 0;
+        pending_value = -2;
+        for (unsigned long bit = 0; bit < log_odds.size(); bit++){
+            if (is_known(bit)) known++;
+        }
+    }
+
+    bool is_known(unsigned long bit){
+        return bit < log_odds.size() && fabs(log_odds[bit]) >= threshold;
+    }
+
+    void observe(unsigned long bit, int value){
+        /* <value> 0 or 1, -1 when the spies could not tell (the key is at least this long) */
+        if (bit >= log_odds.size()) log_odds.resize(bit + 1, 0);
+        if (value < 0) return;
+        bool was_known = is_known(bit);
+        log_odds[bit] += value ? weight : -weight;
+        if (is_known(bit) != was_known){
+            if (was_known) known--;
+            else known++;
+        }
+    }
+
+    void fold(unsigned long bit, int value){
+        /*
+            One round of the spies in the victim iteration of <bit>: the rounds of an iteration make a
+                single observation, made once the next iteration starts (or at flush). A round that saw
+                a 1 outweighs one that saw a 0, which outweighs one that could not tell
+        */
+        if (pending_value != -2 && bit == pending_bit){
+            if (value > pending_value) pending_value = value;
+            return;
+        }
+        flush();
+        pending_bit = bit;
+        pending_value = value;
+    }
+
+    void flush(){
+        if (pending_value != -2) observe(pending_bit, pending_value);
+        pending_value = -2;
+    }
+
+    unsigned long reachable(){
+        /* Bits one more observation can make known: all of them when one observation is enough */
+        if (weight >= threshold) return ~0UL;
+        unsigned long count = 0;
+        for (unsigned long bit = 0; bit < log_odds.size(); bit++){
+            if (fabs(log_odds[bit]) + weight >= threshold) count++;
+        }
+        return count;
+    }
+
+    double confidence(unsigned long bit){
+        /* Posterior of the more likely value */
+        return 1 / (1 + exp(-fabs(log_odds[bit])));
+    }
+
+    char bit_char(unsigned long bit){
+        if (!is_known(bit)) return '?';
+        return log_odds[bit] > 0 ? '1' : '0';
+    }
+};
+
+static inline bool load_key_state(const char *path, std::vector<double> *log_odds, unsigned int *runs){
+    /* A missing file is an empty state, the first run creates it */
+    log_odds->clear();
+    *runs = 0;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return true;
+    KeyStateHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, KEY_STATE_MAGIC, sizeof(header.magic)) == 0 &&
+              header.version == KEY_STATE_VERSION;
+    if (ok){
+        log_odds->resize(header.bits);
+        ok = header.bits == 0 || fread(log_odds->data(), sizeof(double), header.bits, file) == header.bits;
+        *runs = header.runs;
+    }
+    fclose(file);
+    return ok;
+}
+
+static inline bool save_key_state(const char *path, const std::vector<double> &log_odds, unsigned int runs){
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return false;
+    KeyStateHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KEY_STATE_MAGIC, sizeof(header.magic));
+    header.version = KEY_STATE_VERSION;
+    header.runs = runs;
+    header.bits = log_odds.size();
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              (header.bits == 0 || fwrite(log_odds.data(), sizeof(double), header.bits, file) == header.bits);
+    if (fclose(file) != 0) ok = false;
+    return ok;
+}
+
+#endif
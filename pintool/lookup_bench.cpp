@@ -0,0 +1,132 @@
+/*
+    Microbenchmark for the set lookup kernels in set_lookup.h. Does not need Pin.
+
+    Builds a cache-sized array of set blocks with random tags and owners, then runs the same
+    stream of lookups (about half of them hits) through every kernel the host supports,
+    both with a runtime associativity and specialized for it. Results are checked against
+    the scalar kernel before timing.
+
+    Build and run with:
+        make lookup_bench && ./lookup_bench [lookups]
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "set_lookup.h"
+
+using namespace std;
+
+#define BENCH_SETS 16384
+#define BENCH_CORES 4
+
+typedef struct Bench_Query {
+    unsigned long set;
+    unsigned long tag;
+    int core;
+} BenchQuery;
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool same_match(const SetMatch &a, const SetMatch &b){
+    return a.hits == b.hits && a.first_invalid == b.first_invalid && a.unowned == b.unowned && a.own == b.own;
+}
+
+static double run_kernel(LookupKernel kernel, const unsigned char *blocks, unsigned long stride, const SetShape *shape,
+                         const vector<BenchQuery> &queries, unsigned long *checksum){
+    /* Fold every answer into a checksum so the compiler cannot drop the lookups */
+    unsigned long sum = 0;
+    double start = now();
+    for (unsigned long i = 0; i < queries.size(); i++){
+        SetMatch match;
+        kernel(blocks + queries[i].set * stride, shape, queries[i].tag, queries[i].core, &match);
+        sum += match.hits + match.first_invalid + (match.unowned ^ match.own);
+    }
+    double elapsed = now() - start;
+    *checksum = sum;
+    return queries.size() / elapsed;
+}
+
+template <unsigned int ASSOC>
+static void bench_assoc(unsigned long lookups, LookupIsa best){
+    unsigned long stride = layout_set_stride(ASSOC, REPL_LRU);
+    unsigned char *blocks;
+    if (posix_memalign((void **) &blocks, 64, stride * BENCH_SETS + LOOKUP_PADDING) != 0){
+        cerr << "Could not allocate benchmark sets" << endl;
+        exit(1);
+    }
+    memset(blocks, 0, stride * BENCH_SETS + LOOKUP_PADDING);
+
+    SetShape shape;
+    shape.assoc = ASSOC;
+    shape.all_ways = ASSOC == 32 ? 0xffffffff : (1u << ASSOC) - 1;
+    shape.owner_offset = layout_owner_offset(ASSOC, REPL_LRU);
+    shape.valid_offset = layout_valid_offset(ASSOC, REPL_LRU);
+
+    /* Mostly full sets with a few invalid ways, owners spread over the cores and unowned */
+    for (unsigned long set = 0; set < BENCH_SETS; set++){
+        unsigned char *block = blocks + set * stride;
+        unsigned int valid = 0;
+        for (unsigned int way = 0; way < ASSOC; way++){
+            ((unsigned long *) block)[way] = (unsigned long) rand() << 32 | rand();
+            ((signed char *) (block + shape.owner_offset))[way] = rand() % (BENCH_CORES + 1) - 1;
+            if (rand() % 8) valid |= 1u << way;
+        }
+        *(unsigned int *) (block + shape.valid_offset) = valid;
+    }
+
+    vector<BenchQuery> queries(lookups);
+    for (unsigned long i = 0; i < lookups; i++){
+        queries[i].set = rand() % BENCH_SETS;
+        queries[i].core = rand() % BENCH_CORES;
+        if (rand() % 2) queries[i].tag = ((unsigned long *) (blocks + queries[i].set * stride))[rand() % ASSOC];
+        else queries[i].tag = (unsigned long) rand() << 32 | rand();
+    }
+
+    for (int isa = LOOKUP_SCALAR; isa <= best; isa++){
+        for (int specialized = 0; specialized < 2; specialized++){
+            LookupKernel kernel = specialized ? select_lookup_kernel<ASSOC>((LookupIsa) isa) : select_lookup_kernel<0>((LookupIsa) isa);
+            LookupKernel reference = select_lookup_kernel<0>(LOOKUP_SCALAR);
+
+            for (unsigned long i = 0; i < lookups && i < 100000; i++){
+                SetMatch got, want;
+                const unsigned char *block = blocks + queries[i].set * stride;
+                kernel(block, &shape, queries[i].tag, queries[i].core, &got);
+                reference(block, &shape, queries[i].tag, queries[i].core, &want);
+                if (!same_match(got, want)){
+                    cerr << lookup_isa_name((LookupIsa) isa) << " kernel disagrees with scalar at lookup " << i << endl;
+                    exit(1);
+                }
+            }
+
+            unsigned long checksum;
+            run_kernel(kernel, blocks, stride, &shape, queries, &checksum); /* Warm up */
+            double rate = run_kernel(kernel, blocks, stride, &shape, queries, &checksum);
+            cout << setw(6) << ASSOC << setw(8) << lookup_isa_name((LookupIsa) isa) << setw(10) << (specialized ? "fixed" : "generic")
+                 << setw(14) << fixed << setprecision(1) << rate / 1e6 << " M lookups/s" << "   (checksum " << checksum << ")" << endl;
+        }
+    }
+
+    free(blocks);
+}
+
+int main(int argc, char **argv){
+    unsigned long lookups = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    LookupIsa best = detect_lookup_isa();
+    srand(1);
+
+    cout << "Host supports up to " << lookup_isa_name(best) << ", " << lookups << " lookups per run" << endl;
+    cout << setw(6) << "ways" << setw(8) << "kernel" << setw(10) << "assoc" << setw(14) << "rate" << endl;
+    bench_assoc<4>(lookups, best);
+    bench_assoc<8>(lookups, best);
+    bench_assoc<16>(lookups, best);
+    bench_assoc<32>(lookups, best);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+    Simulated metrics (-metrics). Caches count per core and per set while the victim runs, the
+    simulation samples alarms and the occupancy of the sets the spies target once per epoch.
+
+    <prefix>.csv       one row per epoch, appended as epochs end
+    <prefix>.json      per-cache, per-core counters and the epoch series, written at exit. First level
+                       hits leave out the repeats the last-line filter answered, listed per core
+                       as "filtered"
+    <prefix>.sets.csv  per-set counters of every cache, written at exit
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define SHARP_STEPS 3
+
+typedef struct Core_Counters {
+    /* Per core and cache, on its own host line: private caches and LLC slices are locked separately */
+    unsigned long hits; /* First level: without the repeats answered by the Hierarchy's last-line filter */
+    unsigned long misses;
+    unsigned long evictions; /* Valid lines replaced by this core's fills, unowned ones of SHARP step 1 included */
+    unsigned long sharp_steps[SHARP_STEPS]; /* SHARP fills by step: unowned way, own way, random (alarm) */
+    unsigned long back_invalidations; /* LLC: evictions that dropped the line from this core's private caches */
+} __attribute__((aligned(64))) CoreCounters;
+
+typedef struct Set_Counters {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} SetCounters;
+
+/* Sets the spies target: the LLC sets of square_addr and multiply_addr */
+#define METRICS_TARGETS 2
+
+typedef struct Metrics_Epoch {
+    unsigned long clock; /* Victim instructions when the epoch ended */
+    std::vector<unsigned long> alarms; /* Per core: SHARP step 3 fills during the epoch, every slice */
+    std::vector<unsigned int> occupancy; /* [target][core]: valid lines each core owns, last column unowned */
+} MetricsEpoch;
+
+class MetricsSeries {
+public:
+    unsigned long epoch; /* Victim instructions per epoch */
+    unsigned int cores;
+    std::vector<MetricsEpoch> epochs;
+    std::vector<unsigned long> alarm_totals; /* Per core at the end of the last epoch */
+    FILE *csv; /* NULL until opened and once closed */
+
+    MetricsSeries(){
+        csv = NULL;
+    }
+
+    bool open(const char *path, unsigned long length, unsigned int core_count){
+        epoch = length;
+        cores = core_count;
+        alarm_totals.assign(cores, 0);
+        csv = fopen(path, "w");
+        if (csv == NULL) return false;
+        fprintf(csv, "epoch,clock");
+        for (unsigned int core = 0; core < cores; core++) fprintf(csv, ",alarms_%u", core);
+        for (unsigned int target = 0; target < METRICS_TARGETS; target++){
+            for (unsigned int core = 0; core <= cores; core++){
+                if (core < cores) fprintf(csv, ",%s_core_%u", target == 0 ? "square" : "multiply", core);
+                else fprintf(csv, ",%s_unowned", target == 0 ? "square" : "multiply");
+            }
+        }
+        fprintf(csv, "\n");
+        return fflush(csv) == 0;
+    }
+
+    void add(const MetricsEpoch &sample){
+        /* One line per epoch, flushed so a long run can be watched */
+        epochs.push_back(sample);
+        fprintf(csv, "%lu,%lu", (unsigned long) epochs.size() - 1, sample.clock);
+        for (unsigned int core = 0; core < cores; core++) fprintf(csv, ",%lu", sample.alarms[core]);
+        for (unsigned int i = 0; i < sample.occupancy.size(); i++) fprintf(csv, ",%u", sample.occupancy[i]);
+        fprintf(csv, "\n");
+        fflush(csv);
+    }
+
+    bool close(){
+        if (csv == NULL) return false; /* Never opened, or already closed */
+        bool ok = fclose(csv) == 0;
+        csv = NULL;
+        return ok;
+    }
+};
+
+#endif
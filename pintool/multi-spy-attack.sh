@@ -6,7 +6,7 @@ rm $multi_spy_keys
 while [ $i -le $1 ]
 do
 
-$PIN_ROOT/pin -ifeellucky -t obj-intel64/pin_sharp_cache.so $2 $3 4980  $i -- ./rsa | grep "Combined Key" > temp.txt
+$PIN_ROOT/pin -ifeellucky -t obj-intel64/pin_sharp_cache.so -square $2 -multiply $3 -wait 4980 -noise $i -- ./rsa | grep "Combined Key" > temp.txt
 
 cat temp.txt
 
@@ -1,23 +1,27 @@
 #include <iostream>
+#include <fstream>
 #include <iterator>
 #include <algorithm>
 #include <vector>
 #include <sstream>
+#include <stddef.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef SHARP_REPLAY
+#include "pin_shim.h"
+#else
 #include "pin.H"
-
-#define LINE_SIZE 64
-#define L2_ASSOC 4
-#define L3_ASSOC 16
-
-#define L2_CACHE_MISS_PENALTY 40
-#define L3_CACHE_MISS_PENALTY 120
+#endif
+#include "sharp_sim.h"
+#include "sharded_sim.h"
+#include "trace.h"
+#include "key.h"
+#include "event_log.h"
+#include "stack_distance.h"
 
 /* Assuming 1 cycle per instruction */
 #define CPI 1
-#define CACHE_NOISE_ENABLED true /* Much slower if enabled because each cache load calls rand() */
-#define CACHE_NOISE 10 // Maximum noise in cycles introduced by the cache. times will vary between -CACHE_NOISE/2 and CACHE_NOISE/2
 
 /*  SHARP, end of section 7.3, "Hence, we recommend to use SHARP4 and use a threshold of 2,000 alarm events in 1 billion cycles" */
 #define SHARP_ALARM_TIME_THRESHOLD 1000000000
@@ -25,384 +29,457 @@
 
 using namespace std;
 
-typedef struct Way_Struct {
-    bool valid;
-    unsigned int lru;
-    unsigned long tag;
-} Way;
-
-typedef struct Cache_Answer {
-    bool miss; /* Whether it was a miss */
-    bool evicted; /* Whether a valid address was evicted */
-    unsigned long evicted_addr; /* Which addr was evicted if so */
-    unsigned int evicted_core; /* Core that the evicted addr belongs to. Only used for L3 evictions */
-    unsigned long penalty; /* Time penalty. If it was a hit, hit time. Otherwise, Miss time */
-} CacheAnswer;
-
 /* Adjust these values at will */
 bool multi_spy; // attack 1
 bool shared_l2; // attack 2
 int spy_count;
-int spy_probability;
-long wait_time;
-bool start_multi = false;
-unsigned long number_cores = 0;
-unsigned long timestamp = 0;
-unsigned int cache_noise;
+int spy_probability; /* Percent chance that a victim instruction comes with one of each spy */
 
 /* Pass these as argument. Spies will use them to evict the correct address */
 long unsigned int square_addr;
 long unsigned int multiply_addr;
+long unsigned int sign_addr;
+string square_symbol, multiply_symbol; /* Victim routines resolved when it loads, empty when given as addresses */
+
+bool parse_grid(const string &values, long fallback, vector<long> *grid){
+    /* Comma separated values of a -*_grid knob, <fallback> (-wait or -noise) when empty */
+    grid->clear();
+    if (values.empty()){
+        grid->push_back(fallback);
+        return true;
+    }
+    stringstream list(values);
+    string value;
+    while (getline(list, value, ',')){
+        char *end;
+        grid->push_back(strtol(value.c_str(), &end, 10));
+        if (value.empty() || *end != '\0') return false;
+    }
+    return true;
+}
 
-class Cache {
-    public:
-        unsigned long accesses;
-        unsigned long misses;
-        unsigned int size;
-        unsigned int line_size;
-        unsigned int miss_penalty;
-        unsigned int associativity;
 
-        unsigned long tag_mask;
-        unsigned long set_mask;
-        unsigned long block_off_mask;
+typedef struct Thread_State {
+    /* One per victim thread, on its own host line so clocks do not bounce between host cores */
+    int core; /* Simulated core running the thread */
+    unsigned long timestamp; /* Cycles executed by the thread */
+    unsigned long block_instructions; /* Of its current basic block, until the spies due in it run */
+} __attribute__((aligned(64))) ThreadState;
 
-        unsigned long set_bits;
-        unsigned long blk_bits;
+unsigned int victim_threads = 1;
+unsigned int shard_count = 1; /* -shards, 1: the hierarchy is simulated on the victim thread */
 
-        Way **sets;
-    
-        // SHARP data
-        bool sharp;
-        unsigned long * alarm_counter;
-        int  ** owner;
-        
-
-        
-        Cache(unsigned int s, unsigned int ls, unsigned int mp, unsigned int a, bool sp) {
-            size = s;
-            line_size = ls;
-            miss_penalty = mp;
-            associativity = a;
-            accesses = 0;
-            misses = 0;
-
-            unsigned long set_number = size * 1024 / line_size / associativity;
-
-            set_bits = ceil(log2(set_number));
-            blk_bits = ceil(log2(line_size));
-            // All powers of two, so its fine
-            block_off_mask = exp2(blk_bits) - 1;
-            set_mask = exp2(blk_bits + set_bits) - 1 - block_off_mask;
-            tag_mask = 0xffffffffffffffff - block_off_mask - set_mask;
-
-            sets = (Way **) malloc(sizeof(Way*)*set_number);
-
-            for (unsigned long i = 0; i < set_number; i++){
-                sets[i] = (Way*)malloc(sizeof(Way)*associativity);
-                for (unsigned long j = 0; j < associativity; j++){
-                    sets[i][j].valid = false;
-                    sets[i][j].lru = 0;
-                }
-            }
-            
-            sharp = sp;
-            alarm_counter = (unsigned long*) malloc(sizeof(unsigned long)*number_cores);
-            
-            owner = (int **) malloc (sizeof(int *) * set_number);
-            
-            for (unsigned long i = 0; i < set_number; i++){
-                owner[i] = (int *) malloc(sizeof(int) * associativity);
-                for (unsigned long j = 0; j < associativity; j++){
-                    owner[i][j] = -1 ;
-                }
-            }
-        }
+/*
+    Victim accesses in batches: filled by Pin's trace buffers (-instrument buffer), or by trace_replay.
+        Every instance of a grid simulates the same batch
+*/
+enum RecordKind {
+    RECORD_BLOCK, /* ea: first instruction line, arg: lines, count: instructions */
+    RECORD_READ, /* ea: data address */
+    RECORD_WRITE,
+    RECORD_PROBE /* ip: square, multiply or sign */
+};
 
-        bool tags_equal(unsigned long addr, unsigned long tag){
-            return (addr & tag_mask) == tag;
-        }
+typedef struct Access_Record {
+    ADDRINT ip;
+    ADDRINT ea;
+    UINT32 count;
+    THREADID thread; /* Victim thread, mapped to its core when the record is simulated */
+    UINT32 kind;
+    UINT32 arg;
+} AccessRecord;
+
+class Spy;
+
+/*
+    Online key inference (key.h): every instance folds the spies' observations into per-bit estimates
+        as they come, starting from those of earlier runs (-key_state). An observation counts for the
+        exponent bit of the victim iteration (call to square) it was made in, so runs line up even when
+        a spy misses or adds an observation. Once every instance knows key_target bits, the victim is stopped
+*/
+vector<double> key_prior;
+unsigned int key_prior_runs = 0;
+unsigned long key_target = 0; /* 0 to run the victim to the end */
+unsigned int key_accuracy = 80, key_confidence = 99; /* Percent: one observation is never enough, four agreeing ones are */
+unsigned int complete_instances = 0;
+bool key_complete = false;
+
+void stop_victim();
+
+/* -event_log: spy and victim events up to -event_level. NULL if not logged, they are printed as lines then */
+EventLog *event_log = NULL;
+unsigned int event_level = 0;
+
+/*
+    Spies run as wake-up events on the victim's instruction clock (summed over its threads).
+        A min-heap keeps them ordered by their next wake-up, so the victim's analysis routines
+        only compare the clock with the earliest one and idle spies cost nothing per instruction.
+        Below 99% spy_probability the gaps between a spy's instructions are drawn from its seeded
+        stream, the same geometric distribution as a draw per victim instruction
+*/
+typedef struct Spy_Event {
+    unsigned long time; /* Victim clock of the wake-up */
+    int step; /* Spy step it stands for */
+    int spy;
+} SpyEvent;
+
+bool later_event(const SpyEvent &a, const SpyEvent &b){
+    /* Heap order: earliest time on top, lower spies first on ties */
+    return a.time > b.time || (a.time == b.time && a.spy > b.spy);
+}
+
+class SpyScheduler {
+public:
+    unsigned long clock; /* Victim instructions executed */
+    unsigned long next_event; /* Time of the earliest wake-up, ~0 if none */
+    vector<SpyEvent> events;
+    vector<int> sleeping; /* Spies waiting for the victim to start */
+    Spy **spies;
+    vector<unsigned long> base; /* Per spy: clock at its step 0 */
+    vector<unsigned long> drawn_step, drawn_time; /* Per spy: its latest scheduled step and when it runs */
+    vector<Xoshiro256> rngs; /* Per spy: gaps between its instructions */
+    bool concurrent; /* Victim threads advance the clock in parallel */
+    PIN_LOCK lock;
+
+    SpyScheduler(){
+        clock = 0;
+        next_event = ~0UL;
+        concurrent = false;
+        PIN_InitLock(&lock);
+    }
+
+    unsigned long gap(int spy){
+        /* Victim instructions up to the spy's next one, each brings one if rand() % 100 <= spy_probability */
+        double chance = (spy_probability + 1) / 100.0;
+        if (chance >= 1) return 1;
+        double u = ((rngs[spy].next() >> 11) + 1) * (1.0 / 9007199254740992.0); /* (0, 1] */
+        return 1 + (unsigned long) (log(u) / log(1 - chance));
+    }
 
-        unsigned long get_set_index(unsigned long addr){
-            return (addr & set_mask) >> blk_bits;
+    unsigned long time_of(int spy, unsigned long step){
+        /* Steps are drawn in order, a spy never asks for an earlier one */
+        if (spy_probability >= 99){
+            drawn_time[spy] += step - drawn_step[spy];
+            drawn_step[spy] = step;
+        }
+        for (; drawn_step[spy] < step; drawn_step[spy]++){
+            drawn_time[spy] += gap(spy);
         }
+        return drawn_time[spy];
+    }
 
-        bool find_tag_in_set(unsigned long set, unsigned long addr){
-            Way *ways = sets[set];
+    unsigned long steps(int spy){
+        /* Spy instructions executed so far, estimated at the mean rate before the latest drawn one */
+        if (clock < base[spy]) return 0;
+        if (clock >= drawn_time[spy]) return drawn_step[spy] + (clock - drawn_time[spy]) * min(spy_probability + 1, 100) / 100;
+        return min(drawn_step[spy] - 1, (clock - base[spy]) * min(spy_probability + 1, 100) / 100);
+    }
 
-            unsigned int maximum = 0;
-            for (unsigned long way = 0; way < associativity; way++){
-                if (ways[way].lru > maximum){
-                    maximum = ways[way].lru;
-                }
-            }
+    void restart(int spy){
+        /* Step 0 of <spy> is now */
+        base[spy] = drawn_time[spy] = clock;
+        drawn_step[spy] = 0;
+    }
 
-            for (unsigned long i = 0; i < associativity; i++){
-                if (ways[i].valid && tags_equal(addr, ways[i].tag)){
-                    ways[i].lru = maximum+1; /* Most recently used address, so lru is max LRU + 1 */
-                    return false;
-                }
-            }
+    void schedule(int spy, int step){
+        SpyEvent event = {time_of(spy, step), step, spy};
+        events.push_back(event);
+        push_heap(events.begin(), events.end(), later_event);
+        next_event = events.front().time;
+    }
 
-            return true;
+    void start(Spy **s, int count, unsigned long seed); /* After Spy */
+
+    void wake_sleeping(){
+        /* The victim started: sleeping spies begin counting from now */
+        for (unsigned int i = 0; i < sleeping.size(); i++){
+            restart(sleeping[i]);
+            schedule(sleeping[i], 1);
         }
+        sleeping.clear();
+    }
+
+    void run_due(); /* After Spy */
+
+    void save(CheckpointWriter *ckpt){
+        ckpt->value(clock);
+        ckpt->value(next_event);
+        ckpt->values(events);
+        ckpt->values(sleeping);
+        ckpt->values(base);
+        ckpt->values(drawn_step);
+        ckpt->values(drawn_time);
+        ckpt->values(rngs);
+    }
 
-        void swap(unsigned long *lrus, unsigned long *ways, int index1, int index2){
-            unsigned long lru_temp = lrus[index1];
-            unsigned long way_temp = ways[index1];
-            lrus[index1] = lrus[index2];
-            lrus[index2] = lru_temp;
-            ways[index1] = ways[index2];
-            ways[index2] = way_temp;
+    bool restore(CheckpointReader *ckpt){
+        ckpt->value(&clock);
+        ckpt->value(&next_event);
+        ckpt->values(&events);
+        ckpt->values(&sleeping);
+        ckpt->values(&base);
+        ckpt->values(&drawn_step);
+        ckpt->values(&drawn_time);
+        ckpt->values(&rngs);
+        return !ckpt->corrupt;
+    }
+
+    void advance(unsigned long instructions, THREADID tid){
+        if (!concurrent){
+            clock += instructions;
+            if (clock >= next_event) run_due();
+            return;
+        }
+        /* The unlocked test is only a filter, due spies are checked again under the lock */
+        if (__sync_add_and_fetch(&clock, instructions) >= next_event){
+            PIN_GetLock(&lock, tid + 1);
+            run_due();
+            PIN_ReleaseLock(&lock);
         }
+    }
+};
 
-        void sort_lru_list(unsigned long *ways, unsigned long set){
-            /* Sort ways in a set so that we can iterate them by LRU order */
-            unsigned long lrus[associativity];
+class Simulation {
+    /*
+        One hierarchy with its spies, and the victim threads driving them.
+            -noise_grid and -wait_grid run several instances on the same victim stream
+    */
+public:
+    Hierarchy *hierarchy; /* With -shards, shard 0's: its geometry is everyone's */
+    ShardedHierarchy *sharded; /* -shards, NULL when the victim thread simulates <hierarchy> itself */
+    Spy **spies;
+    SpyScheduler scheduler;
+    ThreadState *threads;
+    bool start_multi;
+    long wait_time;
+    unsigned int cache_noise;
+    unsigned int index; /* In simulations[] */
+    ostream *out; /* cout for a lone instance, otherwise <report>, printed at the end */
+    ostringstream report;
+    KeyInference key;
+    unsigned long iterations; /* Calls to square so far: the victim is on exponent bit iterations - 1 */
+    unsigned long key_rounds; /* Spy observations folded into <key> */
+    bool key_prev_all; /* Multi-spy combination, as in print_combined_key */
+    bool key_inferred;
+    long resumed_thread; /* Victim thread a restored checkpoint resumes inside its charged block, -1 if none */
+    MetricsSeries *metrics; /* -metrics epochs, NULL when not measured */
+    unsigned long next_epoch; /* Clock ending the current epoch, ~0 without metrics */
+    StackProfile *stack; /* -stack_distance of the victim's accesses, instance 0 only, NULL otherwise */
+
+    Simulation(const Topology &topology, long wait, unsigned int n, bool alone); /* After Spy */
+
+    ThreadState *thread_state(THREADID tid){
+        /* Threads beyond -victim_threads share the state (core and clock) of an earlier one */
+        return &threads[tid % victim_threads];
+    }
 
-            for (unsigned long way = 0; way < associativity; way++){
-                ways[way] = way;
-                lrus[way] = sets[set][way].lru;
-            }
+    void event(unsigned int level, EventKind kind, unsigned int source, unsigned long value0, unsigned long value1){
+        if (level > event_level) return;
+        EventRecord record = {scheduler.clock, (unsigned short) kind, (unsigned short) index, source, {value0, value1}};
+        event_log->push(record);
+    }
 
-            /* I mean, max associativity is not usually high, we can do bubble sort */
-            for(unsigned int i = 0; i < associativity-1; i++){
-                for (unsigned j = 0; j < associativity - i - 1; j++){
-                    if (lrus[j] > lrus[j+1]){
-                        swap(lrus, ways, j, j+1);
+    void advance_clock(ThreadState *state, unsigned long instructions){
+        unsigned long before = state->timestamp;
+        state->timestamp += CPI * instructions; /* Time increases as victim executes instructions */
+        if (before / SHARP_ALARM_TIME_THRESHOLD != state->timestamp / SHARP_ALARM_TIME_THRESHOLD && state->core == 0){
+            /* End of an alarm window: check if any of the alarms surpasses the defined threshold, then reset them all */
+            if (sharded != NULL) sharded->quiesce();
+            for (unsigned int slice = 0; slice < hierarchy->slice_count; slice++){
+                unsigned long *alarm_counter = hierarchy->slices[slice]->alarm_counter;
+                hierarchy->lock_slice(slice, state->core);
+                for (unsigned int i = 0; i < hierarchy->cores; i++){
+                    unsigned long alarms = sharded != NULL ? sharded->take_alarms(slice, i) : alarm_counter[i];
+                    if (alarms > SHARP_ALARM_THRESHOLD){
+                        /* The defence's detection: always reported, logged as well */
+                        *out << "!!!!!!! WARNING !!!!!!! You have triggered the alarm for core " << i << " in slice " << slice << endl;
+                        event(EVENT_LEVEL_LEAK, EVENT_ALARM, i, slice, alarms);
                     }
+                    alarm_counter[i] = 0;
                 }
+                hierarchy->unlock_slice(slice);
             }
-
+            
         }
+    }
 
-        unsigned long reconstruct_addr(unsigned long tag, unsigned long set){
-            return (set << blk_bits) + tag;
+    void probe_point(unsigned long ip){
+        /* TESTING function addresses    */
+        if (ip == square_addr){
+            start_multi = true;
+            iterations++;
+            if (!scheduler.sleeping.empty()){
+                if (scheduler.concurrent) PIN_GetLock(&scheduler.lock, 1);
+                scheduler.wake_sleeping();
+                if (scheduler.concurrent) PIN_ReleaseLock(&scheduler.lock);
+            }
+            if (event_log == NULL) *out << "square " << scheduler.steps(0) << endl;
+            event(EVENT_LEVEL_VICTIM, EVENT_SQUARE, 0, scheduler.steps(0), 0);
         }
+        else if(ip == multiply_addr){
+            if (event_log == NULL) *out << "multiply " << scheduler.steps(0) << endl;
+            event(EVENT_LEVEL_VICTIM, EVENT_MULTIPLY, 0, scheduler.steps(0), 0);
+        }
+        else if(ip == sign_addr){
+            if (event_log == NULL) *out << "sign " << scheduler.steps(0) << endl;
+            event(EVENT_LEVEL_VICTIM, EVENT_SIGN, 0, scheduler.steps(0), 0);
+        }
+        /* ------------------------------ */
+    }
 
-        void evict_lru_block(CacheAnswer *result, unsigned long set, unsigned long addr){
-            /* Usual eviction policy */
-            Way *ways = sets[set];
+    void profile(unsigned long addr, THREADID tid){
+        /* Victim threads running concurrently take turns */
+        if (scheduler.concurrent) PIN_GetLock(&scheduler.lock, tid + 1);
+        stack->access(addr);
+        if (scheduler.concurrent) PIN_ReleaseLock(&scheduler.lock);
+    }
 
-            unsigned long ways_list[associativity];
-            sort_lru_list(ways_list, set);
+    void victim_load(unsigned long addr, int core, AccessKind kind = ACCESS_DATA){
+        /* The victim never reads its latencies, so with -shards it does not wait for them */
+        if (sharded != NULL) sharded->post(addr, core, kind, true);
+        else hierarchy->observe(addr, core, kind);
+    }
 
-            /* Just get the way with the minimum LRU value */
-            unsigned int way = ways_list[0];
-            if (ways[way].valid == true){
-                result->evicted = true;
-                result->evicted_addr = reconstruct_addr(ways[way].tag, set);
-                result->evicted_core = 0; // Not used
-            }
+    unsigned long observe(unsigned long addr, int core){
+        if (sharded != NULL) return sharded->observe(addr, core);
+        return hierarchy->observe(addr, core);
+    }
 
-            ways[way].valid = true;
-            ways[way].tag = addr & tag_mask;
+    void touch(unsigned long addr, int core){
+        /* A spy load whose latency is not read */
+        if (sharded != NULL) sharded->post(addr, core, ACCESS_DATA, true);
+        else hierarchy->observe(addr, core);
+    }
 
-            /* Update LRU to be maximum LRU +1 */
-            ways[way].lru = ways[ways_list[associativity-1]].lru + 1;
-        }
-    
-        void evict_sharp_block (CacheAnswer *result, unsigned long set, unsigned long addr, int core) {
-            /* Sharp's eviction policy */
-            Way *ways = sets[set];
-
-            unsigned long ways_list[associativity];
-            sort_lru_list(ways_list, set);
-            unsigned long way;
-
-            int candidate = -1;
-
-            // STEP 1: check if a way is unused
-            for (unsigned int i = 0; i < associativity; i++) {
-                way = ways_list[i]; /* Access way in LRU order */
-                if (owner[set][way] == -1) {
-                    candidate = way;
-                    break;
-                }
-            }
+    void probe(const vector<unsigned long> &addrs, int core, vector<unsigned long> *latencies){
+        /* Spy loads issued back to back, their latencies read afterwards */
+        latencies->resize(addrs.size());
+        if (sharded != NULL) sharded->observe_all(addrs.data(), addrs.size(), core, latencies->data());
+        else for (unsigned int i = 0; i < addrs.size(); i++) (*latencies)[i] = hierarchy->observe(addrs[i], core);
+    }
 
-            if (candidate > -1) {
-                result->evicted = false;
-                result->evicted_addr = 0;
-                result->evicted_core = 0;
-                ways[candidate].valid = true;
-                ways[candidate].tag = addr & tag_mask;
-                ways[candidate].lru = ways[ways_list[associativity-1]].lru + 1;
-                owner[set][candidate] = core;
-                return;
-            }
+    void warm(unsigned long addr, int core, AccessKind kind){
+        /* Functional warm-up: contents only, no noise */
+        if (sharded != NULL) sharded->post(addr, core, kind, false);
+        else hierarchy->load(addr, core, kind);
+    }
 
-            // STEP 2: check if a way is owned by calling processor
-            for (unsigned int i = 0; i < associativity; i++) {
-                way = ways_list[i];
-                if (owner[set][i] == core) {
-                    candidate = i;
-                    break;
-                }
-            }
-            if (candidate > -1) {
-                if (ways[candidate].valid == true){
-                    result->evicted = true;
-                    result->evicted_addr = reconstruct_addr(ways[candidate].tag, set);
-                    result->evicted_core = core;
-                }
-                ways[candidate].valid = true;
-                ways[candidate].tag = addr & tag_mask;
-                ways[candidate].lru = ways[ways_list[associativity-1]].lru + 1;
-                owner[set][candidate] = core;
-                return;
-            }
-            
-            // STEP 3: evict something randomly
-            candidate = rand() % associativity;
-            if (ways[candidate].valid == true){
-                result->evicted = true;
-                result->evicted_addr = reconstruct_addr(ways[candidate].tag, set);
-                result->evicted_core = owner[set][candidate];
-            }
-            ways[candidate].valid = true;
-            ways[candidate].tag = addr & tag_mask;
-            ways[candidate].lru = ways[ways_list[associativity-1]].lru + 1;
-            owner[set][candidate] = core;
-            alarm_counter[core]++; // Update alarm counter
-            return;
-  
-        }
+    void reset_stats(){
+        if (sharded != NULL) sharded->reset_stats();
+        else hierarchy->reset_stats();
+    }
 
-        void load(CacheAnswer *result, unsigned long addr, int core){
-            /* Returns addr of entry evicted, or 0 if it was a hit */
-            accesses++;
-            
-            unsigned long set = get_set_index(addr);
+    void instr_cache_load(unsigned long ip, THREADID tid) {
+        /*
+            Only the victim causes instruction loads for simplicity.
+                Its main thread runs on core 0, other threads on their own cores
+        */
+        ThreadState *state = thread_state(tid);
+        if (resumed(tid)) return;
+
+        advance_clock(state, 1);
+        victim_load(ip, state->core, ACCESS_FETCH);
+        if (stack != NULL) profile(ip, tid);
+        scheduler.advance(1, tid);
+        if (scheduler.clock >= next_epoch) check_epoch();
+    }
 
-            bool is_miss = find_tag_in_set(set, addr);
+    void block_cache_load(unsigned long first_line, UINT32 lines, UINT32 instructions, THREADID tid){
+        /*
+            A whole basic block: its time in one go, and one fetch per instruction line it spans.
+                The spies due during it run once its data accesses are simulated too (block_spies)
+        */
+        ThreadState *state = thread_state(tid);
+        unsigned long line_size = hierarchy->slices[0]->line_size;
+
+        if (resumed(tid)) return;
+        block_spies(tid); /* A block left before its tail, or the previous record of a batch */
+        advance_clock(state, instructions);
+        for (UINT32 line = 0; line < lines; line++){
+            victim_load(first_line + line * line_size, state->core, ACCESS_FETCH);
+            if (stack != NULL) profile(first_line + line * line_size, tid);
+        }
+        state->block_instructions = instructions;
+    }
 
-            result->miss = is_miss;
-            result->penalty = cache_noise/2+1;
-            result->evicted = false;
-            result->evicted_addr = 0;
-            result->evicted_core = 0;
+    bool resumed(THREADID tid){
+        /*
+            The block (or instruction) a restored checkpoint was saved in runs again from the probe:
+                its time and fetches are in the checkpoint, its spies still due
+        */
+        if ((long) tid != resumed_thread) return false;
+        resumed_thread = -1;
+        return true;
+    }
 
-            if (is_miss){
-                result->penalty = miss_penalty;
-                misses++;
-                
-                if (sharp) evict_sharp_block (result, set, addr, core);
-                else evict_lru_block(result, set, addr);
-            }
-        }
+    void block_spies(THREADID tid){
+        ThreadState *state = thread_state(tid);
+        if (state->block_instructions == 0) return;
+        scheduler.advance(state->block_instructions, tid);
+        state->block_instructions = 0;
+        if (scheduler.clock >= next_epoch) check_epoch();
+    }
 
-        void print_contents(){
-            /* Just a debug function. Dont mind me */
-            unsigned long set_number = size * 1024 / line_size / associativity;
-            for (unsigned long set = 0; set < set_number; set++){
-                for (unsigned int way = 0; way < associativity; way++){
-                    if (sets[set][way].valid){
-                        if (sharp)
-                            cout << "Set: " << set << " Way: " << way << " Tag: " << sets[set][way].tag << " (" << sets[set][way].lru << ")"  << "[" << owner[set][way] << "]" << endl;
-                        else
-                            cout << "Set: " << set << " Way: " << way << " Tag: " << sets[set][way].tag << " (" << sets[set][way].lru << ")" << endl;
-                    }
-                }
-            }
-        }
-};
+    void data_cache_load(unsigned long addr, THREADID tid){
+        victim_load(addr, thread_state(tid)->core);
+        if (stack != NULL) profile(addr, tid);
+    }
 
-Cache *l2_cache;
-Cache *l3_cache;
-
-bool aligned_addr(unsigned long addr){
-    return (addr & (LINE_SIZE-1)) != 0;
-}
-unsigned long load(unsigned long addr, int core){
-    /* Function responsible for loading a block from a cache hierarchy
-         and implementing snoopy protocol / invalidate */
-
-    CacheAnswer l2_answer;
-    CacheAnswer l3_answer;
-    unsigned long penalty;
-
-    /* Addresses must be aligned to 16 bits */
-    if (aligned_addr(addr)){
-        addr = addr - (addr & (LINE_SIZE-1));
-    }
-
-    if (core == 0){
-        /* Victim and Attacker0 have a different cache hierarchy for simplicity */
-        l2_cache->load (&l2_answer, addr, core);
-        if (l2_answer.miss){
-            if (l2_answer.evicted){
-                /* Update ownership in L3 */
-                unsigned long addr = l2_answer.evicted_addr;
-                unsigned long set = l3_cache->get_set_index(addr);
-                Way *ways = l3_cache->sets[set];
-                for (unsigned long way = 0; way < l3_cache->associativity; way++){
-                    if (ways[way].valid && l3_cache->tags_equal(addr, ways[way].tag)){
-                        l3_cache->owner[set][way] = -1;
-                        break;
-                    }
-                }
-            }
-                
-            l3_cache->load (&l3_answer, addr, core);
-            if (l3_answer.evicted){
-                if (l3_answer.evicted_core == 0){
-                    /* Evict from L2 cache from the proper core
-                            TODO: As soon as attackers start having an L2 as well, I also have to consider them
-                    */
-
-                    unsigned long addr = l3_answer.evicted_addr;
-                    unsigned long set = l2_cache->get_set_index(addr);
-                    Way *ways = l2_cache->sets[set];
-                    for (unsigned long way = 0; way < l2_cache->associativity; way++){
-                        if (ways[way].valid && l2_cache->tags_equal(addr, ways[way].tag)){
-                            ways[way].valid = false;
-                            break;
-                        }
-                    }
-                }
+    void simulate(const AccessRecord *records, UINT64 count){
+        for (UINT64 i = 0; i < count; i++){
+            const AccessRecord *record = &records[i];
+            switch (record->kind){
+                case RECORD_BLOCK: block_cache_load(record->ea, record->arg, record->count, record->thread); break;
+                case RECORD_READ:
+                case RECORD_WRITE: data_cache_load(record->ea, record->thread); break;
+                case RECORD_PROBE: probe_point(record->ip); break;
             }
         }
     }
-    else {
-        /* TODO: Attackers access L3 cache directly for now */
-        l3_cache->load(&l3_answer, addr, core);
-        if (l3_answer.evicted){
-            if (l3_answer.evicted_core == 0){
-                /* Evict from L2 cache from the proper core
-                        TODO: As soon as attackers start having an L2 as well, we also have to consider them
-                */
 
-                unsigned long addr = l3_answer.evicted_addr;
-                unsigned long set = l2_cache->get_set_index(addr);
-                Way *ways = l2_cache->sets[set];
-                for (unsigned long way = 0; way < l2_cache->associativity; way++){
-                    if (ways[way].valid && l2_cache->tags_equal(addr, ways[way].tag)){
-                        ways[way].valid = false;
-                        break;
-                    }
-                }
-            }
+    void check_epoch(){
+        if (scheduler.concurrent) PIN_GetLock(&scheduler.lock, 1);
+        if (scheduler.clock >= next_epoch){
+            close_epoch();
+            while (next_epoch <= scheduler.clock) next_epoch += metrics->epoch;
         }
+        if (scheduler.concurrent) PIN_ReleaseLock(&scheduler.lock);
     }
 
-    if (core == 0){
-        if (l2_answer.miss){
-            penalty = l3_answer.penalty;
+    void close_epoch(){
+        /* Alarms raised during the epoch, and who owns the lines of the sets the spies target */
+        MetricsEpoch sample;
+        unsigned int cores = hierarchy->cores;
+        sample.clock = scheduler.clock;
+        sample.alarms.assign(cores, 0);
+        for (unsigned int core = 0; core < cores; core++){
+            unsigned long total = 0;
+            for (unsigned int i = 0; i < hierarchy->slice_count; i++) total += hierarchy->slices[i]->core_stats[core].sharp_steps[SHARP_STEPS - 1];
+            sample.alarms[core] = total - metrics->alarm_totals[core];
+            metrics->alarm_totals[core] = total;
         }
-        else{
-            penalty = l2_answer.penalty;
+        unsigned long targets[METRICS_TARGETS] = {square_addr, multiply_addr};
+        sample.occupancy.assign(METRICS_TARGETS * (cores + 1), 0);
+        for (unsigned int target = 0; target < METRICS_TARGETS; target++){
+            Cache *slice = hierarchy->slices[hierarchy->slice_of(targets[target])];
+            unsigned long set = slice->get_set_index(targets[target]);
+            unsigned int valid = *slice->set_valid(set);
+            signed char *owner = slice->set_owners(set);
+            for (unsigned int way = 0; way < slice->associativity; way++){
+                if (!(valid & (1u << way))) continue;
+                sample.occupancy[target * (cores + 1) + (owner[way] < 0 ? cores : owner[way])]++;
+            }
         }
-    }
-    else{
-        penalty = l3_answer.penalty;
+        metrics->add(sample);
     }
 
-    if (CACHE_NOISE_ENABLED)
-        return penalty + (rand() % cache_noise) - cache_noise/2;
-    else
-        return penalty;
-}
+    void write_metrics(const string &prefix); /* After Spy */
+    void leaked(); /* After Spy */
+    void print_combined_key();
+    void print_stats();
+    void save(CheckpointWriter *ckpt);
+    bool restore(CheckpointReader *ckpt);
+};
 
 class Spy {
 public:
@@ -413,25 +490,57 @@ public:
     int wait_t;
     int round;
     vector<bool> hits;
-    unsigned long set_number_l3;
+    vector<unsigned long> anchors; /* Per hit: Simulation::iterations the observation belongs to, 0 before signing */
+    unsigned long iteration_anchor; /* Attack 2: iterations when the current one was seen starting */
+    vector<unsigned long> square_evset; /* LLC eviction sets, same slice and set as the target */
+    vector<unsigned long> multiply_evset;
+    unsigned long probe_addr; /* Multi-spy: line of the multiply set this spy watches */
+    vector<unsigned long> latencies; /* Of the last probe of an eviction set */
     unsigned long set_number_l2;
+    unsigned int l2_assoc;
+    unsigned int l3_assoc;
+    unsigned int line_size;
     bool iteration_started;
+    Simulation *sim; /* Hierarchy, noise level and output of the instance the spy belongs to */
+    unsigned int cache_noise;
 
-    Spy (int id) {
+    Spy (Simulation *s, int id) {
+        sim = s;
         cnt = prevCntI = prevCntE = 0;
         ready = 0;
         round = 0;
-        wait_t = wait_time; //?
+        wait_t = sim->wait_time; //?
+        cache_noise = sim->cache_noise;
         spy_id = id; /* Also represents the core it is located in */
-        set_number_l3 = l3_cache->size * 1024 / LINE_SIZE / l3_cache->associativity;
-        set_number_l2 = l2_cache->size * 1024 / LINE_SIZE / l2_cache->associativity;
+        /* Eviction sets target the victim's L2 (core 0) and the LLC */
+        Hierarchy *hierarchy = sim->hierarchy;
+        set_number_l2 = hierarchy->last_private(0)->set_number;
+        l2_assoc = hierarchy->last_private(0)->associativity;
+        l3_assoc = hierarchy->slices[0]->associativity;
+        line_size = hierarchy->slices[0]->line_size;
+        aim();
         iteration_started = false;
+        iteration_anchor = 0;
+    }
+
+    void aim () {
+        /* Eviction sets of the current square_addr and multiply_addr, again once symbols resolve */
+        Hierarchy *hierarchy = sim->hierarchy;
+        square_evset.clear();
+        multiply_evset.clear();
+        for (unsigned int i = 1; i < l3_assoc+1; i++){
+            square_evset.push_back(hierarchy->eviction_address(square_addr, i));
+            multiply_evset.push_back(hierarchy->eviction_address(multiply_addr, i));
+        }
+        probe_addr = hierarchy->eviction_address(multiply_addr, spy_id);
     }
     
-    void operate () {
-        
-        /* Described as a state machine depending on the value of cnt */
-        cnt += 1;
+    int operate (int step) {
+        /*
+            Described as a state machine depending on the value of cnt, run only at the steps it asks for.
+                Returns the step of the next wake-up, 0 to sleep until the victim starts (start_multi)
+        */
+        cnt = step;
         if (cnt == 1) { // initial configuration
             if (shared_l2) {
                 // attack 2
@@ -439,34 +548,34 @@ public:
                     ready += 1;
                 else { /* Second spy can start filling an L3 cache */
                     /* Fill up square set */
-                    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-                        load(square_addr + LINE_SIZE*set_number_l3*i, spy_id);
+                    for (unsigned int i = 0; i < l3_assoc; i++){
+                        sim->touch(square_evset[i], spy_id);
                     }
 
                     /* Fill up multiply set. Waiting does not really matter, we can do this at startup  */
-                    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-                        load(multiply_addr + LINE_SIZE*set_number_l3*i, spy_id);
+                    for (unsigned int i = 0; i < l3_assoc; i++){
+                        sim->touch(multiply_evset[i], spy_id);
                     }
                     ready += 1000;
 
                 }
             } 
             else { // attack 1
-                if (!start_multi) {cnt--;return;}
+                if (!sim->start_multi) return 0;
                 int offset = spy_id; // ordered spy attack
                 offset = 0;
                 ready += offset + 20000; // 20k for startup instructions
             }
-            return;
+            return next_step();
         }
         if (cnt >= ready) { // wait time over
             if (shared_l2) {
                 // attack 2
                 if (spy_id == 0){
                     // Constantly evict square_addr and multiply_addr from L2 cache, but not from L3
-                    for (unsigned int i = 1; i < L2_ASSOC+1; i++){
-                        load(square_addr + LINE_SIZE*set_number_l2*i, spy_id);
-                        load(multiply_addr + LINE_SIZE*set_number_l2*i, spy_id);
+                    for (unsigned int i = 1; i < l2_assoc+1; i++){
+                        sim->touch(square_addr + line_size*set_number_l2*i, spy_id);
+                        sim->touch(multiply_addr + line_size*set_number_l2*i, spy_id);
                     }
                     ready += 1;
                 }
@@ -475,11 +584,15 @@ public:
                         and when it finally starts, check if previous iteration has miss for multiply_addr */
                     unsigned long time_to_wait = 0;
                     if (iteration_started == false){
-                        for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-                            time_to_wait = load(square_addr + LINE_SIZE*set_number_l3*i, spy_id);
+                        sim->probe(square_evset, spy_id, &latencies);
+                        for (unsigned int i = 0; i < l3_assoc; i++){
+                            time_to_wait = latencies[i];
                             if (time_to_wait >= L3_CACHE_MISS_PENALTY - cache_noise/2){
                                 iteration_started = true;
-                                cout << "Leaked that iteration started " << time_to_wait << " " << L3_CACHE_MISS_PENALTY << " " << cache_noise << " " << cnt-prevCntI << endl;
+                                iteration_anchor = sim->iterations;
+                                if (event_log == NULL)
+                                    *sim->out << "Leaked that iteration started " << time_to_wait << " " << L3_CACHE_MISS_PENALTY << " " << cache_noise << " " << cnt-prevCntI << endl;
+                                sim->event(EVENT_LEVEL_LEAK, EVENT_ITERATION, spy_id, time_to_wait, cnt-prevCntI);
                         	prevCntI=cnt; 
 			  }
                         }
@@ -491,14 +604,18 @@ public:
                     }
                     else{
                         bool exponent_is_1 = false;
-                        for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-                            time_to_wait = load(multiply_addr + LINE_SIZE*set_number_l3*i, spy_id);
+                        sim->probe(multiply_evset, spy_id, &latencies);
+                        for (unsigned int i = 0; i < l3_assoc; i++){
+                            time_to_wait = latencies[i];
                             if (time_to_wait >= L3_CACHE_MISS_PENALTY - cache_noise/2){
                                 exponent_is_1 = true;
                             }
                         }
-                        cout << "Leaked that exponent is " << exponent_is_1 << " " << cnt-prevCntE <<  endl;
+                        if (event_log == NULL) *sim->out << "Leaked that exponent is " << exponent_is_1 << " " << cnt-prevCntE <<  endl;
+                        sim->event(EVENT_LEVEL_LEAK, EVENT_EXPONENT, spy_id, exponent_is_1, cnt-prevCntE);
                         hits.push_back(exponent_is_1);
+                        anchors.push_back(iteration_anchor);
+                        sim->leaked();
                         iteration_started = false;
 
                         if (exponent_is_1)
@@ -515,12 +632,15 @@ public:
                     TODO: How to check if it is a hit
                 */
                 
-                unsigned time_to_wait = load(multiply_addr +  LINE_SIZE*set_number_l3*spy_id, spy_id);
+                unsigned time_to_wait = load(probe_addr, spy_id);
                 //ready += time_to_wait;
                 bool hit = false;
                 if (time_to_wait < L3_CACHE_MISS_PENALTY - cache_noise/4) hit = true;
                 hits.push_back(hit); /* TODO - Update algorithm accordingly. We no longer have a <hit> or <miss> indicator */
-                cout << "SPY " << spy_id << " hit: " << hit << endl;                
+                anchors.push_back(sim->iterations);
+                sim->leaked();
+                if (event_log == NULL) *sim->out << "SPY " << spy_id << " hit: " << hit << endl;
+                sim->event(EVENT_LEVEL_PROBE, EVENT_PROBE, spy_id, hit, time_to_wait);
                 // update wait time
                 //   currently fine-grained, i.e., 1 unit difference between spies
                 int offset = 0;
@@ -532,453 +652,1578 @@ public:
                 ready += offset;
             }
         }
+        return next_step();
     }
-};
 
-Spy ** spies;
-
-VOID instr_cache_load(unsigned long ip) {
-    /*
-        Only the victim causes instruction loads for simplicity
-            And it is assumed to be always located on core 0
-    */
+    int next_step () {
+        /* Steps before <ready> would only count, skip them */
+        return max(ready, cnt + 1);
+    }
 
-    /* TESTING function addresses    */
-    if (ip == square_addr){
-        start_multi = true;
-        cout << "square " << spies[0]->cnt << endl;
+    unsigned long load (unsigned long addr, int core) {
+        return sim->observe(addr, core);
     }
-    else if(ip == multiply_addr){
-        cout << "multiply " << spies[0]->cnt << endl;
+
+    void save(CheckpointWriter *ckpt){
+        /* Progress only: wait_t and cache_noise belong to the run restoring it */
+        int progress[5] = {ready, cnt, prevCntI, prevCntE, round};
+        ckpt->value(progress);
+        ckpt->value(iteration_started);
+        ckpt->value(iteration_anchor);
+        ckpt->values(vector<unsigned char>(hits.begin(), hits.end()));
+        ckpt->values(anchors);
     }
-    /* ------------------------------ */
 
-    timestamp += CPI; /* Time increases as victim executes instructions */
-    if (timestamp == SHARP_ALARM_TIME_THRESHOLD){
-        /* Check if any of the alarms surpasses the defined threshold. Otherwise, reset them all */
-        for (unsigned int i = 0; i < number_cores; i++){
-            if (l3_cache->alarm_counter[i] > SHARP_ALARM_THRESHOLD){
-                cout << "!!!!!!! WARNING !!!!!!! You have triggered the alarm for core " << i << endl;
-            }
-            l3_cache->alarm_counter[i] = 0;
-        }
-        
+    bool restore(CheckpointReader *ckpt){
+        int progress[5];
+        vector<unsigned char> saved_hits;
+        if (!ckpt->value(&progress) || !ckpt->value(&iteration_started) || !ckpt->value(&iteration_anchor) ||
+            !ckpt->values(&saved_hits) || !ckpt->values(&anchors))
+            return false;
+        ready = progress[0];
+        cnt = progress[1];
+        prevCntI = progress[2];
+        prevCntE = progress[3];
+        round = progress[4];
+        hits.assign(saved_hits.begin(), saved_hits.end());
+        return true;
     }
+};
 
-    load(ip, 0);
+void SpyScheduler::start(Spy **s, int count, unsigned long seed){
+    spies = s;
+    base.assign(count, 0);
+    drawn_step.assign(count, 0);
+    drawn_time.assign(count, 0);
+    rngs.resize(count);
+    for (int i = 0; i < count; i++){
+        rngs[i].seed(seed, STREAM_SPY, spies[i]->spy_id); /* The spy's core */
+        schedule(i, 1);
+    }
 }
 
-VOID data_cache_load(unsigned long addr, int core){
-    load(addr, core);
+void SpyScheduler::run_due(){
+    while (!events.empty() && events.front().time <= clock){
+        pop_heap(events.begin(), events.end(), later_event);
+        SpyEvent event = events.back();
+        events.pop_back();
+
+        int next = spies[event.spy]->operate(event.step);
+        if (next == 0) sleeping.push_back(event.spy);
+        else{
+            SpyEvent again = {time_of(event.spy, next), next, event.spy};
+            events.push_back(again);
+            push_heap(events.begin(), events.end(), later_event);
+        }
+    }
+    next_event = events.empty() ? ~0UL : events.front().time;
 }
 
-VOID spy_instruction(int spy){
-    spies[spy]->operate();
+Simulation::Simulation(const Topology &topology, long wait, unsigned int n, bool alone){
+    sharded = NULL;
+    if (shard_count > 1){
+        sharded = new ShardedHierarchy(topology, shard_count);
+        hierarchy = sharded->shards[0].hierarchy;
+    }
+    else hierarchy = new Hierarchy(topology);
+    index = n;
+    wait_time = wait;
+    cache_noise = topology.noise;
+    start_multi = false;
+    key.init(key_accuracy, key_confidence, key_prior);
+    iterations = 0;
+    key_rounds = 0;
+    key_prev_all = true;
+    key_inferred = false;
+    resumed_thread = -1;
+    metrics = NULL;
+    next_epoch = ~0UL;
+    stack = NULL;
+    out = alone ? &cout : &report;
+
+    /* The victim's main thread runs on core 0, its other threads on the last cores, after the spies */
+    if (posix_memalign((void **) &threads, 64, victim_threads * sizeof(ThreadState)) != 0){
+        cerr << "Could not allocate thread state" << endl;
+        exit(1);
+    }
+    for (unsigned int t = 0; t < victim_threads; t++){
+        threads[t].core = t == 0 ? 0 : topology.cores - victim_threads + t;
+        threads[t].timestamp = 0;
+        threads[t].block_instructions = 0;
+    }
+
+    spies = (Spy**) malloc (sizeof (Spy *) * spy_count);
+    if (shared_l2) {
+        spies[0] = new Spy (this, 0); // shares L2
+        spies[1] = new Spy (this, 1); // different core
+    }
+    else {
+        for (int i = 0; i < spy_count; i++) {
+            spies[i] = new Spy (this, i+1); // do not share core 0
+        }
+    }
+    scheduler.concurrent = topology.concurrent;
+    scheduler.start(spies, spy_count, topology.seed);
 }
 
+void Simulation::save(CheckpointWriter *ckpt){
+    ckpt->section(threads, victim_threads * sizeof(ThreadState));
+    ckpt->value(start_multi);
+    ckpt->value(iterations);
+    hierarchy->save(ckpt);
+    scheduler.save(ckpt);
+    for (int i = 0; i < spy_count; i++){
+        spies[i]->save(ckpt);
+    }
+}
 
-VOID Instruction(INS ins, VOID *v)
-{
-    ADDRINT ip = INS_Address(ins);
-    UINT32 memOperands = INS_MemoryOperandCount(ins);
+bool Simulation::restore(CheckpointReader *ckpt){
+    ckpt->section(threads, victim_threads * sizeof(ThreadState));
+    ckpt->value(&start_multi);
+    ckpt->value(&iterations);
+    hierarchy->restore(ckpt);
+    scheduler.restore(ckpt);
+    for (int i = 0; i < spy_count; i++){
+        spies[i]->restore(ckpt);
+    }
+    /* Counters start at the checkpoint, so does the first epoch */
+    if (metrics != NULL) next_epoch = scheduler.clock + metrics->epoch;
+    return !ckpt->corrupt;
+}
 
-    // All instructions cause a load in Icache
-    INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)instr_cache_load, IARG_UINT64, ip, IARG_END);
+void Simulation::write_metrics(const string &prefix){
+    /* Counters at exit, see metrics.h. The epoch series is already in <prefix>.csv */
+    if (metrics->epochs.empty() || metrics->epochs.back().clock < scheduler.clock) close_epoch(); /* The last, partial epoch */
+    unsigned int cores = hierarchy->cores;
+    vector<Cache *> caches;
+    vector<string> names;
+    vector<unsigned int> ids; /* Slice of the LLC, core of a private cache */
+    for (unsigned int i = 0; i < hierarchy->slice_count; i++){
+        caches.push_back(hierarchy->slices[i]);
+        names.push_back("L3");
+        ids.push_back(i);
+    }
+    for (unsigned int i = 0; i < cores * hierarchy->private_levels * 2; i++){
+        if (hierarchy->privates[i] == NULL) continue;
+        caches.push_back(hierarchy->privates[i]);
+        names.push_back(hierarchy->cache_name(i));
+        ids.push_back(i / 2 / hierarchy->private_levels);
+    }
 
-    /* Service the first and second read first */
-    for (UINT32 memOp = 0; memOp < memOperands; memOp++){
-        if (INS_MemoryOperandIsRead(ins, memOp)){
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE,  (AFUNPTR) data_cache_load,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_UINT64, 0,
-                IARG_END);
+    ofstream json((prefix + ".json").c_str());
+    json << "{\n  \"cache_noise\": " << cache_noise << ",\n  \"wait_time\": " << wait_time << ",\n  \"instructions\": " << scheduler.clock
+         << ",\n  \"epoch\": " << metrics->epoch << ",\n  \"alarm_threshold\": " << SHARP_ALARM_THRESHOLD << ",\n  \"filtered\": [";
+    /* First level hits the last-line filter answered without a lookup, not in the caches' hits */
+    for (unsigned int core = 0; core < cores; core++) json << (core ? ", " : "") << hierarchy->filtered[core];
+    json << "],\n  \"caches\": [\n";
+    for (unsigned int c = 0; c < caches.size(); c++){
+        Cache *cache = caches[c];
+        json << "    {\"cache\": \"" << names[c] << "\", \"" << (c < hierarchy->slice_count ? "slice" : "core") << "\": " << ids[c]
+             << ", \"sets\": " << cache->set_number << ", \"ways\": " << cache->associativity << ", \"accesses\": " << cache->accesses
+             << ", \"misses\": " << cache->misses << ", \"cores\": [";
+        for (unsigned int core = 0; core < cores; core++){
+            CoreCounters *stats = &cache->core_stats[core];
+            json << (core ? ", " : "") << "{\"core\": " << core << ", \"hits\": " << stats->hits << ", \"misses\": " << stats->misses
+                 << ", \"evictions\": " << stats->evictions << ", \"sharp_steps\": [" << stats->sharp_steps[0] << ", " << stats->sharp_steps[1]
+                 << ", " << stats->sharp_steps[2] << "], \"back_invalidations\": " << stats->back_invalidations << "}";
         }
+        json << "]}" << (c + 1 < caches.size() ? "," : "") << "\n";
     }
-
-    /* And then the write */
-    for (UINT32 memOp = 0; memOp < memOperands; memOp++){
-        if (INS_MemoryOperandIsWritten(ins, memOp)){
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE,  (AFUNPTR) data_cache_load,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_UINT64, 0,
-                IARG_END);
+    /* Heatmaps: per epoch, the lines of each target set owned by each core, then the unowned ones */
+    json << "  ],\n  \"epochs\": [\n";
+    for (unsigned int e = 0; e < metrics->epochs.size(); e++){
+        MetricsEpoch &epoch = metrics->epochs[e];
+        json << "    {\"clock\": " << epoch.clock << ", \"alarms\": [";
+        for (unsigned int core = 0; core < cores; core++) json << (core ? ", " : "") << epoch.alarms[core];
+        for (unsigned int target = 0; target < METRICS_TARGETS; target++){
+            json << "], \"" << (target == 0 ? "square" : "multiply") << "\": [";
+            for (unsigned int core = 0; core <= cores; core++) json << (core ? ", " : "") << epoch.occupancy[target * (cores + 1) + core];
         }
+        json << "]}" << (e + 1 < metrics->epochs.size() ? "," : "") << "\n";
     }
-    
-    
-    /* 
-        Random values computed statically here. 
-            Faster than dynamically call rand every victim instruction
-            Still introduces a significant amount of noise
-    */
-    for (int i = 0; i < spy_count; i++) {
-        if (rand() % 100 <= spy_probability) { // chance of spy instruction
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE,  (AFUNPTR) spy_instruction,
-                IARG_UINT64, i,
-                IARG_END);
+    json << "  ]\n}\n";
+    json.close();
+
+    /* Sets never accessed are left out */
+    ofstream sets((prefix + ".sets.csv").c_str());
+    sets << "cache,id,set,hits,misses,evictions\n";
+    for (unsigned int c = 0; c < caches.size(); c++){
+        for (unsigned long set = 0; set < caches[c]->set_number; set++){
+            SetCounters *stats = &caches[c]->set_stats[set];
+            if (stats->hits == 0 && stats->misses == 0) continue;
+            sets << names[c] << "," << ids[c] << "," << set << "," << stats->hits << "," << stats->misses << "," << stats->evictions << "\n";
         }
     }
-    
-    
+    sets.close();
+
+    if (!metrics->close() || json.fail() || sets.fail()) cerr << "Could not write the metrics " << prefix << ".*" << endl;
 }
 
-void print_combined_key () {
-    /* Computing the private key using information gathered 
-        by all the spies AFTER the victim finishes executing.
-            We do not need communication between spies during execution */
+Simulation **simulations; /* A single one unless -noise_grid or -wait_grid list several values */
+unsigned int simulation_count = 1;
 
-    cout << "Computing combined key..." << endl;
-    if (multi_spy) {
-        // combine hits from spies
-        vector<int> combined_key;
-        bool prev_all = true;
-        bool first = false;
-        int knowns=0;
-        for (unsigned int i = 0; i < spies[0]->hits.size(); i++) {
+void Simulation::leaked(){
+    /*
+        A spy recorded an observation: fold every complete one into the key estimates,
+            at the bit of its victim iteration. Observations before signing have none, and the
+            rounds of one iteration count once (KeyInference::fold)
+    */
+    if (multi_spy){
+        /* Round i is complete once every spy probed it, the first spy's probe anchors it */
+        unsigned long complete = spies[0]->hits.size();
+        for (int s = 1; s < spy_count; s++) complete = min(complete, (unsigned long) spies[s]->hits.size());
+        for (; key_rounds < complete; key_rounds++){
             int cnt = 0;
-            int out = -1;
-            for (int s = 0; s < spy_count; s++) {
-                if (spies[s]->hits[i]) cnt++;
+            for (int s = 0; s < spy_count; s++){
+                if (spies[s]->hits[key_rounds]) cnt++;
             }
-            // all hits means no exponent
-            if (cnt == spy_count) out = 0;
-            // previous all hits and now miss means exponent used
-            else if (prev_all && cnt < spy_count) out = 1;
-            // miss on last spy means exponent used
-            // ordered spy attack
-	    //else if (i%2==0 && !spies[0]->hits[i]) out = 1;
-            //else if (i%2==1 && !spies[spy_count-1]->hits[i]) out = 1;
-            prev_all = (cnt == spy_count);
-            if (first || out == 1) first = true;
-            if (first) combined_key.push_back (out);
+            int value = -1;
+            if (cnt == spy_count) value = 0;
+            else if (key_prev_all) value = 1;
+            key_prev_all = cnt == spy_count;
+            unsigned long anchor = spies[0]->anchors[key_rounds];
+            if (anchor > 0) key.fold(anchor - 1, value);
         }
-        cout << "Combined Key: ";
-        for (unsigned int i = 0; i < combined_key.size(); i++) 
-          {if (combined_key[i]==-1) cout << "?";
-           else {knowns++;cout << combined_key[i];}}
-        cout << endl;
-        cout << "Percentage found: " << 100 * (float) knowns / combined_key.size() << endl;
     }
     else{
-        cout << "Key: ";
-        /*for (unsigned int i = 4; i < spies[1]->hits.size() - 2; i+= 2){
-            if (spies[1]->hits[i] && !spies[1]->hits[i+1])
-                cout << "1";
-            else if ((spies[1]->hits[i+1])){
-                cout << "?";
-                i -= 1;
-            }
-            else
-                cout << "0";
-        }
-        cout << "1" << endl;
-        */
-
-        for (unsigned int i = 0; i < spies[1]->hits.size(); i+= 1){
-            if (spies[1]->hits[i])
-                cout << "1";
-            else{
-                cout << "0";
-            }
+        /* The second spy reads the exponent bits */
+        for (; key_rounds < spies[1]->hits.size(); key_rounds++){
+            unsigned long anchor = spies[1]->anchors[key_rounds];
+            if (anchor > 0) key.fold(anchor - 1, spies[1]->hits[key_rounds]);
         }
-        cout << endl;
     }
-}
 
-VOID Fini(INT32 code, VOID *v)
-{
-    cout << "Overall stats: " << endl;
-    cout << "Timestamp:" << timestamp << endl;
-    for (unsigned int i = 0; i < number_cores; i++){
-        printf("Alarm for core %d: %ld\n", i, l3_cache->alarm_counter[i]);
+    if (key_target == 0 || key_inferred || key.known < key_target) return;
+    key_inferred = true;
+    *out << "Key inferred: " << key.known << " bits known after " << scheduler.clock << " instructions" << endl;
+    if (__sync_add_and_fetch(&complete_instances, 1) == simulation_count){
+        key_complete = true;
+        if (simulation_count == 1) stop_victim();
     }
-
-    cout << "L3 overall misses: " << l3_cache->misses << " and accesses: " << l3_cache->accesses << endl;
-
-    print_combined_key();
-}
-
-INT32 Usage(){
-    cerr << "Our cache simulator tool." << endl;
-    cerr << "Usage: pin -t obj-intel64/pin_sharp_cache.so <square_addr> <multiply_addr> -- ./rsa " << endl;
-    return -1;
 }
 
-void test_second_atk_simplified(){
-    /* Test technique used in our second attack.
-        Test this with 0 cache noise */
-    unsigned long set_number_l2 = 256 * 1024 / LINE_SIZE / L2_ASSOC;
-    unsigned long set_number_l3 = 16384 * 1024 / LINE_SIZE / L3_ASSOC;
-
-    number_cores = 2;
-    square_addr = 0x401697;
-    multiply_addr = 0x4016dc;
-
-    l2_cache = new Cache(256, LINE_SIZE, L2_CACHE_MISS_PENALTY, L2_ASSOC, false);
-    l3_cache = new Cache(16384, LINE_SIZE, L3_CACHE_MISS_PENALTY, L3_ASSOC, true); // l3 uses SHARP
-    
-    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-        load(square_addr + LINE_SIZE*set_number_l3*i, 1);
-        load(multiply_addr + LINE_SIZE*set_number_l3*i, 1);
-    }
-
-    cout << endl << endl << "Spy1 fills up sets corresponding to square and multiply calls" << endl;
-    cout << "L3 cache" << endl; l3_cache->print_contents();
-
-    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-        unsigned long time_to_wait = load(square_addr + LINE_SIZE*set_number_l3*i, 1);
-        if (time_to_wait >= L3_CACHE_MISS_PENALTY){
-            cout << "This should not be printed" << endl;
-            break;
+class SimulationPool {
+    /*
+        Runs every instance over each batch of records. Worker w simulates instances w, w + workers, ...
+            and the thread delivering the batch is worker 0, so one worker spawns no thread at all.
+            Instances never share state, each stays with one worker and needs no locks
+    */
+public:
+    unsigned int workers;
+    PIN_SEMAPHORE *start; /* Per worker: a batch is ready */
+    PIN_SEMAPHORE *done; /* Per worker: its instances went through the batch */
+    PIN_THREAD_UID *uids;
+    const AccessRecord *batch;
+    UINT64 batch_count;
+    bool stopping;
+    PIN_LOCK lock; /* Victim threads deliver batches in turns */
+
+    bool init(unsigned int count);
+
+    void run_share(unsigned int worker){
+        for (unsigned int i = worker; i < simulation_count; i += workers){
+            simulations[i]->simulate(batch, batch_count);
         }
     }
 
-    load(square_addr, 0);
-    cout << endl << endl << "Victim calls square" << endl;
-    cout << "L2 cache" << endl; l2_cache->print_contents();
-    cout << "L3 cache" << endl; l3_cache->print_contents();
-
-    cout << "Square address is located at " << square_addr << endl;
-    for (unsigned int i = 1; i < L2_ASSOC+1; i++){
-        load(square_addr + LINE_SIZE*set_number_l2*i, 0);
-        load(multiply_addr + LINE_SIZE*set_number_l2*i, 0);
-    }
-    cout << endl << endl << "Spy0 should have evicted square" << endl;
-    cout << "L2 cache" << endl; l2_cache->print_contents();
-    cout << "L3 cache" << endl; l3_cache->print_contents();
-
-    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-        unsigned long time_to_wait = load(square_addr + LINE_SIZE*set_number_l3*i, 1);
-        if (time_to_wait >= L3_CACHE_MISS_PENALTY){
-            cout << "This should be printed" << endl;
+    void run(const AccessRecord *records, UINT64 count, THREADID tid){
+        PIN_GetLock(&lock, tid + 1);
+        batch = records;
+        batch_count = count;
+        if (stopping){
+            /* Buffers flushed by threads exiting after the workers stopped */
+            for (unsigned int i = 0; i < simulation_count; i++){
+                simulations[i]->simulate(batch, batch_count);
+            }
+            PIN_ReleaseLock(&lock);
+            return;
+        }
+        for (unsigned int w = 1; w < workers; w++){
+            PIN_SemaphoreClear(&done[w]);
+            PIN_SemaphoreSet(&start[w]);
         }
+        run_share(0);
+        for (unsigned int w = 1; w < workers; w++){
+            PIN_SemaphoreWait(&done[w]);
+        }
+        PIN_ReleaseLock(&lock);
     }
 
-    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-        unsigned long time_to_wait = load(square_addr + LINE_SIZE*set_number_l3*i, 1);
-        if (time_to_wait >= L3_CACHE_MISS_PENALTY){
-            cout << "This should not be printed" << endl;
+    void stop(){
+        if (stopping) return;
+        PIN_GetLock(&lock, 1);
+        stopping = true;
+        PIN_ReleaseLock(&lock);
+        for (unsigned int w = 1; w < workers; w++){
+            PIN_SemaphoreSet(&start[w]);
+            PIN_WaitForThreadTermination(uids[w], PIN_INFINITE_TIMEOUT, NULL);
         }
     }
+};
 
-    for (unsigned int i = 1; i < L2_ASSOC+1; i++){
-        load(square_addr + LINE_SIZE*set_number_l2*i, 0);
-        load(multiply_addr + LINE_SIZE*set_number_l2*i, 0);
+SimulationPool pool;
+
+VOID pool_worker(VOID *arg){
+    unsigned int worker = (unsigned long) arg;
+    while (true){
+        PIN_SemaphoreWait(&pool.start[worker]);
+        PIN_SemaphoreClear(&pool.start[worker]);
+        if (pool.stopping) return;
+        pool.run_share(worker);
+        PIN_SemaphoreSet(&pool.done[worker]);
     }
+}
 
-    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-        unsigned long time_to_wait = load(square_addr + LINE_SIZE*set_number_l3*i, 1);
-        if (time_to_wait >= L3_CACHE_MISS_PENALTY){
-            cout << "This should not be printed" << endl;
+bool SimulationPool::init(unsigned int count){
+    workers = count;
+    stopping = false;
+    PIN_InitLock(&lock);
+    start = new PIN_SEMAPHORE[workers];
+    done = new PIN_SEMAPHORE[workers];
+    uids = new PIN_THREAD_UID[workers];
+    for (unsigned int w = 1; w < workers; w++){
+        PIN_SemaphoreInit(&start[w]);
+        PIN_SemaphoreInit(&done[w]);
+        if (PIN_SpawnInternalThread(pool_worker, (VOID *) (unsigned long) w, 0, &uids[w]) == INVALID_THREADID){
+            workers = w;
+            return false;
         }
     }
+    return true;
+}
 
-    load(multiply_addr, 0);
-    cout << endl << endl << "Victim calls multiply" << endl;
-    cout << "L2 cache" << endl; l2_cache->print_contents();
-    cout << "L3 cache" << endl; l3_cache->print_contents();
+PIN_THREAD_UID event_writer_uid;
 
-    for (unsigned int i = 1; i < L2_ASSOC+1; i++){
-        load(square_addr + LINE_SIZE*set_number_l2*i, 0);
-        load(multiply_addr + LINE_SIZE*set_number_l2*i, 0);
+VOID event_writer(VOID *arg){
+    /* Drains the event ring to the file while the simulation runs, and what is left once it stops */
+    while (true){
+        if (event_log->drain() > 0) continue;
+        if (event_log->stopping) return;
+        PIN_Sleep(1);
     }
+}
 
-    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-        unsigned long time_to_wait = load(square_addr + LINE_SIZE*set_number_l3*i, 1);
-        if (time_to_wait >= L3_CACHE_MISS_PENALTY){
-            cout << "This should not be printed" << endl;
-        }
-    }
+void stop_shards(){
+    /* Every access is simulated and the shard workers are gone, later ones run on the victim thread */
+    if (shard_count > 1) simulations[0]->sharded->stop();
+}
 
-    load(square_addr, 0);
-    cout << endl << endl << "Victim calls square" << endl;
-    cout << "L2 cache" << endl; l2_cache->print_contents();
-    cout << "L3 cache" << endl; l3_cache->print_contents();
+void stop_event_writer(){
+    if (event_log == NULL || event_log->stopping) return;
+    event_log->stopping = true;
+    PIN_WaitForThreadTermination(event_writer_uid, PIN_INFINITE_TIMEOUT, NULL);
+}
 
-    for (unsigned int i = 1; i < L2_ASSOC+1; i++){
-        load(square_addr + LINE_SIZE*set_number_l2*i, 0);
-        load(multiply_addr + LINE_SIZE*set_number_l2*i, 0);
+/*
+    -save_checkpoint writes the state of the lone instance when the victim first reaches the probe
+        named by -checkpoint_at. -restore_checkpoint fast-forwards the victim to that probe (it starts
+        the region of interest), then loads the state into every instance (each keeps its own noise
+        and wait time). The state is saved after the probe's block is charged, and the restored
+        victim runs that block again from the probe: Simulation::resumed skips its charge
+*/
+CheckpointWriter *checkpoint_writer = NULL;
+CheckpointReader *checkpoint_reader = NULL;
+unsigned long *checkpoint_probe = NULL; /* square_addr, multiply_addr or sign_addr, NULL once reached */
+unsigned long checkpoint_fingerprint;
+
+unsigned long topology_fingerprint(const Topology &topology){
+    /* What a checkpoint's state depends on, besides the victim: cache shapes, cores and spies */
+    unsigned long hash = checkpoint_mix(CHECKPOINT_VERSION, topology.cores);
+    const LevelConfig *levels[MAX_PRIVATE_LEVELS + 1];
+    for (unsigned int level = 0; level < topology.private_levels; level++) levels[level] = &topology.level[level];
+    levels[topology.private_levels] = &topology.llc;
+    for (unsigned int level = 0; level <= topology.private_levels; level++){
+        hash = checkpoint_mix(hash, levels[level]->size);
+        hash = checkpoint_mix(hash, levels[level]->line_size);
+        hash = checkpoint_mix(hash, levels[level]->miss_penalty);
+        hash = checkpoint_mix(hash, levels[level]->assoc);
+        hash = checkpoint_mix(hash, levels[level]->sharp);
+        hash = checkpoint_mix(hash, levels[level]->policy);
     }
-    cout << endl << endl << "Spy1 evicts everything" << endl;
-    cout << "L2 cache" << endl; l2_cache->print_contents();
-    cout << "L3 cache" << endl; l3_cache->print_contents();
+    hash = checkpoint_mix(hash, topology.split_l1);
+    hash = checkpoint_mix(hash, topology.llc_slices);
+    for (unsigned int bit = 0; bit < floor_log2(topology.llc_slices); bit++) hash = checkpoint_mix(hash, topology.slice_hash[bit]);
+    hash = checkpoint_mix(hash, topology.private_cores);
+    hash = checkpoint_mix(hash, victim_threads);
+    hash = checkpoint_mix(hash, spy_count);
+    hash = checkpoint_mix(hash, shared_l2);
+    hash = checkpoint_mix(hash, spy_probability);
+    return hash;
+}
 
+void reach_checkpoint(){
+    unsigned long event = *checkpoint_probe;
+    checkpoint_probe = NULL;
+    if (checkpoint_writer != NULL){
+        CheckpointHeader *header = &checkpoint_writer->header;
+        header->fingerprint = checkpoint_fingerprint;
+        header->event_addr = event;
+        header->square_addr = square_addr;
+        header->multiply_addr = multiply_addr;
+        header->instructions = simulations[0]->scheduler.clock;
+        simulations[0]->save(checkpoint_writer);
+        if (checkpoint_writer->close())
+            cout << "Saved checkpoint at 0x" << hex << event << dec << " (" << header->instructions << " instructions)" << endl;
+        else
+            cerr << "Could not write the checkpoint" << endl;
+        return;
+    }
 
-    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
-        unsigned long time_to_wait = load(square_addr + LINE_SIZE*set_number_l3*i, 1);
-        if (time_to_wait >= L3_CACHE_MISS_PENALTY){
-            cout << "This should be printed" << endl;
+    CheckpointHeader *header = &checkpoint_reader->header;
+    if (header->fingerprint != checkpoint_fingerprint || header->event_addr != event ||
+        header->square_addr != square_addr || header->multiply_addr != multiply_addr){
+        cerr << "The checkpoint was saved with other caches, spies or probe points" << endl;
+        exit(1);
+    }
+    for (unsigned int n = 0; n < simulation_count; n++){
+        checkpoint_reader->rewind();
+        if (!simulations[n]->restore(checkpoint_reader)){
+            cerr << "The checkpoint is damaged" << endl;
+            exit(1);
         }
     }
-
+    checkpoint_reader->close();
+    cout << "Restored checkpoint at 0x" << hex << event << dec << " (" << header->instructions << " instructions)" << endl;
 }
 
-void test_evict_and_ownership(){
-    /* Test ownership invalidation protocol when a cache line is evicted from the L2 */
-    unsigned long set_number_l2 = 256 * 1024 / LINE_SIZE / L2_ASSOC;
-    unsigned long set_number_l3 = 16384 * 1024 / LINE_SIZE / L3_ASSOC;
+VOID simulate_instances(const AccessRecord *records, UINT64 count, THREADID tid){
+    if (simulation_count == 1) simulations[0]->simulate(records, count);
+    else pool.run(records, count, tid);
+}
 
-    number_cores = 17;
+bool victim_stopped = false; /* trace_replay stops reading the trace */
 
-    l2_cache = new Cache(256, LINE_SIZE, L2_CACHE_MISS_PENALTY, L2_ASSOC, false);
-    l3_cache = new Cache(16384, LINE_SIZE, L3_CACHE_MISS_PENALTY, L3_ASSOC, true); // l3 uses SHARP
+void stop_victim(){
+    /* The key is known well enough, the rest of the victim adds nothing */
+    if (victim_stopped) return;
+    victim_stopped = true;
+    cout << "Stopping the victim, every instance inferred " << key_target << " key bits" << endl;
+#ifndef SHARP_REPLAY
+    PIN_ExitApplication(0);
+#endif
+}
 
-    /* Initially load <L2_ASSOC> blocks from core 0 */
-    for (unsigned int i = 0; i < L2_ASSOC; i++){
-        load(LINE_SIZE*set_number_l2*i, 0);
+VOID simulate_batch(const AccessRecord *records, UINT64 count, THREADID tid){
+    if (checkpoint_probe != NULL){
+        /* The state is saved right before the probe record */
+        UINT64 event = 0;
+        while (event < count && !(records[event].kind == RECORD_PROBE && records[event].ip == *checkpoint_probe))
+            event++;
+        simulate_instances(records, event, tid);
+        if (event == count) return;
+        reach_checkpoint();
+        records += event;
+        count -= event;
     }
+    simulate_instances(records, count, tid);
+    /* A lone instance stops the victim itself, a grid only once the pool is done with the batch */
+    if (key_complete && simulation_count > 1) stop_victim();
+}
 
-    cout << "L2 cache" << endl; l2_cache->print_contents();
-    cout << "L3 cache" << endl; l3_cache->print_contents();
+/*
+    Region of interest. Before -roi_start the victim is fast-forwarded: it runs uninstrumented, or
+        (-warmup functional) only loads its lines and data into the caches, without clocks, noise,
+        spies or stats. From there on it is simulated in detail, until -roi_end if given.
+        In Pin every change of phase drops the instrumentation, so each phase pays only for its own
+*/
+enum RoiPhase {
+    PHASE_FORWARD,
+    PHASE_DETAIL,
+    PHASE_DONE
+};
+
+int phase = PHASE_DETAIL;
+bool functional_warmup = true;
+unsigned long roi_start_addr = 0, roi_end_addr = 0; /* Routine entries, 0 if none */
+string roi_start_symbol, roi_end_symbol;
+unsigned long roi_start_count = 0, roi_end_count = 0; /* Victim instructions, 0 if none */
+unsigned long forward_instructions = 0, roi_instructions = 0; /* Summed by every victim thread */
+
+VOID warm_load(unsigned long addr, THREADID tid, AccessKind kind){
+    for (unsigned int n = 0; n < simulation_count; n++){
+        Simulation *sim = simulations[n];
+        sim->warm(addr, sim->thread_state(tid)->core, kind);
+    }
+}
+
+VOID warm_block(unsigned long first_line, UINT32 lines, THREADID tid){
+    unsigned long line_size = simulations[0]->hierarchy->slices[0]->line_size;
+    for (UINT32 line = 0; line < lines; line++){
+        warm_load(first_line + line * line_size, tid, ACCESS_FETCH);
+    }
+}
+
+VOID warm_data(unsigned long addr, THREADID tid){
+    warm_load(addr, tid, ACCESS_DATA);
+}
 
-    /* Now, there is a set where all the ways are filled. Load one more address */
-    load(LINE_SIZE*set_number_l2*L2_ASSOC, 0);
+ADDRINT forward_count(UINT32 instructions){
+    /* Blocks that would run past -roi_start instructions are already simulated in detail */
+    return __sync_add_and_fetch(&forward_instructions, instructions) > roi_start_count;
+}
+
+ADDRINT roi_count(UINT32 instructions){
+    return __sync_add_and_fetch(&roi_instructions, instructions) > roi_end_count;
+}
 
-    /* The entry of the block that was evicted from the L3 cache should be owned by no one now */
-    cout << "L2 cache" << endl; l2_cache->print_contents();
-    cout << "L3 cache" << endl; l3_cache->print_contents();
-    cout << "Ownership test finished. Testing eviction from inclusivity ... " << endl;
-    srand(12); /* Made on purpose so the core 16th evicts the address at set 4096 and way 0 */
-    /* Now, using 16 attackers, evict the added block from the L3 cache */
-    unsigned long address_to_invalidate = LINE_SIZE*set_number_l2*L2_ASSOC;
-    for (int core = 1; core < 17; core++){
-        load(address_to_invalidate + LINE_SIZE*set_number_l3*L3_ASSOC*core, core);
-        cout << "L3 cache" << endl; l3_cache->print_contents();
+void start_roi(THREADID tid){
+    if (checkpoint_reader != NULL){
+        reach_checkpoint();
+        for (unsigned int n = 0; n < simulation_count; n++) simulations[n]->resumed_thread = tid;
     }
+    else if (functional_warmup){
+        /* Keep what the warm-up loaded, not what it counted */
+        for (unsigned int n = 0; n < simulation_count; n++) simulations[n]->reset_stats();
+    }
+    cout << "Region of interest starts" << endl;
+}
 
-    /* L2 cache should now have that block invalidated */
-    cout << "L2 cache" << endl; l2_cache->print_contents();
+void end_roi(){
+    cout << "Region of interest ends after " << simulations[0]->scheduler.clock << " instructions" << endl;
+}
 
+bool parse_roi(const string &arg, unsigned long *count, string *symbol){
+    /* A number of victim instructions, or the name of a victim routine (its first call) */
+    *count = 0;
+    symbol->clear();
+    if (arg.empty()) return true;
+    char *end;
+    unsigned long n = strtoul(arg.c_str(), &end, 10);
+    if (*end == '\0'){
+        *count = n;
+        return n > 0;
+    }
+    if (isdigit(arg[0])) return false;
+    *symbol = arg;
+    return true;
+}
 
+/* Cache geometry knobs. Shapes listed in FIXED_GEOMETRIES run on a specialized implementation */
+KNOB<unsigned int> KnobLineSize(KNOB_MODE_WRITEONCE, "pintool", "line_size", "64", "cache line size in bytes");
+KNOB<bool> KnobL1(KNOB_MODE_WRITEONCE, "pintool", "l1", "0", "model private L1 instruction and data caches in front of the L2 (0: the L2 is the first level, the attacks' model)");
+KNOB<unsigned int> KnobL1Size(KNOB_MODE_WRITEONCE, "pintool", "l1_size", "32", "size of each L1 (instruction and data) in KB");
+KNOB<unsigned int> KnobL1Assoc(KNOB_MODE_WRITEONCE, "pintool", "l1_assoc", "8", "L1 associativity");
+KNOB<unsigned int> KnobL2Size(KNOB_MODE_WRITEONCE, "pintool", "l2_size", "256", "L2 size in KB");
+KNOB<unsigned int> KnobL2Assoc(KNOB_MODE_WRITEONCE, "pintool", "l2_assoc", "4", "L2 associativity");
+KNOB<string> KnobL2Policy(KNOB_MODE_WRITEONCE, "pintool", "l2_policy", "lru", "L2 replacement policy: lru, plru or srrip");
+KNOB<unsigned int> KnobL3Size(KNOB_MODE_WRITEONCE, "pintool", "l3_size", "16384", "L3 size in KB");
+KNOB<unsigned int> KnobL3Assoc(KNOB_MODE_WRITEONCE, "pintool", "l3_assoc", "16", "L3 associativity");
+KNOB<string> KnobL3Policy(KNOB_MODE_WRITEONCE, "pintool", "l3_policy", "lru", "L3 replacement policy: lru, plru or srrip");
+KNOB<unsigned int> KnobL3Slices(KNOB_MODE_WRITEONCE, "pintool", "l3_slices", "1", "number of L3 slices, a power of two");
+KNOB<string> KnobL3SliceHash(KNOB_MODE_WRITEONCE, "pintool", "l3_slice_hash", "", "comma separated hex address masks, one per slice number bit (default: 8-slice Intel hash)");
+KNOB<bool> KnobL3Sharp(KNOB_MODE_WRITEONCE, "pintool", "l3_sharp", "1", "use SHARP replacement in the L3");
+KNOB<bool> KnobSpyL2(KNOB_MODE_WRITEONCE, "pintool", "spy_l2", "0", "give spies on other cores a private L2 like the victim's (0: they access the L3 directly, the attacks' model)");
+KNOB<unsigned int> KnobVictimThreads(KNOB_MODE_WRITEONCE, "pintool", "victim_threads", "1", "victim threads simulated on their own core, later threads share them");
+KNOB<unsigned long> KnobSeed(KNOB_MODE_WRITEONCE, "pintool", "seed", "1", "seed of every random stream (evictions, noise), independent of the noise level");
+#ifndef SHARP_REPLAY
+KNOB<string> KnobInstrument(KNOB_MODE_WRITEONCE, "pintool", "instrument", "bbl", "analysis granularity: bbl (one call per basic block), ins (one per instruction) or buffer (records simulated in batches)");
+KNOB<string> KnobSquare(KNOB_MODE_WRITEONCE, "pintool", "square", "square", "victim routine (or 0x instruction address) the spies take as the start of an iteration");
+KNOB<string> KnobMultiply(KNOB_MODE_WRITEONCE, "pintool", "multiply", "multiply", "victim routine (or 0x instruction address) whose call means an exponent bit of 1");
+KNOB<string> KnobSignSymbol(KNOB_MODE_WRITEONCE, "pintool", "sign_symbol", "sign", "victim routine whose entry is reported as the start of signing (empty: none)");
+KNOB<string> KnobRecord(KNOB_MODE_WRITEONCE, "pintool", "record", "", "write the victim's accesses to this trace file for trace_replay instead of simulating them");
+#endif
+KNOB<unsigned int> KnobWait(KNOB_MODE_WRITEONCE, "pintool", "wait", "0", "wait time of the spies between probes, in victim instructions");
+KNOB<unsigned int> KnobNoise(KNOB_MODE_WRITEONCE, "pintool", "noise", "0", "cache noise: load latencies vary by up to half of it either way, in cycles");
+KNOB<string> KnobLookup(KNOB_MODE_WRITEONCE, "pintool", "lookup", "auto", "set lookup kernel: auto, avx2, sse2 or scalar");
+KNOB<string> KnobNoiseGrid(KNOB_MODE_WRITEONCE, "pintool", "noise_grid", "", "comma separated cache noise levels, one instance each (default: -noise)");
+KNOB<string> KnobWaitGrid(KNOB_MODE_WRITEONCE, "pintool", "wait_grid", "", "comma separated wait times, crossed with -noise_grid (default: -wait)");
+KNOB<string> KnobSaveCheckpoint(KNOB_MODE_WRITEONCE, "pintool", "save_checkpoint", "", "write the simulator state to this file when the victim reaches -checkpoint_at");
+KNOB<string> KnobRestoreCheckpoint(KNOB_MODE_WRITEONCE, "pintool", "restore_checkpoint", "", "skip the victim up to -checkpoint_at and continue from the state saved in this file");
+KNOB<string> KnobCheckpointAt(KNOB_MODE_WRITEONCE, "pintool", "checkpoint_at", "sign", "probe where checkpoints are saved and restored: square, multiply or sign (first time reached)");
+KNOB<string> KnobRoiStart(KNOB_MODE_WRITEONCE, "pintool", "roi_start", "", "routine whose first call starts detailed simulation, or a number of victim instructions to fast-forward (default: none)");
+KNOB<string> KnobRoiEnd(KNOB_MODE_WRITEONCE, "pintool", "roi_end", "", "routine whose first call ends detailed simulation, or a number of instructions to simulate in detail (default: none)");
+KNOB<string> KnobWarmup(KNOB_MODE_WRITEONCE, "pintool", "warmup", "functional", "fast-forward before -roi_start: functional (cache contents only) or none (uninstrumented)");
+KNOB<string> KnobKeyState(KNOB_MODE_WRITEONCE, "pintool", "key_state", "", "file of per-bit key estimates: this run starts from them and adds its own at exit");
+KNOB<unsigned int> KnobKeyBits(KNOB_MODE_WRITEONCE, "pintool", "key_bits", "0", "length of the victim's key: once -key_known percent of it is known the victim is stopped (0: never). One run observes each bit once: unless -key_accuracy reaches -key_confidence, the rest comes from earlier runs in -key_state");
+KNOB<unsigned int> KnobKeyKnown(KNOB_MODE_WRITEONCE, "pintool", "key_known", "100", "percentage of -key_bits to know before stopping the victim");
+KNOB<unsigned int> KnobKeyAccuracy(KNOB_MODE_WRITEONCE, "pintool", "key_accuracy", "80", "percentage of spy observations assumed right, the weight of each one");
+KNOB<unsigned int> KnobKeyConfidence(KNOB_MODE_WRITEONCE, "pintool", "key_confidence", "99", "posterior percentage at which a key bit counts as known");
+KNOB<string> KnobEventLog(KNOB_MODE_WRITEONCE, "pintool", "event_log", "", "write spy and victim events to this binary log instead of printing them, see event_decode (default: none)");
+KNOB<unsigned int> KnobEventLevel(KNOB_MODE_WRITEONCE, "pintool", "event_level", "3", "events logged: 1 leaked bits and alarms, 2 also victim calls, 3 also every spy probe");
+KNOB<unsigned int> KnobEventRing(KNOB_MODE_WRITEONCE, "pintool", "event_ring", "65536", "events the ring holds until the writer drains them, a power of two");
+KNOB<string> KnobMetrics(KNOB_MODE_WRITEONCE, "pintool", "metrics", "", "count per core and per set, write <prefix>.csv (per epoch), <prefix>.json and <prefix>.sets.csv (default: none)");
+KNOB<unsigned long> KnobMetricsEpoch(KNOB_MODE_WRITEONCE, "pintool", "metrics_epoch", "1000000", "victim instructions per epoch of the -metrics series (alarms, target set occupancy)");
+KNOB<string> KnobStackDistance(KNOB_MODE_WRITEONCE, "pintool", "stack_distance", "", "profile the victim's LRU stack distances, write <prefix>.csv (miss curves) and <prefix>.reuse.csv (square and multiply) (default: none)");
+KNOB<unsigned long> KnobStackSets(KNOB_MODE_WRITEONCE, "pintool", "stack_sets", "16384", "-stack_distance: largest set count profiled, a power of two (every smaller one too)");
+KNOB<unsigned int> KnobStackWays(KNOB_MODE_WRITEONCE, "pintool", "stack_ways", "32", "-stack_distance: miss curves go up to this associativity");
+KNOB<unsigned int> KnobWorkers(KNOB_MODE_WRITEONCE, "pintool", "workers", "0", "threads simulating the instances of a grid (0: one per host cpu, at most one per instance)");
+KNOB<unsigned int> KnobShards(KNOB_MODE_WRITEONCE, "pintool", "shards", "1", "split the sets of every cache among this many worker threads, a power of two (1: the victim thread simulates them). SHARP's random step 3 victims then differ from an unsharded run");
+
+/* Analysis routines of the unbuffered modes, a lone instance only (a grid always goes through batches) */
+VOID probe_point(unsigned long ip){
+    if (checkpoint_probe != NULL && ip == *checkpoint_probe) reach_checkpoint();
+    simulations[0]->probe_point(ip);
+}
 
+VOID instr_cache_load(unsigned long ip, THREADID tid){
+    simulations[0]->instr_cache_load(ip, tid);
+}
 
+VOID block_cache_load(unsigned long first_line, UINT32 lines, UINT32 instructions, THREADID tid){
+    simulations[0]->block_cache_load(first_line, lines, instructions, tid);
 }
-void test_sharp(){
-    /* Test our SHARK implementation */
-    unsigned long set_number_l3 = 16384 * 1024 / LINE_SIZE / L3_ASSOC;
-    number_cores = 3;
 
-    l2_cache = new Cache(256, LINE_SIZE, L2_CACHE_MISS_PENALTY, L2_ASSOC, false);
-    l3_cache = new Cache(16384, LINE_SIZE, L3_CACHE_MISS_PENALTY, L3_ASSOC, true); // l3 uses SHARP
+VOID block_spies(THREADID tid){
+    simulations[0]->block_spies(tid);
+}
+
+VOID data_cache_load(unsigned long addr, THREADID tid){
+    simulations[0]->data_cache_load(addr, tid);
+}
+
+#ifndef SHARP_REPLAY
+/*
+    -record: the analysis routines below replace the simulator's, with the same arguments.
+        The victim's stream does not depend on the caches or the spies, so it is written once
+        and trace_replay runs it through any configuration later
+*/
+TraceWriter *recorder = NULL;
+PIN_LOCK record_lock; /* Victim threads write in turns */
+
+VOID record_block(unsigned long first_line, UINT32 lines, UINT32 instructions, THREADID tid){
+    if (victim_threads > 1) PIN_GetLock(&record_lock, tid + 1);
+    recorder->block(first_line, lines, instructions, tid);
+    if (victim_threads > 1) PIN_ReleaseLock(&record_lock);
+}
+
+VOID record_fetch(unsigned long ip, THREADID tid){
+    record_block(ip, 1, 1, tid);
+}
+
+VOID record_read(unsigned long addr, THREADID tid){
+    if (victim_threads > 1) PIN_GetLock(&record_lock, tid + 1);
+    recorder->access(TRACE_READ, addr, tid);
+    if (victim_threads > 1) PIN_ReleaseLock(&record_lock);
+}
+
+VOID record_write(unsigned long addr, THREADID tid){
+    if (victim_threads > 1) PIN_GetLock(&record_lock, tid + 1);
+    recorder->access(TRACE_WRITE, addr, tid);
+    if (victim_threads > 1) PIN_ReleaseLock(&record_lock);
+}
+
+VOID record_probe(unsigned long ip, THREADID tid){
+    if (victim_threads > 1) PIN_GetLock(&record_lock, tid + 1);
+    recorder->probe(ip, tid);
+    if (victim_threads > 1) PIN_ReleaseLock(&record_lock);
+}
+
+/*
+    -instrument buffer: the victim only appends records to a per-thread Pin trace buffer,
+        and the simulator replays them in order when the buffer fills (or the thread exits).
+        Probe points are records too, so they keep their place among the accesses
+*/
+#define BUFFER_PAGES 64
+
+bool buffered = false;
+BUFFER_ID record_buffer;
+
+VOID *simulate_records(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf, UINT64 count, VOID *v){
+    simulate_batch((const AccessRecord *) buf, count, tid);
+    return buf; /* Reuse the same buffer */
+}
 
-    /* Initially load <L3_ASSOC> blocks from core 0 */
-    for (unsigned int i = 0; i < L3_ASSOC; i++){
-        load(LINE_SIZE*set_number_l3*i, 0);
+VOID *record_records(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf, UINT64 count, VOID *v){
+    /* -record with -instrument buffer: the records go to the trace file instead of the simulator */
+    const AccessRecord *records = (const AccessRecord *) buf;
+    for (UINT64 i = 0; i < count; i++){
+        const AccessRecord *record = &records[i];
+        switch (record->kind){
+            case RECORD_BLOCK: record_block(record->ea, record->arg, record->count, record->thread); break;
+            case RECORD_READ: record_read(record->ea, record->thread); break;
+            case RECORD_WRITE: record_write(record->ea, record->thread); break;
+            case RECORD_PROBE: record_probe(record->ip, record->thread); break;
+        }
     }
+    return buf;
+}
 
-    cout << "About to load from core 1" << endl;
-    /* Load 1 block from core 1 */
-    load(LINE_SIZE*set_number_l3*L3_ASSOC, 1);
-    cout << "Loaded" << endl;
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v){
+    if (tid >= victim_threads){
+        cerr << "Victim thread " << tid << " shares core " << simulations[0]->thread_state(tid)->core << ", raise -victim_threads to give it its own" << endl;
+    }
+}
 
-    /* L3 cache should have <L3_ASSOC>-1 blocks from core0 and 1 block from core1 */
-    cout << "L3 cache" << endl; l3_cache->print_contents();
+void instrument_access(INS ins, UINT32 memOp, RecordKind kind){
+    if (buffered){
+        INS_InsertFillBufferPredicated(ins, IPOINT_BEFORE, record_buffer,
+                                       IARG_INST_PTR, offsetof(AccessRecord, ip),
+                                       IARG_MEMORYOP_EA, memOp, offsetof(AccessRecord, ea),
+                                       IARG_THREAD_ID, offsetof(AccessRecord, thread),
+                                       IARG_UINT32, kind, offsetof(AccessRecord, kind),
+                                       IARG_END);
+    }
+    else{
+        AFUNPTR routine = (AFUNPTR) data_cache_load;
+        if (recorder != NULL) routine = kind == RECORD_WRITE ? (AFUNPTR) record_write : (AFUNPTR) record_read;
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE,  routine,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_THREAD_ID,
+            IARG_END);
+    }
+}
 
-    /* After loading one more block from core 1, the L3 cache should have the same format as before */
-    load(LINE_SIZE*set_number_l3*(L3_ASSOC+1), 1);
-    cout << "L3 cache" << endl; l3_cache->print_contents();
+VOID enter_roi(CONTEXT *ctxt, THREADID tid){
+    /* Runs again when the instruction is re-executed, and may race with other victim threads */
+    if (!__sync_bool_compare_and_swap(&phase, PHASE_FORWARD, PHASE_DETAIL)) return;
+    start_roi(tid);
+    PIN_RemoveInstrumentation();
+    PIN_ExecuteAt(ctxt); /* The current instruction again, instrumented for detail */
+}
 
-    /* After loading one block from core 2, the L3 cache should now evict randomly one block */
-    load(LINE_SIZE*set_number_l3*(L3_ASSOC+2), 2);
-    cout << "L3 cache" << endl; l3_cache->print_contents();
+VOID leave_roi(CONTEXT *ctxt){
+    if (!__sync_bool_compare_and_swap(&phase, PHASE_DETAIL, PHASE_DONE)) return;
+    end_roi(); /* Records still buffered come before the end, they are simulated when flushed */
+    PIN_RemoveInstrumentation();
+    PIN_ExecuteAt(ctxt);
 }
 
-void test_caches(){
-    /* Test new changes to Caches,
-         considering associativity could be larger than 2, 
-         and we now load from multiple caches
+void instrument_forward(INS ins, bool block_head, unsigned long first_line, UINT32 lines, UINT32 instructions){
+    /*
+        Fast-forward: <ins> only watches for -roi_start, and with -warmup functional loads its data.
+            A <block_head> stands for the <instructions> of its block and fetches its <lines>
     */
-    unsigned long set_number_l2 = 256 * 1024 / LINE_SIZE / L2_ASSOC;
-    number_cores = 4;
+    if (INS_Address(ins) == roi_start_addr){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) enter_roi, IARG_CONTEXT, IARG_THREAD_ID, IARG_END);
+    }
+    if (block_head && roi_start_count > 0){
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR) forward_count, IARG_UINT32, instructions, IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR) enter_roi, IARG_CONTEXT, IARG_THREAD_ID, IARG_END);
+    }
+    if (!functional_warmup) return;
+    if (block_head){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) warm_block, IARG_UINT64, first_line, IARG_UINT32, lines, IARG_THREAD_ID, IARG_END);
+    }
+    for (UINT32 memOp = 0; memOp < INS_MemoryOperandCount(ins); memOp++){
+        INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) warm_data, IARG_MEMORYOP_EA, memOp, IARG_THREAD_ID, IARG_END);
+    }
+}
 
-    l2_cache = new Cache(256, LINE_SIZE, L2_CACHE_MISS_PENALTY, L2_ASSOC, false);
-    l3_cache = new Cache(16384, LINE_SIZE, L3_CACHE_MISS_PENALTY, L3_ASSOC, true); // l3 uses SHARP
+void instrument_roi_end(INS ins, bool block_head, UINT32 instructions){
+    /* Before any other call of <ins>, the region may end right there */
+    if (INS_Address(ins) == roi_end_addr){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) leave_roi, IARG_CONTEXT, IARG_END);
+    }
+    if (block_head && roi_end_count > 0){
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR) roi_count, IARG_UINT32, instructions, IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR) leave_roi, IARG_CONTEXT, IARG_END);
+    }
+}
 
-    load(0, 0);
-    load(LINE_SIZE*set_number_l2, 0);
-    load(LINE_SIZE*set_number_l2*2, 0);
-    load(LINE_SIZE*set_number_l2*3, 0);
-    load(LINE_SIZE*set_number_l2*4, 0);
-    load(LINE_SIZE*set_number_l2*5, 0);
-    load(LINE_SIZE*set_number_l2*6, 0);
-    load(LINE_SIZE*set_number_l2*7, 0);
+VOID instrument_probe(INS ins){
+    /* Only the probed instructions get a call, no other instruction pays for a comparison */
+    ADDRINT addr = INS_Address(ins);
+    if (addr != square_addr && addr != multiply_addr && addr != sign_addr) return;
+    if (buffered){
+        INS_InsertFillBuffer(ins, IPOINT_BEFORE, record_buffer,
+                             IARG_UINT64, addr, offsetof(AccessRecord, ip),
+                             IARG_THREAD_ID, offsetof(AccessRecord, thread),
+                             IARG_UINT32, RECORD_PROBE, offsetof(AccessRecord, kind),
+                             IARG_END);
+    }
+    else if (recorder != NULL){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) record_probe, IARG_UINT64, addr, IARG_THREAD_ID, IARG_END);
+    }
+    else{
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) probe_point, IARG_UINT64, addr, IARG_END);
+    }
+}
+
+void instrument_memory(INS ins){
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
 
-    cout << "Loaded 4 colliding addresses" << endl;
-    cout << "L2 cache" << endl; l2_cache->print_contents();
-    cout << "L3 cache" << endl; l3_cache->print_contents();
+    /* Service the first and second read first */
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++){
+        if (INS_MemoryOperandIsRead(ins, memOp)){
+            instrument_access(ins, memOp, RECORD_READ);
+        }
+    }
+
+    /* And then the write */
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++){
+        if (INS_MemoryOperandIsWritten(ins, memOp)){
+            instrument_access(ins, memOp, RECORD_WRITE);
+        }
+    }
 }
 
-int main(int argc, char **argv)
+VOID Instruction(INS ins, VOID *v)
 {
-    /* Finish comment in this line for testing
-    test_second_atk_simplified();
-    return 0;
-    
-    test_evict_and_ownership();
-    test_sharp();
-    test_caches();
-    return 0;
-    // */
+    /* -instrument ins: every instruction calls into the simulator */
+    ADDRINT ip = INS_Address(ins);
+
+    if (phase == PHASE_FORWARD){
+        unsigned long line_size = simulations[0]->hierarchy->slices[0]->line_size;
+        instrument_forward(ins, true, ip & ~(line_size - 1), 1, 1);
+        return;
+    }
+    if (phase == PHASE_DONE) return;
+    instrument_roi_end(ins, true, 1);
+
+    // All instructions cause a load in Icache
+    AFUNPTR routine = recorder != NULL ? (AFUNPTR) record_fetch : (AFUNPTR) instr_cache_load;
+    INS_InsertPredicatedCall(ins, IPOINT_BEFORE, routine, IARG_UINT64, ip, IARG_THREAD_ID, IARG_END);
+
+    instrument_probe(ins);
+    instrument_memory(ins);
+}
+
+VOID Trace(TRACE trace, VOID *v)
+{
+    /*
+        -instrument bbl: one call per basic block charges its time and fetches its lines, and one on its tail
+            runs the spies due once the block's data accesses are simulated. Only memory operands and
+            probe points keep per-instruction calls
+        -instrument buffer: the same work, appended as records instead of calls. A block's spies run
+            at the next block record
+    */
+    unsigned long line_size = simulations[0]->hierarchy->slices[0]->line_size; /* Same in every instance */
+    if (phase == PHASE_DONE) return;
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+        INS head = BBL_InsHead(bbl);
+        INS tail = BBL_InsTail(bbl);
+        unsigned long first_line = BBL_Address(bbl) & ~(line_size - 1);
+        unsigned long last_line = (INS_Address(tail) + INS_Size(tail) - 1) & ~(line_size - 1);
+        UINT32 lines = (last_line - first_line) / line_size + 1;
+
+        if (phase == PHASE_FORWARD){
+            for (INS ins = head; INS_Valid(ins); ins = INS_Next(ins)){
+                instrument_forward(ins, ins == head, first_line, lines, BBL_NumIns(bbl));
+            }
+            continue;
+        }
+        instrument_roi_end(head, true, BBL_NumIns(bbl));
+
+        if (buffered){
+            INS_InsertFillBuffer(head, IPOINT_BEFORE, record_buffer,
+                                 IARG_UINT64, first_line, offsetof(AccessRecord, ea),
+                                 IARG_UINT32, lines, offsetof(AccessRecord, arg),
+                                 IARG_UINT32, BBL_NumIns(bbl), offsetof(AccessRecord, count),
+                                 IARG_THREAD_ID, offsetof(AccessRecord, thread),
+                                 IARG_UINT32, RECORD_BLOCK, offsetof(AccessRecord, kind),
+                                 IARG_END);
+        }
+        else{
+            BBL_InsertCall(bbl, IPOINT_BEFORE, recorder != NULL ? (AFUNPTR) record_block : (AFUNPTR) block_cache_load,
+                           IARG_UINT64, first_line,
+                           IARG_UINT32, lines,
+                           IARG_UINT32, BBL_NumIns(bbl),
+                           IARG_THREAD_ID,
+                           IARG_END);
+        }
+
+        for (INS ins = head; INS_Valid(ins); ins = INS_Next(ins)){
+            if (ins != head) instrument_roi_end(ins, false, 0);
+            instrument_probe(ins);
+            instrument_memory(ins);
+        }
+        if (!buffered && recorder == NULL){
+            /* After the tail's memory operands: calls at one point run in the order they were inserted */
+            INS_InsertCall(tail, IPOINT_BEFORE, (AFUNPTR) block_spies, IARG_THREAD_ID, IARG_END);
+        }
+    }
+}
+
+bool parse_probe(const char *arg, unsigned long *addr, string *symbol){
+    /* "0x..." is an instruction address, anything else the name of a victim routine (its entry point) */
+    if (arg[0] == '\0') return false;
+    symbol->clear();
+    *addr = 0;
+    if (strncmp(arg, "0x", 2) != 0){
+        *symbol = arg;
+        return true;
+    }
+    char *end;
+    *addr = strtoul(arg, &end, 16);
+    return *end == '\0';
+}
+
+bool resolve_probe(IMG img, const string &symbol, unsigned long *addr){
+    if (symbol.empty()) return true;
+    RTN rtn = RTN_FindByName(img, symbol.c_str());
+    if (!RTN_Valid(rtn)) return false;
+    *addr = RTN_Address(rtn);
+    return true;
+}
+
+VOID ImageLoad(IMG img, VOID *v){
+    if (IMG_IsMainExecutable(img)){
+        if (!resolve_probe(img, square_symbol, &square_addr) || !resolve_probe(img, multiply_symbol, &multiply_addr)){
+            cerr << "Could not find " << square_symbol << " or " << multiply_symbol << " in " << IMG_Name(img) << endl;
+            exit(1);
+        }
+        if (!resolve_probe(img, KnobSignSymbol.Value(), &sign_addr)){
+            cerr << "No routine " << KnobSignSymbol.Value() << " in " << IMG_Name(img) << ", signing start is not reported" << endl;
+        }
+        cout << hex << "Probes: square 0x" << square_addr << ", multiply 0x" << multiply_addr << ", sign 0x" << sign_addr << dec << endl;
+        if (!resolve_probe(img, roi_start_symbol, &roi_start_addr) || !resolve_probe(img, roi_end_symbol, &roi_end_addr)){
+            cerr << "Could not find " << roi_start_symbol << " or " << roi_end_symbol << " in " << IMG_Name(img) << endl;
+            exit(1);
+        }
+        if (checkpoint_reader != NULL) roi_start_addr = *checkpoint_probe;
+
+        /* Every rebuild of the victim moves the routines, the eviction sets follow them */
+        for (unsigned int n = 0; n < simulation_count; n++){
+            for (int i = 0; i < spy_count; i++){
+                simulations[n]->spies[i]->aim();
+            }
+        }
+        if (simulations[0]->stack != NULL) simulations[0]->stack->aim(square_addr, multiply_addr);
+    }
+}
+#else
+bool resolve_trace_probe(const string &symbol, unsigned long *addr){
+    if (symbol.empty()) return true;
+    if (symbol == "square") *addr = square_addr;
+    else if (symbol == "multiply") *addr = multiply_addr;
+    else if (symbol == "sign") *addr = sign_addr;
+    else return false;
+    return *addr != 0;
+}
 
+#define REPLAY_BATCH 4096 /* Records per batch, about what a Pin trace buffer of BUFFER_PAGES holds */
+
+bool forward_record(const TraceRecord *record){
+    /* A record before -roi_start, true if the region of interest starts with it */
+    bool start = false;
+    switch (record->kind){
+        case TRACE_PROBE:
+            start = record->addr == roi_start_addr;
+            break;
+        case TRACE_BLOCK:
+            start = roi_start_count > 0 && forward_count(record->instructions);
+            if (!start && functional_warmup) warm_block(record->addr, record->lines, record->thread);
+            break;
+        default:
+            if (functional_warmup) warm_data(record->addr, record->thread);
+            break;
+    }
+    if (start){
+        phase = PHASE_DETAIL;
+        start_roi(record->thread);
+    }
+    return start;
+}
+
+bool replay_trace(TraceReader *trace){
+    /* trace_replay: the recorded stream goes through the simulator in batches, like Pin's trace buffers */
+    static AccessRecord batch[REPLAY_BATCH];
+    UINT64 count = 0;
+    TraceRecord record, block;
+    block.kind = TRACE_THREAD; /* No block forwarded yet */
+    while (!victim_stopped && trace->next(&record)){
+        if (phase == PHASE_FORWARD){
+            if (record.kind == TRACE_BLOCK) block = record;
+            if (!forward_record(&record)) continue;
+            if (checkpoint_reader != NULL && block.kind == TRACE_BLOCK){
+                /* As Pin resumes a restored victim: the block holding the probe runs again from it */
+                AccessRecord *again = &batch[count++];
+                again->thread = record.thread;
+                again->kind = RECORD_BLOCK;
+                again->ea = block.addr;
+                again->arg = block.lines;
+                again->count = block.instructions;
+            }
+        }
+        if ((record.kind == TRACE_PROBE && record.addr == roi_end_addr) ||
+            (record.kind == TRACE_BLOCK && roi_end_count > 0 && roi_count(record.instructions))){
+            phase = PHASE_DONE;
+            break;
+        }
+        AccessRecord *next = &batch[count];
+        next->thread = record.thread;
+        switch (record.kind){
+            case TRACE_BLOCK:
+                next->kind = RECORD_BLOCK;
+                next->ea = record.addr;
+                next->arg = record.lines;
+                next->count = record.instructions;
+                break;
+            case TRACE_READ: next->kind = RECORD_READ; next->ea = record.addr; break;
+            case TRACE_WRITE: next->kind = RECORD_WRITE; next->ea = record.addr; break;
+            case TRACE_PROBE: next->kind = RECORD_PROBE; next->ip = record.addr; break;
+            default: continue;
+        }
+        if (++count == REPLAY_BATCH){
+            simulate_batch(batch, count, 0);
+            count = 0;
+        }
+    }
+    simulate_batch(batch, count, 0);
+    if (phase == PHASE_DONE) end_roi();
+    return !trace->corrupt;
+}
+#endif
+
+void Simulation::print_combined_key () {
+    /* Computing the private key using information gathered 
+        by all the spies AFTER the victim finishes executing.
+            We do not need communication between spies during execution */
+
+    *out << "Computing combined key..." << endl;
+    if (multi_spy) {
+        // combine hits from spies
+        vector<int> combined_key;
+        bool prev_all = true;
+        bool first = false;
+        int knowns=0;
+        /* Only the rounds every spy probed, as in leaked */
+        unsigned long rounds = spies[0]->hits.size();
+        for (int s = 1; s < spy_count; s++) rounds = min(rounds, (unsigned long) spies[s]->hits.size());
+        for (unsigned int i = 0; i < rounds; i++) {
+            int cnt = 0;
+            int out = -1;
+            for (int s = 0; s < spy_count; s++) {
+                if (spies[s]->hits[i]) cnt++;
+            }
+            // all hits means no exponent
+            if (cnt == spy_count) out = 0;
+            // previous all hits and now miss means exponent used
+            else if (prev_all && cnt < spy_count) out = 1;
+            // miss on last spy means exponent used
+            // ordered spy attack
+	    //else if (i%2==0 && !spies[0]->hits[i]) out = 1;
+            //else if (i%2==1 && !spies[spy_count-1]->hits[i]) out = 1;
+            prev_all = (cnt == spy_count);
+            if (first || out == 1) first = true;
+            if (first) combined_key.push_back (out);
+        }
+        *out << "Combined Key: ";
+        for (unsigned int i = 0; i < combined_key.size(); i++) 
+          {if (combined_key[i]==-1) *out << "?";
+           else {knowns++;*out << combined_key[i];}}
+        *out << endl;
+        *out << "Percentage found: " << 100 * (float) knowns / combined_key.size() << endl;
+    }
+    else{
+        *out << "Key: ";
+        /*for (unsigned int i = 4; i < spies[1]->hits.size() - 2; i+= 2){
+            if (spies[1]->hits[i] && !spies[1]->hits[i+1])
+                *out << "1";
+            else if ((spies[1]->hits[i+1])){
+                *out << "?";
+                i -= 1;
+            }
+            else
+                *out << "0";
+        }
+        *out << "1" << endl;
+        */
+
+        for (unsigned int i = 0; i < spies[1]->hits.size(); i+= 1){
+            if (spies[1]->hits[i])
+                *out << "1";
+            else{
+                *out << "0";
+            }
+        }
+        *out << endl;
+    }
+}
+
+void Simulation::print_stats(){
+    *out << "Overall stats: " << endl;
+    for (unsigned int t = 0; t < victim_threads; t++){
+        if (victim_threads > 1) *out << "Timestamp of thread " << t << " (core " << threads[t].core << "):" << threads[t].timestamp << endl;
+        else *out << "Timestamp:" << threads[t].timestamp << endl;
+    }
+    for (unsigned int i = 0; i < hierarchy->cores; i++){
+        unsigned long alarms = 0;
+        for (unsigned int slice = 0; slice < hierarchy->slice_count; slice++){
+            alarms += sharded != NULL ? sharded->alarms(slice, i) : hierarchy->slices[slice]->alarm_counter[i];
+        }
+        *out << "Alarm for core " << i << ": " << alarms << endl;
+    }
+
+    if (sharded != NULL){
+        /* Each shard filters repeats of the last line it saw, so the count differs from an unsharded run */
+        *out << "L3 overall misses: " << sharded->llc_misses() << " and accesses: " << sharded->llc_accesses() << endl;
+        *out << "Accesses answered by the L1 last line: " << sharded->filtered_accesses() << " (" << shard_count << " shards)" << endl;
+    }
+    else{
+        *out << "L3 overall misses: " << hierarchy->llc_misses() << " and accesses: " << hierarchy->llc_accesses() << endl;
+        *out << "Accesses answered by the L1 last line: " << hierarchy->filtered_accesses() << endl;
+    }
+
+    print_combined_key();
+    *out << "Inferred key: ";
+    for (unsigned long bit = 0; bit < key.log_odds.size(); bit++) *out << key.bit_char(bit);
+    *out << endl << "Known bits: " << key.known << " of " << key.log_odds.size() << " at " << key_confidence << "% confidence" << endl;
+    if (out != &cout){
+        cout << report.str();
+        report.str("");
+    }
+}
+
+string metrics_prefix(unsigned int n){
+    /* Files of instance <n>: a grid numbers them */
+    if (simulation_count == 1) return KnobMetrics.Value();
+    stringstream prefix;
+    prefix << KnobMetrics.Value() << "." << n;
+    return prefix.str();
+}
+
+#ifndef SHARP_REPLAY
+VOID PrepareForFini(VOID *v){
+    /* Pin wants internal threads gone before Fini, later buffer flushes simulate inline */
+    pool.stop();
+    stop_shards();
+    stop_event_writer();
+}
+#endif
+
+VOID Fini(INT32 code, VOID *v)
+{
+#ifndef SHARP_REPLAY
+    if (recorder != NULL){
+        recorder->header.square_addr = square_addr;
+        recorder->header.multiply_addr = multiply_addr;
+        recorder->header.sign_addr = sign_addr;
+        if (!recorder->close()){
+            cerr << "Could not write the trace " << KnobRecord.Value() << endl;
+            return;
+        }
+        cout << "Recorded " << recorder->header.records << " records (" << recorder->header.instructions << " instructions) to " << KnobRecord.Value() << endl;
+        return;
+    }
+#endif
+    /* The spies due during each thread's last block */
+    for (unsigned int n = 0; n < simulation_count; n++){
+        for (THREADID tid = 0; tid < victim_threads; tid++) simulations[n]->block_spies(tid);
+    }
+    pool.stop();
+    stop_shards();
+    stop_event_writer();
+    if (event_log != NULL){
+        /* Events of buffers flushed after the writer stopped are still in the ring */
+        if (event_log->close())
+            cout << "Logged " << event_log->header.records << " events to " << KnobEventLog.Value() << endl;
+        else
+            cerr << "Could not write the event log " << KnobEventLog.Value() << endl;
+        if (event_log->header.dropped > 0)
+            cerr << event_log->header.dropped << " events did not fit in the ring and were dropped, raise -event_ring" << endl;
+    }
+    if (checkpoint_probe != NULL){
+        cerr << "The victim never reached -checkpoint_at " << KnobCheckpointAt.Value() << ", no checkpoint was " << (checkpoint_writer != NULL ? "saved" : "restored") << endl;
+    }
+    if (!KnobMetrics.Value().empty()){
+        for (unsigned int n = 0; n < simulation_count; n++) simulations[n]->write_metrics(metrics_prefix(n));
+        cout << "Metrics written to " << KnobMetrics.Value() << (simulation_count > 1 ? ".<instance>" : "") << ".{csv,json,sets.csv}" << endl;
+    }
+    if (simulations[0]->stack != NULL){
+        StackProfile *stack = simulations[0]->stack;
+        if (stack->write(KnobStackDistance.Value().c_str(), KnobStackWays.Value()))
+            cout << "Stack distances of " << stack->accesses << " victim accesses (" << stack->lines.size() << " lines) written to "
+                 << KnobStackDistance.Value() << ".{csv,reuse.csv}" << endl;
+        else
+            cerr << "Could not write the stack distances " << KnobStackDistance.Value() << ".*" << endl;
+    }
+    /* The last iteration's rounds have no next one to close them */
+    for (unsigned int n = 0; n < simulation_count; n++) simulations[n]->key.flush();
+    if (!KnobKeyState.Value().empty()){
+        /* The evidence of every instance adds up, each started from the prior */
+        vector<double> merged = key_prior;
+        for (unsigned int n = 0; n < simulation_count; n++){
+            vector<double> &log_odds = simulations[n]->key.log_odds;
+            if (log_odds.size() > merged.size()) merged.resize(log_odds.size(), 0);
+            for (unsigned long bit = 0; bit < log_odds.size(); bit++){
+                merged[bit] += log_odds[bit] - (bit < key_prior.size() ? key_prior[bit] : 0);
+            }
+        }
+        if (save_key_state(KnobKeyState.Value().c_str(), merged, key_prior_runs + simulation_count))
+            cout << "Key estimates of " << key_prior_runs + simulation_count << " runs saved to " << KnobKeyState.Value() << endl;
+        else
+            cerr << "Could not write the key estimates to " << KnobKeyState.Value() << endl;
+    }
+    if (simulation_count == 1){
+        simulations[0]->print_stats();
+        return;
+    }
+    /* Instances print their report, spies' output included, one after the other */
+    for (unsigned int n = 0; n < simulation_count; n++){
+        Simulation *sim = simulations[n];
+        cout << "Instance " << n << ": cache_noise " << sim->cache_noise << ", wait_time " << sim->wait_time << endl;
+        sim->print_stats();
+    }
+}
+
+INT32 Usage(){
+    cerr << "Our cache simulator tool." << endl;
+#ifdef SHARP_REPLAY
+    cerr << "Usage: ./trace_replay [knobs] -- <trace recorded with -record>" << endl;
+#else
+    cerr << "Usage: pin -t obj-intel64/pin_sharp_cache.so [knobs] -- ./rsa " << endl;
+    cerr << "    -square and -multiply are routine names of the victim or 0x instruction addresses" << endl;
+#endif
+    cerr << "    -noise_grid and -wait_grid replace -noise and -wait with lists, one instance per pair" << endl;
+    cerr << KNOB_BASE::StringKnobSummary() << endl;
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
     spy_probability = 100; // chances a spy will insert an instruction
     
     // select attack
     multi_spy = false;
     shared_l2 = true;
 
+#ifndef SHARP_REPLAY
+    PIN_InitSymbols();
+#endif
+    if (PIN_Init(argc, argv)){
+        return Usage();
+    }
+
+    ReplacementPolicy l2_policy, l3_policy;
+    if (!parse_replacement(KnobL2Policy.Value(), &l2_policy) || !parse_replacement(KnobL3Policy.Value(), &l3_policy)){
+        cerr << "Replacement policies are lru, plru or srrip" << endl;
+        return Usage();
+    }
+    if (!parse_lookup_isa(KnobLookup.Value(), &lookup_isa)){
+        cerr << "Lookup kernels are auto, avx2, sse2 or scalar" << endl;
+        return Usage();
+    }
+#ifndef SHARP_REPLAY
+    if (KnobInstrument.Value() != "bbl" && KnobInstrument.Value() != "ins" && KnobInstrument.Value() != "buffer"){
+        cerr << "Instrumentation modes are bbl, ins or buffer" << endl;
+        return Usage();
+    }
+#endif
+
+    Topology topology;
     if (shared_l2){
         spy_count = 2;
-        number_cores = 2;
+        topology.cores = 2;
     }
     else{
-        spy_count = L3_ASSOC;
-        number_cores = L3_ASSOC + 1;
+        spy_count = KnobL3Assoc.Value();
+        topology.cores = spy_count + 1;
     }
 
-    srand(strtol(argv[9],NULL,10)); /* Make stuff deterministic for easier debugging */
-    
-    if (argc < 7+2){
+    /* The victim's main thread runs on core 0, its other threads on cores after the spies */
+    victim_threads = KnobVictimThreads.Value();
+    if (victim_threads == 0){
         return Usage();
     }
-
-    square_addr = strtol(argv[6], NULL, 16);
-    multiply_addr = strtol(argv[7], NULL, 16);
-    wait_time = strtol(argv[8], NULL, 10);
-    cache_noise = strtol(argv[9], NULL, 10);
-    PIN_Init(argc, argv);
+    unsigned long victim_cores = 0;
+    for (unsigned int t = 0; t < victim_threads; t++){
+        unsigned int core = t == 0 ? 0 : topology.cores + t - 1;
+        if (core < 64) victim_cores |= 1UL << core;
+    }
+    topology.cores += victim_threads - 1;
+
+    /* Every tool argument is a knob, Pin rejects anything else */
+#ifdef SHARP_REPLAY
+    /* The probe points come from the trace, the only argument after "--" */
+    int separator = 0;
+    while (separator < argc && strcmp(argv[separator], "--") != 0)
+        separator++;
+    TraceReader trace;
+    if (separator + 2 != argc){
+        return Usage();
+    }
+    if (!trace.open(argv[separator+1])){
+        cerr << "Could not open the trace " << argv[separator+1] << endl;
+        return 1;
+    }
+    square_addr = trace.header.square_addr;
+    multiply_addr = trace.header.multiply_addr;
+    sign_addr = trace.header.sign_addr;
+#else
+    if (!parse_probe(KnobSquare.Value().c_str(), &square_addr, &square_symbol) || !parse_probe(KnobMultiply.Value().c_str(), &multiply_addr, &multiply_symbol)){
+        cerr << "-square and -multiply take a routine name or a 0x instruction address" << endl;
+        return Usage();
+    }
+#endif
+    vector<long> wait_grid, noise_grid;
+    if (!parse_grid(KnobWaitGrid.Value(), KnobWait.Value(), &wait_grid) ||
+        !parse_grid(KnobNoiseGrid.Value(), KnobNoise.Value(), &noise_grid)){
+        cerr << "-noise_grid and -wait_grid take comma separated numbers" << endl;
+        return Usage();
+    }
+    simulation_count = noise_grid.size() * wait_grid.size();
+    /* Instances are simulated one batch at a time by a pool, never by several victim threads at once */
+    topology.concurrent = victim_threads > 1 && simulation_count == 1;
+    topology.seed = KnobSeed.Value(); /* Make stuff deterministic for easier debugging */
+    topology.metrics = !KnobMetrics.Value().empty();
     
     /* Parameters taken from a real i7 processor (3.4 GHz i7-4770). L3 cache size is made to be a power of 2 */
-    l2_cache = new Cache(256, LINE_SIZE, L2_CACHE_MISS_PENALTY, L2_ASSOC, false);
-    l3_cache = new Cache(16384, LINE_SIZE, L3_CACHE_MISS_PENALTY, L3_ASSOC, true); // l3 uses SHARP
-    
-    
+    if (KnobL1.Value()){
+        topology.private_levels = 2;
+        topology.split_l1 = true;
+        topology.level[0] = {KnobL1Size.Value(), KnobLineSize.Value(), L1_CACHE_MISS_PENALTY, KnobL1Assoc.Value(), false, REPL_LRU};
+    }
+    else{
+        topology.private_levels = 1;
+        topology.split_l1 = false;
+    }
+    topology.level[topology.private_levels - 1] = {KnobL2Size.Value(), KnobLineSize.Value(), L2_CACHE_MISS_PENALTY, KnobL2Assoc.Value(), false, l2_policy};
+    topology.llc = {KnobL3Size.Value(), KnobLineSize.Value(), L3_CACHE_MISS_PENALTY, KnobL3Assoc.Value(), KnobL3Sharp.Value(), l3_policy};
+    topology.llc_slices = KnobL3Slices.Value();
+    if (!parse_slice_hash(KnobL3SliceHash.Value(), topology.llc_slices, topology.slice_hash)){
+        cerr << "-l3_slice_hash needs one hex mask per slice number bit (log2 of -l3_slices)" << endl;
+        return Usage();
+    }
+    topology.private_cores = KnobSpyL2.Value() ? ~0UL >> (64 - min(topology.cores, 64u)) : victim_cores;
+    key_accuracy = KnobKeyAccuracy.Value();
+    key_confidence = KnobKeyConfidence.Value();
+    if (key_accuracy <= 50 || key_accuracy >= 100 || key_confidence <= 50 || key_confidence >= 100 || KnobKeyKnown.Value() > 100){
+        cerr << "-key_accuracy and -key_confidence are percentages between 51 and 99, -key_known up to 100" << endl;
+        return Usage();
+    }
+    key_target = (KnobKeyBits.Value() * (unsigned long) KnobKeyKnown.Value() + 99) / 100;
+    if (!KnobKeyState.Value().empty() && !load_key_state(KnobKeyState.Value().c_str(), &key_prior, &key_prior_runs)){
+        cerr << "Could not read the key estimates in " << KnobKeyState.Value() << endl;
+        return 1;
+    }
+    if (key_target > 0){
+        /* A run observes each bit once: if one more observation settles too few bits, the stop would never come */
+        KeyInference reach;
+        reach.init(key_accuracy, key_confidence, key_prior);
+        if (reach.reachable() < key_target){
+            cerr << "-key_bits: one run cannot make " << key_target << " bits known at " << key_accuracy << "% accuracy and "
+                 << key_confidence << "% confidence, it needs earlier runs in -key_state. This run goes to the end and adds its own" << endl;
+            key_target = 0;
+        }
+    }
 
-    spies = (Spy**) malloc (sizeof (Spy *) * spy_count);
-    if (shared_l2) {
-        spies[0] = new Spy (0); // shares L2
-        spies[1] = new Spy (1); // different core
+    shard_count = KnobShards.Value();
+    if (shard_count == 0){
+        return Usage();
     }
-    else {
-        for (int i = 0; i < spy_count; i++) {
-            spies[i] = new Spy (i+1); // do not share core 0
+    if (shard_count > 1 && (simulation_count > 1 || victim_threads > 1 || topology.metrics ||
+                            !KnobSaveCheckpoint.Value().empty() || !KnobRestoreCheckpoint.Value().empty())){
+        /* The victim thread is the only one feeding the shards, and nothing reads them but their totals */
+        cerr << "-shards simulates a single instance of a single victim thread, without -metrics or checkpoints" << endl;
+        return 1;
+    }
+
+    simulations = (Simulation **) malloc(simulation_count * sizeof(Simulation *));
+    for (unsigned int n = 0; n < simulation_count; n++){
+        topology.noise = noise_grid[n / wait_grid.size()];
+        simulations[n] = new Simulation(topology, wait_grid[n % wait_grid.size()], n, simulation_count == 1);
+    }
+    simulations[0]->hierarchy->print_config();
+
+    if (topology.metrics){
+        if (KnobMetricsEpoch.Value() == 0){
+            cerr << "-metrics_epoch must be at least one instruction" << endl;
+            return Usage();
+        }
+        for (unsigned int n = 0; n < simulation_count; n++){
+            Simulation *sim = simulations[n];
+            sim->metrics = new MetricsSeries;
+            if (!sim->metrics->open((metrics_prefix(n) + ".csv").c_str(), KnobMetricsEpoch.Value(), topology.cores)){
+                cerr << "Could not create the metrics " << metrics_prefix(n) << ".csv" << endl;
+                return 1;
+            }
+            sim->next_epoch = KnobMetricsEpoch.Value();
         }
     }
-    
 
-    INS_AddInstrumentFunction(Instruction, 0);
+    if (!KnobStackDistance.Value().empty()){
+        if (!is_pow2(KnobStackSets.Value()) || KnobStackWays.Value() == 0){
+            cerr << "-stack_sets is a power of two, -stack_ways at least one" << endl;
+            return Usage();
+        }
+        /* Every instance sees the same victim stream, the first one profiles it */
+        StackProfile *stack = new StackProfile;
+        stack->init(KnobLineSize.Value(), KnobStackSets.Value());
+        stack->aim(square_addr, multiply_addr);
+        simulations[0]->stack = stack;
+    }
+
+    if (!KnobEventLog.Value().empty()){
+        if (KnobEventLevel.Value() < EVENT_LEVEL_LEAK || KnobEventLevel.Value() > EVENT_LEVEL_PROBE || !is_pow2(KnobEventRing.Value())){
+            cerr << "-event_level goes from 1 to 3, -event_ring is a power of two" << endl;
+            return Usage();
+        }
+        vector<EventInstance> instances(simulation_count);
+        for (unsigned int n = 0; n < simulation_count; n++){
+            instances[n].cache_noise = simulations[n]->cache_noise;
+            instances[n].wait_time = simulations[n]->wait_time;
+            instances[n].miss_penalty = L3_CACHE_MISS_PENALTY;
+        }
+        event_log = new EventLog;
+        if (!event_log->open(KnobEventLog.Value().c_str(), KnobEventLevel.Value(), KnobEventRing.Value(), instances.data(), simulation_count)){
+            cerr << "Could not create the event log " << KnobEventLog.Value() << endl;
+            return 1;
+        }
+        if (PIN_SpawnInternalThread(event_writer, NULL, 0, &event_writer_uid) == INVALID_THREADID){
+            cerr << "Could not start the event log writer" << endl;
+            return 1;
+        }
+        event_level = KnobEventLevel.Value();
+    }
+
+    if (!parse_roi(KnobRoiStart.Value(), &roi_start_count, &roi_start_symbol) || !parse_roi(KnobRoiEnd.Value(), &roi_end_count, &roi_end_symbol)){
+        cerr << "-roi_start and -roi_end take a routine name or a number of instructions" << endl;
+        return Usage();
+    }
+    if (KnobWarmup.Value() != "functional" && KnobWarmup.Value() != "none"){
+        cerr << "Warm-up modes are functional or none" << endl;
+        return Usage();
+    }
+    functional_warmup = KnobWarmup.Value() == "functional";
+    if (!roi_start_symbol.empty() || roi_start_count > 0) phase = PHASE_FORWARD;
+#ifdef SHARP_REPLAY
+    /* A trace only knows its probe points */
+    if (!resolve_trace_probe(roi_start_symbol, &roi_start_addr) || !resolve_trace_probe(roi_end_symbol, &roi_end_addr)){
+        cerr << "trace_replay can only start or end the region of interest at square, multiply or sign" << endl;
+        return Usage();
+    }
+#endif
+
+    const string &save = KnobSaveCheckpoint.Value(), &restore = KnobRestoreCheckpoint.Value();
+    if (!save.empty() || !restore.empty()){
+        if (KnobCheckpointAt.Value() == "square") checkpoint_probe = &square_addr;
+        else if (KnobCheckpointAt.Value() == "multiply") checkpoint_probe = &multiply_addr;
+        else if (KnobCheckpointAt.Value() == "sign") checkpoint_probe = &sign_addr;
+        else{
+            cerr << "-checkpoint_at takes square, multiply or sign" << endl;
+            return Usage();
+        }
+        if (!save.empty() && !restore.empty()){
+            cerr << "Either save or restore a checkpoint, not both" << endl;
+            return Usage();
+        }
+        if (victim_threads > 1){
+            cerr << "Checkpoints need a single victim thread" << endl;
+            return 1;
+        }
+#ifndef SHARP_REPLAY
+        if (!KnobRecord.Value().empty()){
+            cerr << "-record does not simulate, there is nothing to checkpoint" << endl;
+            return 1;
+        }
+#endif
+        checkpoint_fingerprint = topology_fingerprint(topology);
+        if (!save.empty()){
+            if (simulation_count > 1){
+                cerr << "Save checkpoints from a single instance, grids can restore them" << endl;
+                return 1;
+            }
+            checkpoint_writer = new CheckpointWriter;
+            if (!checkpoint_writer->open(save.c_str())){
+                cerr << "Could not create the checkpoint " << save << endl;
+                return 1;
+            }
+        }
+        else{
+            checkpoint_reader = new CheckpointReader;
+            if (!checkpoint_reader->open(restore.c_str())){
+                cerr << "Could not read the checkpoint " << restore << endl;
+                return 1;
+            }
+            if (phase == PHASE_FORWARD){
+                cerr << "A restored checkpoint starts the region of interest, drop -roi_start" << endl;
+                return Usage();
+            }
+            /* Nothing before the checkpoint matters, skip it without warming */
+            phase = PHASE_FORWARD;
+            functional_warmup = false;
+#ifdef SHARP_REPLAY
+            roi_start_addr = *checkpoint_probe;
+#endif
+        }
+    }
+
+    if (simulation_count > 1){
+        unsigned int workers = KnobWorkers.Value();
+        if (workers == 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = max(1u, min(workers, simulation_count));
+        if (!pool.init(workers)){
+            cerr << "Could not start " << workers << " simulation workers" << endl;
+            return 1;
+        }
+        cout << "Simulating " << simulation_count << " instances on " << workers << " workers" << endl;
+    }
+    if (shard_count > 1){
+        if (!simulations[0]->sharded->start()){
+            cerr << "Could not start " << shard_count << " shard workers" << endl;
+            return 1;
+        }
+        cout << "Simulating the caches in " << shard_count << " shards, one worker each" << endl;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus <= (long) shard_count)
+            cerr << "Only " << cpus << " host cpus for " << shard_count << " shard workers and the victim, they take turns" << endl;
+    }
+
+#ifdef SHARP_REPLAY
+    bool complete = replay_trace(&trace);
+    trace.close();
+    if (!complete){
+        cerr << "The trace is damaged, stopped replaying it" << endl;
+        return 1;
+    }
+    Fini(0, 0);
+    return 0;
+#else
+    if (!KnobRecord.Value().empty()){
+        recorder = new TraceWriter;
+        if (!recorder->open(KnobRecord.Value().c_str())){
+            cerr << "Could not create the trace " << KnobRecord.Value() << endl;
+            return 1;
+        }
+        PIN_InitLock(&record_lock);
+    }
+
+    /* A grid simulates every instance on each batch, so it always buffers */
+    buffered = KnobInstrument.Value() == "buffer" || (simulation_count > 1 && recorder == NULL);
+    if (buffered){
+        record_buffer = PIN_DefineTraceBuffer(sizeof(AccessRecord), BUFFER_PAGES, recorder != NULL ? record_records : simulate_records, 0);
+        if (record_buffer == BUFFER_ID_INVALID){
+            cerr << "Could not define the record buffer" << endl;
+            return 1;
+        }
+    }
+
+    if (KnobInstrument.Value() == "ins")
+        INS_AddInstrumentFunction(Instruction, 0);
+    else
+        TRACE_AddInstrumentFunction(Trace, 0);
+    IMG_AddInstrumentFunction(ImageLoad, 0);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
     
     // Start the program, never returns
     PIN_StartProgram();
     return 0;
+#endif
 }
 
 /* 
     Compile with:
         make obj-intel64/pin_sharp_cache.so
     Test with:
-        pin -t obj-intel64/pin_sharp_cache.so 0x4014e3 0x4016dc -- ./rsa
+        pin -t obj-intel64/pin_sharp_cache.so -square square -multiply multiply -wait 0 -noise 10 -- ./rsa
+    Probe points are looked up in the symbols of ./rsa, so rebuilding it needs no new addresses.
+    Raw instruction addresses still work:
+        pin -t obj-intel64/pin_sharp_cache.so -square 0x4014e3 -multiply 0x4016dc -wait 0 -noise 10 -- ./rsa
+    Sweep cache shapes without recompiling, e.g.:
+        pin -t obj-intel64/pin_sharp_cache.so -l2_assoc 8 -l3_size 8192 -l3_policy srrip -noise 10 -- ./rsa
+    Or record the victim once and replay it without Pin (same knobs, except -instrument, -square, -multiply, -sign_symbol and -record):
+        pin -t obj-intel64/pin_sharp_cache.so -record rsa.trace -- ./rsa
+        make trace_replay && ./trace_replay -l3_policy srrip -noise 10 -- rsa.trace
+    Stop once the key is known, adding up the evidence of every run so far:
+        pin -t obj-intel64/pin_sharp_cache.so -key_state rsa.key -key_bits 1024 -key_known 90 -noise 10 -- ./rsa
+    Count hits, misses, SHARP steps and alarms per core and per set, with a series every 100000 instructions:
+        ./trace_replay -metrics rsa -metrics_epoch 100000 -noise 10 -- rsa.trace
+    Miss curves of every LRU L3 shape up to 16384 sets x 32 ways, and the reuse of square and multiply, in one run:
+        ./trace_replay -stack_distance rsa.stack -noise 10 -- rsa.trace
+    Log what the spies see and decode it, as text or CSV:
+        ./trace_replay -event_log rsa.events -noise 10 -- rsa.trace && make event_decode && ./event_decode rsa.events
+    Only simulate signing in detail, the start-up just warms the caches (-warmup none skips it):
+        pin -t obj-intel64/pin_sharp_cache.so -roi_start sign -noise 10 -- ./rsa
+    Simulate the caches on 4 worker threads, each owning a quarter of the sets of every cache:
+        ./trace_replay -shards 4 -noise 10 -- rsa.trace
+    A noise x wait time grid comes out of one run, every instance sees the same victim stream:
+        ./trace_replay -noise_grid 1,10,50 -wait_grid 0,4980 -- rsa.trace
+    Simulate the start-up of the victim once, later runs continue from the first call to sign:
+        pin -t obj-intel64/pin_sharp_cache.so -save_checkpoint warm.ckpt -noise 10 -- ./rsa
+        pin -t obj-intel64/pin_sharp_cache.so -restore_checkpoint warm.ckpt -noise_grid 1,10,50 -- ./rsa
 */
@@ -0,0 +1,223 @@
+#ifndef PIN_SHIM_H
+#define PIN_SHIM_H
+
+/*
+    The few Pin declarations the simulator uses outside instrumentation, so pin_sharp_cache.cpp
+    also builds without a Pin kit (-DSHARP_REPLAY, see trace_replay in the Makefile).
+
+    Knobs keep Pin's syntax: "-name value", every tool argument before "--" is one.
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace std;
+
+typedef void VOID;
+typedef bool BOOL;
+typedef int INT32;
+typedef unsigned int UINT32;
+typedef unsigned long UINT64;
+typedef unsigned long ADDRINT;
+typedef unsigned int THREADID;
+
+typedef struct Pin_Lock {
+    volatile int owner; /* 0 when free */
+} PIN_LOCK;
+
+static inline VOID PIN_InitLock(PIN_LOCK *lock){
+    lock->owner = 0;
+}
+
+static inline VOID PIN_GetLock(PIN_LOCK *lock, INT32 owner){
+    while (!__sync_bool_compare_and_swap(&lock->owner, 0, owner)){
+        while (lock->owner != 0);
+    }
+}
+
+static inline VOID PIN_ReleaseLock(PIN_LOCK *lock){
+    __sync_lock_release(&lock->owner);
+}
+
+typedef struct Pin_Semaphore {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool set;
+} PIN_SEMAPHORE;
+
+static inline VOID PIN_SemaphoreInit(PIN_SEMAPHORE *sem){
+    pthread_mutex_init(&sem->mutex, NULL);
+    pthread_cond_init(&sem->cond, NULL);
+    sem->set = false;
+}
+
+static inline VOID PIN_SemaphoreSet(PIN_SEMAPHORE *sem){
+    pthread_mutex_lock(&sem->mutex);
+    sem->set = true;
+    pthread_cond_broadcast(&sem->cond);
+    pthread_mutex_unlock(&sem->mutex);
+}
+
+static inline VOID PIN_SemaphoreClear(PIN_SEMAPHORE *sem){
+    pthread_mutex_lock(&sem->mutex);
+    sem->set = false;
+    pthread_mutex_unlock(&sem->mutex);
+}
+
+static inline VOID PIN_SemaphoreWait(PIN_SEMAPHORE *sem){
+    pthread_mutex_lock(&sem->mutex);
+    while (!sem->set) pthread_cond_wait(&sem->cond, &sem->mutex);
+    pthread_mutex_unlock(&sem->mutex);
+}
+
+static inline VOID PIN_Sleep(UINT32 milliseconds){
+    usleep(milliseconds * 1000);
+}
+
+/* Internal threads are plain pthreads, the uid is the pthread to join */
+typedef pthread_t PIN_THREAD_UID;
+typedef VOID (*ROOT_THREAD_FUNC)(VOID *arg);
+#define INVALID_THREADID ((THREADID) -1)
+#define PIN_INFINITE_TIMEOUT ((UINT32) -1)
+
+typedef struct Pin_Thread_Start {
+    ROOT_THREAD_FUNC func;
+    VOID *arg;
+} PinThreadStart;
+
+static inline VOID *pin_thread_main(VOID *start){
+    PinThreadStart run = *(PinThreadStart *) start;
+    delete (PinThreadStart *) start;
+    run.func(run.arg);
+    return NULL;
+}
+
+static inline THREADID PIN_SpawnInternalThread(ROOT_THREAD_FUNC func, VOID *arg, size_t stack_size, PIN_THREAD_UID *uid){
+    static THREADID next_id = 1;
+    PinThreadStart *start = new PinThreadStart;
+    start->func = func;
+    start->arg = arg;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pin_thread_main, start) != 0){
+        delete start;
+        return INVALID_THREADID;
+    }
+    if (uid != NULL) *uid = thread;
+    else pthread_detach(thread);
+    return __sync_fetch_and_add(&next_id, 1);
+}
+
+static inline BOOL PIN_WaitForThreadTermination(const PIN_THREAD_UID &uid, UINT32 timeout, INT32 *exit_code){
+    /* Only waits without a timeout, all the simulator needs */
+    return pthread_join(uid, NULL) == 0;
+}
+
+enum KNOB_MODE {
+    KNOB_MODE_WRITEONCE
+};
+
+class KNOB_BASE {
+public:
+    const char *name;
+    const char *default_value;
+    const char *description;
+    KNOB_BASE *next;
+
+    KNOB_BASE(const char *n, const char *value, const char *desc){
+        name = n;
+        default_value = value;
+        description = desc;
+        /* Knobs are globals, this runs before main. Kept in declaration order for the summary */
+        next = NULL;
+        KNOB_BASE **link = &first();
+        while (*link != NULL) link = &(*link)->next;
+        *link = this;
+    }
+
+    virtual bool set(const char *value) = 0;
+
+    static KNOB_BASE *&first(){
+        static KNOB_BASE *knobs = NULL;
+        return knobs;
+    }
+
+    static KNOB_BASE *find(const char *n){
+        for (KNOB_BASE *knob = first(); knob != NULL; knob = knob->next){
+            if (strcmp(knob->name, n) == 0) return knob;
+        }
+        return NULL;
+    }
+
+    static string StringKnobSummary(){
+        ostringstream out;
+        for (KNOB_BASE *knob = first(); knob != NULL; knob = knob->next){
+            out << "-" << knob->name << "  [default " << knob->default_value << "]" << endl << "\t" << knob->description << endl;
+        }
+        return out.str();
+    }
+};
+
+static inline bool parse_knob(const char *value, string *out){
+    *out = value;
+    return true;
+}
+
+static inline bool parse_knob(const char *value, bool *out){
+    if (strcmp(value, "1") == 0 || strcmp(value, "true") == 0) *out = true;
+    else if (strcmp(value, "0") == 0 || strcmp(value, "false") == 0) *out = false;
+    else return false;
+    return true;
+}
+
+static inline bool parse_knob(const char *value, unsigned int *out){
+    char *end;
+    *out = strtoul(value, &end, 0);
+    return value[0] != '\0' && *end == '\0';
+}
+
+static inline bool parse_knob(const char *value, unsigned long *out){
+    char *end;
+    *out = strtoul(value, &end, 0);
+    return value[0] != '\0' && *end == '\0';
+}
+
+template <class T>
+class KNOB : public KNOB_BASE {
+public:
+    T value;
+
+    KNOB(KNOB_MODE mode, const char *family, const char *n, const char *value, const char *desc) : KNOB_BASE(n, value, desc){
+        parse_knob(value, &this->value);
+    }
+
+    bool set(const char *v){
+        return parse_knob(v, &value);
+    }
+
+    T Value() const {
+        return value;
+    }
+};
+
+static inline BOOL PIN_Init(INT32 argc, char **argv){
+    /* Like Pin: true on anything before "--" that is not a knob and its value */
+    for (int i = 1; i < argc && strcmp(argv[i], "--") != 0; i += 2){
+        KNOB_BASE *knob = argv[i][0] == '-' ? KNOB_BASE::find(argv[i] + 1) : NULL;
+        if (knob == NULL){
+            cerr << "Unknown knob " << argv[i] << endl;
+            return true;
+        }
+        if (i + 1 >= argc || !knob->set(argv[i + 1])){
+            cerr << "Bad value for " << argv[i] << endl;
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
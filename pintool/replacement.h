@@ -0,0 +1,243 @@
+#ifndef REPLACEMENT_H
+#define REPLACEMENT_H
+
+#include <string.h>
+#include <string>
+
+/*
+    Replacement state for one cache set.
+
+    Every policy keeps its whole state in a few bytes inside the set block of the Cache,
+    and answers two questions without sorting:
+        touch  - a way was hit
+        insert - a way was filled (only SRRIP treats it differently from a hit)
+        victim - which way to replace, restricted to a mask of candidate ways
+                 (SHARP restricts the candidates to unowned ways, then to the ways of one core)
+
+    LRU   - ordered list of way numbers, one byte each, most recently used first.
+            Hits move a way to the front (byte search + memmove), the victim is the last candidate.
+    PLRU  - binary tree of assoc-1 bits in a single word (associativity must be a power of two)
+    SRRIP - 2-bit re-reference prediction value per way in a single word (Jaleel et al., ISCA'10)
+*/
+
+enum ReplacementPolicy {
+    REPL_LRU,
+    REPL_PLRU,
+    REPL_SRRIP
+};
+
+static inline const char *replacement_name(ReplacementPolicy policy){
+    switch (policy){
+        case REPL_PLRU: return "plru";
+        case REPL_SRRIP: return "srrip";
+        default: return "lru";
+    }
+}
+
+static inline unsigned long load_word(const unsigned char *bytes){
+    unsigned long word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static inline void store_word(unsigned char *bytes, unsigned long word){
+    memcpy(bytes, &word, sizeof(word));
+}
+
+struct LruList {
+    /* Padded to whole words with 0xff so the word-at-a-time search never matches padding */
+    static constexpr unsigned int state_bytes(unsigned int assoc){
+        return (assoc + 7) & ~7u;
+    }
+
+    static void init(unsigned char *state, unsigned int assoc){
+        /* Way 0 is the least recently used one, so an empty set fills in way order */
+        memset(state, 0xff, state_bytes(assoc));
+        for (unsigned int i = 0; i < assoc; i++)
+            state[i] = assoc - 1 - i;
+    }
+
+    static unsigned int position(const unsigned char *state, unsigned int assoc, unsigned int way){
+        /* Word-at-a-time search for the byte holding <way> */
+        const unsigned long ones = 0x0101010101010101UL;
+        const unsigned long highs = 0x8080808080808080UL;
+        for (unsigned int i = 0; i < assoc; i += 8){
+            unsigned long x = load_word(state + i) ^ (ones * way);
+            unsigned long zero = (x - ones) & ~x & highs;
+            if (zero)
+                return i + __builtin_ctzl(zero) / 8;
+        }
+        return assoc - 1; /* Not reached, every way is in the list */
+    }
+
+    static void touch(unsigned char *state, unsigned int assoc, unsigned int way){
+        unsigned int pos = position(state, assoc, way);
+        memmove(state + 1, state, pos);
+        state[0] = way;
+    }
+
+    static void insert(unsigned char *state, unsigned int assoc, unsigned int way){
+        touch(state, assoc, way);
+    }
+
+    static unsigned int victim(const unsigned char *state, unsigned int assoc, unsigned int candidates){
+        for (int i = assoc - 1; i >= 0; i--){
+            if (candidates & (1u << state[i]))
+                return state[i];
+        }
+        return state[assoc - 1];
+    }
+
+    static unsigned int age(const unsigned char *state, unsigned int assoc, unsigned int way){
+        return position(state, assoc, way);
+    }
+};
+
+struct TreePlru {
+    /* Node n (heap numbering from 1) set means the older half is on the right */
+    static constexpr unsigned int state_bytes(unsigned int /* assoc */){
+        return sizeof(unsigned long);
+    }
+
+    static void init(unsigned char *state, unsigned int /* assoc */){
+        store_word(state, 0);
+    }
+
+    static void touch(unsigned char *state, unsigned int assoc, unsigned int way){
+        unsigned long bits = load_word(state);
+        unsigned int node = 1, low = 0;
+        for (unsigned int span = assoc; span > 1; span /= 2){
+            unsigned int half = span / 2;
+            if (way < low + half){
+                bits |= 1UL << node; /* Point away from the touched half */
+                node = 2 * node;
+            }
+            else{
+                bits &= ~(1UL << node);
+                node = 2 * node + 1;
+                low += half;
+            }
+        }
+        store_word(state, bits);
+    }
+
+    static void insert(unsigned char *state, unsigned int assoc, unsigned int way){
+        touch(state, assoc, way);
+    }
+
+    static unsigned int victim(const unsigned char *state, unsigned int assoc, unsigned int candidates){
+        /* Follow the tree, but never walk into a subtree without candidates */
+        unsigned long bits = load_word(state);
+        unsigned int node = 1, low = 0;
+        for (unsigned int span = assoc; span > 1; span /= 2){
+            unsigned int half = span / 2;
+            unsigned long half_mask = ((1UL << half) - 1);
+            bool left_ok = (candidates >> low) & half_mask;
+            bool right_ok = (candidates >> (low + half)) & half_mask;
+            bool right = (bits >> node) & 1;
+            if (right && !right_ok) right = false;
+            if (!right && !left_ok) right = true;
+            node = 2 * node + right;
+            if (right) low += half;
+        }
+        return low;
+    }
+
+    static unsigned int age(const unsigned char *state, unsigned int assoc, unsigned int way){
+        /* Number of tree nodes pointing at <way>, i.e. how close it is to being the victim */
+        unsigned long bits = load_word(state);
+        unsigned int node = 1, low = 0, pointing = 0;
+        for (unsigned int span = assoc; span > 1; span /= 2){
+            unsigned int half = span / 2;
+            bool right = way >= low + half;
+            pointing += ((bits >> node) & 1) == right;
+            node = 2 * node + right;
+            if (right) low += half;
+        }
+        return pointing;
+    }
+};
+
+struct Srrip {
+    /* Two bits per way, so up to 32 ways fit in one word */
+    static const unsigned long RRPV_MAX = 3;
+    static const unsigned long RRPV_INSERT = 2;
+    static const unsigned long LOW_BITS = 0x5555555555555555UL;
+
+    static constexpr unsigned int state_bytes(unsigned int /* assoc */){
+        return sizeof(unsigned long);
+    }
+
+    static unsigned long way_fields(unsigned int assoc){
+        return assoc >= 32 ? ~0UL : (1UL << (2 * assoc)) - 1;
+    }
+
+    static unsigned long spread(unsigned int mask){
+        /* Move bit i of <mask> to bit 2i */
+        unsigned long x = mask;
+        x = (x | (x << 16)) & 0x0000ffff0000ffffUL;
+        x = (x | (x << 8)) & 0x00ff00ff00ff00ffUL;
+        x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fUL;
+        x = (x | (x << 2)) & 0x3333333333333333UL;
+        x = (x | (x << 1)) & LOW_BITS;
+        return x;
+    }
+
+    static void init(unsigned char *state, unsigned int assoc){
+        store_word(state, way_fields(assoc)); /* Every way starts at RRPV_MAX */
+    }
+
+    static void touch(unsigned char *state, unsigned int /* assoc */, unsigned int way){
+        /* Hits predict a near re-reference. Fills are handled by insert */
+        unsigned long rrpv = load_word(state);
+        rrpv &= ~(RRPV_MAX << (2 * way));
+        store_word(state, rrpv);
+    }
+
+    static void insert(unsigned char *state, unsigned int /* assoc */, unsigned int way){
+        unsigned long rrpv = load_word(state);
+        rrpv = (rrpv & ~(RRPV_MAX << (2 * way))) | (RRPV_INSERT << (2 * way));
+        store_word(state, rrpv);
+    }
+
+    static unsigned int victim(unsigned char *state, unsigned int assoc, unsigned int candidates){
+        /* First candidate predicted for a distant re-reference. If there is none, age the whole set */
+        unsigned long rrpv = load_word(state);
+        unsigned long fields = way_fields(assoc) & LOW_BITS;
+        unsigned long wanted = spread(candidates) & fields;
+
+        for (unsigned int round = 0; round <= RRPV_MAX; round++){
+            unsigned long distant = rrpv & (rrpv >> 1) & fields;
+            if (distant & wanted){
+                store_word(state, rrpv);
+                return __builtin_ctzl(distant & wanted) / 2;
+            }
+            rrpv += fields & ~distant; /* Saturating increment, fields already at RRPV_MAX stay there */
+        }
+        return 0; /* Not reached when <candidates> is not empty */
+    }
+
+    static unsigned int age(const unsigned char *state, unsigned int /* assoc */, unsigned int way){
+        return (load_word(state) >> (2 * way)) & RRPV_MAX;
+    }
+};
+
+constexpr unsigned int replacement_state_bytes(ReplacementPolicy policy, unsigned int assoc){
+    return policy == REPL_PLRU ? TreePlru::state_bytes(assoc) :
+           policy == REPL_SRRIP ? Srrip::state_bytes(assoc) : LruList::state_bytes(assoc);
+}
+
+/* Policy implementation for a compile-time policy, used by the specialized caches */
+template <ReplacementPolicy P> struct PolicyOf { typedef LruList type; };
+template <> struct PolicyOf<REPL_PLRU> { typedef TreePlru type; };
+template <> struct PolicyOf<REPL_SRRIP> { typedef Srrip type; };
+
+static inline bool parse_replacement(const std::string &name, ReplacementPolicy *policy){
+    if (name == "lru") *policy = REPL_LRU;
+    else if (name == "plru") *policy = REPL_PLRU;
+    else if (name == "srrip") *policy = REPL_SRRIP;
+    else return false;
+    return true;
+}
+
+#endif
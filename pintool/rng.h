@@ -0,0 +1,119 @@
+#ifndef RNG_H
+#define RNG_H
+
+/*
+    Random numbers for the simulator, reproducible from a single seed.
+
+    Xoshiro256   - xoshiro256** generator (Blackman and Vigna). Small, fast and splittable:
+                   every stream is seeded from its own splitmix64 sequence.
+    NoiseBuffer  - timing noise drawn ahead of time, NOISE_LANES xoshiro streams side by side
+                   so the refill loop vectorizes. Values are spread over [-noise/2, noise - noise/2).
+    CoreRng      - the streams of one simulated core: random SHARP evictions and timing noise.
+                   They never share state, so changing the noise level does not change evictions.
+                   A spy's core also has a STREAM_SPY stream, drawn by the spy scheduler.
+*/
+
+#define NOISE_LANES 8
+#define NOISE_BATCH 512 /* Values drawn per refill, a multiple of NOISE_LANES */
+
+static inline unsigned long rotl64(unsigned long x, int k){
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline unsigned long splitmix64(unsigned long *x){
+    unsigned long z = (*x += 0x9e3779b97f4a7c15UL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    return z ^ (z >> 31);
+}
+
+enum RngStream {
+    STREAM_EVICT = 1,
+    STREAM_NOISE,
+    STREAM_SPY
+};
+
+static inline unsigned long stream_seed(unsigned long seed, RngStream kind, unsigned long index){
+    /* Start of the splitmix64 sequence of stream <index> of <kind>, unrelated to every other stream of <seed> */
+    unsigned long id = ((unsigned long) kind << 48) | index;
+    unsigned long x = seed ^ splitmix64(&id);
+    return splitmix64(&x);
+}
+
+struct Xoshiro256 {
+    unsigned long s[4];
+
+    void seed(unsigned long seed, RngStream kind, unsigned long index){
+        unsigned long x = stream_seed(seed, kind, index);
+        for (int i = 0; i < 4; i++) s[i] = splitmix64(&x);
+    }
+
+    unsigned long next(){
+        unsigned long result = rotl64(s[1] * 5, 7) * 9;
+        unsigned long t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl64(s[3], 45);
+        return result;
+    }
+
+    unsigned int below(unsigned int n){
+        /* Uniform in [0, n) by multiply-shift, no division */
+        return ((next() >> 32) * n) >> 32;
+    }
+};
+
+struct NoiseBuffer {
+    /* Lane states are stored word by word (s0 of every lane, then s1...) so a refill step works on whole vectors */
+    unsigned long s[4][NOISE_LANES];
+    int values[NOISE_BATCH];
+    unsigned int next_value;
+    unsigned int noise;
+
+    void seed(unsigned long seed, unsigned long index, unsigned int n){
+        for (int lane = 0; lane < NOISE_LANES; lane++){
+            unsigned long x = stream_seed(seed, STREAM_NOISE, index * NOISE_LANES + lane);
+            for (int i = 0; i < 4; i++) s[i][lane] = splitmix64(&x);
+        }
+        noise = n;
+        next_value = NOISE_BATCH;
+    }
+
+    void refill(){
+        const int offset = noise / 2;
+        for (int i = 0; i < NOISE_BATCH; i += NOISE_LANES){
+            for (int lane = 0; lane < NOISE_LANES; lane++){
+                unsigned long result = rotl64(s[1][lane] * 5, 7) * 9;
+                unsigned long t = s[1][lane] << 17;
+                s[2][lane] ^= s[0][lane];
+                s[3][lane] ^= s[1][lane];
+                s[1][lane] ^= s[2][lane];
+                s[0][lane] ^= s[3][lane];
+                s[2][lane] ^= t;
+                s[3][lane] = rotl64(s[3][lane], 45);
+                values[i + lane] = (int) (((result >> 32) * noise) >> 32) - offset;
+            }
+        }
+        next_value = 0;
+    }
+
+    int draw(){
+        if (next_value == NOISE_BATCH) refill();
+        return values[next_value++];
+    }
+};
+
+typedef struct Core_Rng {
+    Xoshiro256 evict; /* SHARP step 3 victims */
+    NoiseBuffer noise;
+
+    void seed(unsigned long seed, unsigned int core, unsigned int n){
+        evict.seed(seed, STREAM_EVICT, core);
+        noise.seed(seed, core, n);
+    }
+} __attribute__((aligned(64))) CoreRng;
+
+#endif
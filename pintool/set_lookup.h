@@ -0,0 +1,187 @@
+#ifndef SET_LOOKUP_H
+#define SET_LOOKUP_H
+
+#include <immintrin.h>
+#include <cpuid.h>
+#include "replacement.h"
+
+/*
+    Set block layout and the kernels that search one set.
+
+    A set block holds 64-bit tags for every way, the replacement state, one owner byte per way
+    and a valid bitmask (see Cache). A kernel matches all ways at once and reports, in one pass,
+    the ways holding a tag, the first invalid way and the SHARP unowned / own-core way masks.
+
+    Kernels load whole vectors, so they may read past the ways of a set: into the rest of the
+    set block, the next set, or the LOOKUP_PADDING bytes every cache allocates after the last set of a page.
+    Bits for ways that do not exist are masked off.
+*/
+
+#define LOOKUP_PADDING 64
+
+constexpr unsigned long layout_repl_offset(unsigned int assoc){
+    return sizeof(unsigned long) * assoc;
+}
+
+constexpr unsigned long layout_owner_offset(unsigned int assoc, ReplacementPolicy policy){
+    return layout_repl_offset(assoc) + replacement_state_bytes(policy, assoc);
+}
+
+constexpr unsigned long layout_valid_offset(unsigned int assoc, ReplacementPolicy policy){
+    return (layout_owner_offset(assoc, policy) + assoc + sizeof(unsigned int) - 1) & ~(sizeof(unsigned int) - 1);
+}
+
+constexpr unsigned long layout_stride(unsigned long bytes){
+    /*
+        Sets up to a host line round up to a power of two, so none straddles two lines. Larger ones
+            round up to whole host lines: a 16-way LRU set (164 bytes) takes three, not four
+    */
+    return bytes <= 32 ? 32 : bytes <= 64 ? 64 : (bytes + 63) & ~63UL;
+}
+
+constexpr unsigned long layout_set_stride(unsigned int assoc, ReplacementPolicy policy){
+    return layout_stride(layout_valid_offset(assoc, policy) + sizeof(unsigned int));
+}
+
+typedef struct Set_Shape {
+    unsigned int assoc;
+    unsigned int all_ways;
+    unsigned long owner_offset;
+    unsigned long valid_offset;
+} SetShape;
+
+typedef struct Set_Match {
+    unsigned int hits; /* Valid ways holding the tag */
+    int first_invalid; /* Lowest invalid way, -1 if every way is valid */
+    unsigned int unowned; /* Ways without a SHARP owner */
+    unsigned int own; /* Ways owned by the requesting core */
+} SetMatch;
+
+enum LookupIsa {
+    LOOKUP_SCALAR,
+    LOOKUP_SSE2,
+    LOOKUP_AVX2
+};
+
+typedef void (*LookupKernel)(const unsigned char *block, const SetShape *shape, unsigned long tag, int core, SetMatch *match);
+
+static inline const char *lookup_isa_name(LookupIsa isa){
+    switch (isa){
+        case LOOKUP_AVX2: return "avx2";
+        case LOOKUP_SSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+static inline void finish_match(const unsigned char *block, const SetShape *shape, SetMatch *match){
+    unsigned int valid = *(const unsigned int *) (block + shape->valid_offset);
+    unsigned int invalid = ~valid & shape->all_ways;
+    match->hits &= valid & shape->all_ways;
+    match->unowned &= shape->all_ways;
+    match->own &= shape->all_ways;
+    match->first_invalid = invalid ? __builtin_ctz(invalid) : -1;
+}
+
+/* ASSOC is the associativity when known at compile time, 0 to read it from the shape */
+
+template <unsigned int ASSOC>
+void match_set_scalar(const unsigned char *block, const SetShape *shape, unsigned long tag, int core, SetMatch *match){
+    const unsigned int assoc = ASSOC ? ASSOC : shape->assoc;
+    const unsigned long *tags = (const unsigned long *) block;
+    const signed char *owner = (const signed char *) (block + shape->owner_offset);
+
+    match->hits = match->unowned = match->own = 0;
+    for (unsigned int way = 0; way < assoc; way++){
+        match->hits |= (unsigned int) (tags[way] == tag) << way;
+        match->unowned |= (unsigned int) (owner[way] == -1) << way;
+        match->own |= (unsigned int) (owner[way] == core) << way;
+    }
+    finish_match(block, shape, match);
+}
+
+template <unsigned int ASSOC>
+void match_set_sse2(const unsigned char *block, const SetShape *shape, unsigned long tag, int core, SetMatch *match){
+    const unsigned int assoc = ASSOC ? ASSOC : shape->assoc;
+    const __m128i tag_v = _mm_set1_epi64x(tag);
+    const __m128i none_v = _mm_set1_epi8(-1);
+    const __m128i core_v = _mm_set1_epi8(core);
+
+    match->hits = match->unowned = match->own = 0;
+    for (unsigned int way = 0; way < assoc; way += 2){
+        /* SSE2 has no 64-bit compare: a tag matches when both of its halves do */
+        __m128i tags = _mm_loadu_si128((const __m128i *) (block + sizeof(unsigned long) * way));
+        __m128i halves = _mm_cmpeq_epi32(tags, tag_v);
+        __m128i both = _mm_and_si128(halves, _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1)));
+        match->hits |= (unsigned int) _mm_movemask_pd(_mm_castsi128_pd(both)) << way;
+    }
+    for (unsigned int way = 0; way < assoc; way += 16){
+        __m128i owners = _mm_loadu_si128((const __m128i *) (block + shape->owner_offset + way));
+        match->unowned |= (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(owners, none_v)) << way;
+        match->own |= (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(owners, core_v)) << way;
+    }
+    finish_match(block, shape, match);
+}
+
+template <unsigned int ASSOC>
+__attribute__((target("avx2")))
+void match_set_avx2(const unsigned char *block, const SetShape *shape, unsigned long tag, int core, SetMatch *match){
+    const unsigned int assoc = ASSOC ? ASSOC : shape->assoc;
+    const __m256i tag_v = _mm256_set1_epi64x(tag);
+
+    match->hits = 0;
+    for (unsigned int way = 0; way < assoc; way += 4){
+        __m256i tags = _mm256_loadu_si256((const __m256i *) (block + sizeof(unsigned long) * way));
+        match->hits |= (unsigned int) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(tags, tag_v))) << way;
+    }
+
+    /* Up to 16 owners fit in one SSE compare, more need the full 32 bytes */
+    if (assoc <= 16){
+        __m128i owners = _mm_loadu_si128((const __m128i *) (block + shape->owner_offset));
+        match->unowned = _mm_movemask_epi8(_mm_cmpeq_epi8(owners, _mm_set1_epi8(-1)));
+        match->own = _mm_movemask_epi8(_mm_cmpeq_epi8(owners, _mm_set1_epi8(core)));
+    }
+    else{
+        __m256i owners = _mm256_loadu_si256((const __m256i *) (block + shape->owner_offset));
+        match->unowned = _mm256_movemask_epi8(_mm256_cmpeq_epi8(owners, _mm256_set1_epi8(-1)));
+        match->own = _mm256_movemask_epi8(_mm256_cmpeq_epi8(owners, _mm256_set1_epi8(core)));
+    }
+    finish_match(block, shape, match);
+}
+
+template <unsigned int ASSOC>
+LookupKernel select_lookup_kernel(LookupIsa isa){
+    switch (isa){
+        case LOOKUP_AVX2: return match_set_avx2<ASSOC>;
+        case LOOKUP_SSE2: return match_set_sse2<ASSOC>;
+        default: return match_set_scalar<ASSOC>;
+    }
+}
+
+static inline LookupIsa detect_lookup_isa(){
+    /* AVX2 needs the CPU flag and the OS saving the upper halves of the ymm registers */
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return LOOKUP_SSE2;
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return LOOKUP_SSE2;
+
+    unsigned int xcr0_low, xcr0_high;
+    __asm__ ("xgetbv" : "=a" (xcr0_low), "=d" (xcr0_high) : "c" (0));
+    if ((xcr0_low & 6) != 6)
+        return LOOKUP_SSE2;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & bit_AVX2))
+        return LOOKUP_SSE2;
+    return LOOKUP_AVX2;
+}
+
+static inline bool parse_lookup_isa(const std::string &name, LookupIsa *isa){
+    if (name == "auto") *isa = detect_lookup_isa();
+    else if (name == "avx2") *isa = LOOKUP_AVX2;
+    else if (name == "sse2") *isa = LOOKUP_SSE2;
+    else if (name == "scalar") *isa = LOOKUP_SCALAR;
+    else return false;
+    return true;
+}
+
+#endif
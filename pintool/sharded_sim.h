@@ -0,0 +1,356 @@
+#ifndef SHARDED_SIM_H
+#define SHARDED_SIM_H
+
+/*
+    Set-partitioned simulation (-shards): one Hierarchy per shard, each simulated by its own worker
+    thread. Include after sharp_sim.h.
+
+    Every cache picks an address's set from the low bits of its line number. With every level on the
+    same line size and <shards> a power of two no larger than the set count of any cache, the low
+    log2(shards) line bits pick the shard.
+    An address, its set at every level and every line its load can evict, back-invalidate or
+    release then all belong to the same shard, so inclusion never crosses shards. Each shard
+    builds the whole hierarchy but only ever touches its own sets, and sets are allocated on use.
+
+    The front end (the thread simulating the victim) routes each access into its shard's
+    single-producer single-consumer ring. A shard runs its accesses in the order they were routed,
+    which is everything an access depends on, so a stream gives the same contents and latencies as
+    one Hierarchy until SHARP first evicts a random victim (step 3): each shard draws them from its
+    own streams, so from then on a sharded run differs from an unsharded one. Noise is drawn
+    by the front end in program order from the streams a lone Hierarchy uses. Timed loads (spies)
+    wait on a ShardFuture, a probe issues all its loads before waiting for the first one, and
+    loads nobody times (the victim's) do not wait at all. Reading counters or contents needs
+    quiesce() first, which waits for every ring to drain.
+
+    Waiting threads spin, then sleep on a semaphore: the host may have fewer cpus than shards.
+    A thread announces it sleeps, checks once more and only then sleeps, while the other side
+    publishes its progress before checking for a sleeper, so no wake-up is lost. The front end
+    wakes a sleeping worker once a batch is waiting for it, or before it waits for the worker.
+*/
+
+#define SHARD_RING 4096 /* Accesses a ring holds, a power of two */
+#define SHARD_SPIN 1024 /* Polls before a waiting thread goes to sleep */
+#define SHARD_BATCH 256 /* Accesses queued before a sleeping worker is woken for them */
+
+typedef struct Shard_Future {
+    volatile bool done;
+    unsigned long latency; /* Written before <done> */
+} ShardFuture;
+
+typedef struct Shard_Request {
+    unsigned long addr;
+    int core;
+    AccessKind kind;
+    ShardFuture *future; /* NULL when nobody waits for the latency */
+} ShardRequest;
+
+class ShardedHierarchy;
+
+typedef struct Shard {
+    /* Ring indices on their own host lines: the front end writes <tail>, the worker <head> */
+    volatile unsigned long tail __attribute__((aligned(64))); /* Next slot to fill */
+    volatile unsigned long head __attribute__((aligned(64))); /* Next slot to simulate, slots before it are free */
+    ShardRequest slots[SHARD_RING];
+    volatile bool sleeping; /* The worker waits for <wake> */
+    PIN_SEMAPHORE wake;
+    Hierarchy *hierarchy;
+    ShardedHierarchy *owner;
+    PIN_THREAD_UID uid;
+} __attribute__((aligned(64))) Shard;
+
+VOID shard_worker(VOID *arg);
+
+class ShardedHierarchy {
+public:
+    unsigned int shard_count;
+    unsigned long shard_mask;
+    unsigned int blk_bits;
+    unsigned int cores;
+    Shard *shards;
+    CoreRng *rngs; /* Front end noise, the streams of a lone Hierarchy */
+    bool running; /* Workers started and not stopped: otherwise accesses run on the caller */
+    volatile bool stopping;
+    volatile bool waiting; /* The front end waits for <answered> */
+    PIN_SEMAPHORE answered;
+    vector<ShardFuture> futures; /* Of the probe in flight */
+
+    ShardedHierarchy(const Topology &topology, unsigned int count){
+        /* Every set count must be a power of two holding <count> shards, every line the LLC's size */
+        unsigned long fewest_sets = ~0UL;
+        const LevelConfig *levels[MAX_PRIVATE_LEVELS + 1];
+        for (unsigned int level = 0; level < topology.private_levels; level++) levels[level] = &topology.level[level];
+        levels[topology.private_levels] = &topology.llc;
+        for (unsigned int level = 0; level <= topology.private_levels; level++){
+            const LevelConfig *config = levels[level];
+            unsigned long sets = config->size * 1024UL / config->line_size / config->assoc;
+            if (level == topology.private_levels) sets /= topology.llc_slices;
+            if (!is_pow2(sets)) fewest_sets = 0;
+            else fewest_sets = min(fewest_sets, sets);
+            if (config->line_size != topology.llc.line_size){
+                /* Shards are picked by LLC line, a private line spanning several would cross them */
+                cerr << "Shards need every cache level to use the L3's line size (" << topology.llc.line_size << "B)" << endl;
+                exit(1);
+            }
+        }
+        if (!is_pow2(count) || count > fewest_sets){
+            cerr << "Shards must be a power of two up to the sets of the smallest cache (" << fewest_sets << "), all of them a power of two" << endl;
+            exit(1);
+        }
+
+        shard_count = count;
+        shard_mask = count - 1;
+        blk_bits = floor_log2(topology.llc.line_size);
+        cores = topology.cores;
+        Topology alone = topology;
+        alone.concurrent = false; /* One worker per shard */
+        if (posix_memalign((void **) &shards, 64, count * sizeof(Shard)) != 0 ||
+            posix_memalign((void **) &rngs, 64, cores * sizeof(CoreRng)) != 0){
+            cerr << "Could not allocate " << count << " shards" << endl;
+            exit(1);
+        }
+        for (unsigned int s = 0; s < count; s++){
+            Shard *shard = &shards[s];
+            shard->tail = shard->head = 0;
+            shard->sleeping = false;
+            PIN_SemaphoreInit(&shard->wake);
+            shard->owner = this;
+            shard->hierarchy = new Hierarchy(alone);
+            for (unsigned int core = 0; core < cores && s > 0; core++){
+                /* Shard 0 keeps the lone Hierarchy's step 3 streams, the others take indexes above any core */
+                shard->hierarchy->rngs[core].evict.seed(topology.seed, STREAM_EVICT, ((unsigned long) s << 6) | core);
+            }
+        }
+        for (unsigned int core = 0; core < cores; core++){
+            rngs[core].seed(topology.seed, core, topology.noise);
+        }
+        running = false;
+        stopping = false;
+        waiting = false;
+        PIN_SemaphoreInit(&answered);
+    }
+
+    ~ShardedHierarchy(){
+        stop();
+        for (unsigned int s = 0; s < shard_count; s++) delete shards[s].hierarchy;
+        free(shards);
+        free(rngs);
+    }
+
+    bool start(){
+        /* One worker per shard. False if one could not be spawned, accesses then run on the caller */
+        for (unsigned int s = 0; s < shard_count; s++){
+            if (PIN_SpawnInternalThread(shard_worker, &shards[s], 0, &shards[s].uid) == INVALID_THREADID){
+                join(s);
+                return false;
+            }
+        }
+        running = true;
+        return true;
+    }
+
+    void stop(){
+        /* Pin wants internal threads gone before Fini, later accesses run on the caller */
+        if (!running) return;
+        quiesce();
+        join(shard_count);
+        running = false;
+    }
+
+    void join(unsigned int workers){
+        /* The first <workers> workers are idle, let them end */
+        stopping = true;
+        for (unsigned int s = 0; s < workers; s++){
+            PIN_SemaphoreSet(&shards[s].wake);
+            PIN_WaitForThreadTermination(shards[s].uid, PIN_INFINITE_TIMEOUT, NULL);
+        }
+        stopping = false;
+    }
+
+    void answer(){
+        /* A worker published progress: wake the front end if it sleeps on it */
+        if (__atomic_load_n(&waiting, __ATOMIC_SEQ_CST)){
+            waiting = false;
+            PIN_SemaphoreSet(&answered);
+        }
+    }
+
+    void doze(unsigned int *polls){
+        /* The front end waits for a worker: spin, then announce it (its loop checks once more), then sleep */
+        if (++*polls < SHARD_SPIN) return;
+        if (*polls == SHARD_SPIN){
+            PIN_SemaphoreClear(&answered);
+            __atomic_store_n(&waiting, true, __ATOMIC_SEQ_CST);
+            return;
+        }
+        PIN_SemaphoreWait(&answered);
+        *polls = 0;
+    }
+
+    void work(Shard *shard){
+        /* Worker: simulates what the front end published, then frees the slots all at once */
+        unsigned int polls = 0;
+        while (true){
+            unsigned long head = shard->head;
+            unsigned long tail = __atomic_load_n(&shard->tail, __ATOMIC_ACQUIRE);
+            if (head == tail){
+                if (stopping) return;
+                /* Idle: spin, then announce it and look once more, then sleep until the front end publishes */
+                if (++polls < SHARD_SPIN) continue;
+                if (polls == SHARD_SPIN){
+                    PIN_SemaphoreClear(&shard->wake);
+                    __atomic_store_n(&shard->sleeping, true, __ATOMIC_SEQ_CST);
+                    continue;
+                }
+                PIN_SemaphoreWait(&shard->wake);
+                polls = 0;
+                continue;
+            }
+            polls = 0;
+            for (; head != tail; head++){
+                ShardRequest *request = &shard->slots[head & (SHARD_RING - 1)];
+                unsigned long latency = shard->hierarchy->load(request->addr, request->core, request->kind);
+                if (request->future != NULL){
+                    request->future->latency = latency;
+                    __atomic_store_n(&request->future->done, true, __ATOMIC_SEQ_CST);
+                    answer();
+                }
+            }
+            __atomic_store_n(&shard->head, head, __ATOMIC_SEQ_CST);
+            answer();
+        }
+    }
+
+    Shard *shard_of(unsigned long addr){
+        return &shards[(addr >> blk_bits) & shard_mask];
+    }
+
+    Hierarchy *hierarchy_of(unsigned long addr){
+        return shard_of(addr)->hierarchy;
+    }
+
+    void submit(unsigned long addr, int core, AccessKind kind, ShardFuture *future){
+        Shard *shard = shard_of(addr);
+        if (!running){
+            unsigned long latency = shard->hierarchy->load(addr, core, kind);
+            if (future != NULL){
+                future->latency = latency;
+                future->done = true;
+            }
+            return;
+        }
+        unsigned long tail = shard->tail;
+        unsigned int polls = 0;
+        while (tail - __atomic_load_n(&shard->head, __ATOMIC_SEQ_CST) == SHARD_RING){
+            rouse(shard);
+            doze(&polls);
+        }
+        ShardRequest *request = &shard->slots[tail & (SHARD_RING - 1)];
+        request->addr = addr;
+        request->core = core;
+        request->kind = kind;
+        request->future = future;
+        __atomic_store_n(&shard->tail, tail + 1, __ATOMIC_SEQ_CST);
+        if (future != NULL || tail + 1 - shard->head >= SHARD_BATCH) rouse(shard);
+    }
+
+    void rouse(Shard *shard){
+        /* Wake the worker of <shard> if it sleeps, after publishing what it has to do */
+        if (__atomic_load_n(&shard->sleeping, __ATOMIC_SEQ_CST)){
+            shard->sleeping = false;
+            PIN_SemaphoreSet(&shard->wake);
+        }
+    }
+
+    unsigned long wait(ShardFuture *future){
+        unsigned int polls = 0;
+        while (!__atomic_load_n(&future->done, __ATOMIC_SEQ_CST)) doze(&polls);
+        return future->latency;
+    }
+
+    void post(unsigned long addr, int core, AccessKind kind, bool observed){
+        /* An access whose latency nobody reads. <observed>: it stands for an observe(), so its noise is drawn */
+        submit(addr, core, kind, NULL);
+        if (observed && CACHE_NOISE_ENABLED) rngs[core].noise.draw();
+    }
+
+    unsigned long load(unsigned long addr, int core, AccessKind kind = ACCESS_DATA){
+        ShardFuture future = {false, 0};
+        submit(addr, core, kind, &future);
+        return wait(&future);
+    }
+
+    unsigned long observe(unsigned long addr, int core, AccessKind kind = ACCESS_DATA){
+        /* A load as its core times it, see Hierarchy::observe */
+        ShardFuture future = {false, 0};
+        submit(addr, core, kind, &future);
+        long noise = CACHE_NOISE_ENABLED ? rngs[core].noise.draw() : 0;
+        return wait(&future) + noise;
+    }
+
+    void observe_all(const unsigned long *addrs, unsigned int count, int core, unsigned long *latencies){
+        /* Timed loads of one core whose latencies are read once all are issued, e.g. a probe of an eviction set */
+        if (futures.size() < count) futures.resize(count);
+        for (unsigned int i = 0; i < count; i++){
+            futures[i].done = false;
+            submit(addrs[i], core, ACCESS_DATA, &futures[i]);
+        }
+        for (unsigned int i = 0; i < count; i++){
+            long noise = CACHE_NOISE_ENABLED ? rngs[core].noise.draw() : 0;
+            latencies[i] = wait(&futures[i]) + noise;
+        }
+    }
+
+    void quiesce(){
+        /* Every access routed so far is simulated */
+        if (!running) return;
+        for (unsigned int s = 0; s < shard_count; s++) rouse(&shards[s]);
+        for (unsigned int s = 0; s < shard_count; s++){
+            unsigned int polls = 0;
+            while (__atomic_load_n(&shards[s].head, __ATOMIC_SEQ_CST) != shards[s].tail) doze(&polls);
+        }
+    }
+
+    /* Totals over the shards, after quiesce() */
+    unsigned long alarms(unsigned int slice, unsigned int core){
+        unsigned long total = 0;
+        for (unsigned int s = 0; s < shard_count; s++) total += shards[s].hierarchy->slices[slice]->alarm_counter[core];
+        return total;
+    }
+
+    unsigned long take_alarms(unsigned int slice, unsigned int core){
+        /* Ends an alarm window: the total, and every shard starts over */
+        unsigned long total = alarms(slice, core);
+        for (unsigned int s = 0; s < shard_count; s++) shards[s].hierarchy->slices[slice]->alarm_counter[core] = 0;
+        return total;
+    }
+
+    unsigned long llc_misses(){
+        unsigned long total = 0;
+        for (unsigned int s = 0; s < shard_count; s++) total += shards[s].hierarchy->llc_misses();
+        return total;
+    }
+
+    unsigned long llc_accesses(){
+        unsigned long total = 0;
+        for (unsigned int s = 0; s < shard_count; s++) total += shards[s].hierarchy->llc_accesses();
+        return total;
+    }
+
+    unsigned long filtered_accesses(){
+        unsigned long total = 0;
+        for (unsigned int s = 0; s < shard_count; s++) total += shards[s].hierarchy->filtered_accesses();
+        return total;
+    }
+
+    void reset_stats(){
+        quiesce();
+        for (unsigned int s = 0; s < shard_count; s++) shards[s].hierarchy->reset_stats();
+    }
+};
+
+VOID shard_worker(VOID *arg){
+    Shard *shard = (Shard *) arg;
+    shard->owner->work(shard);
+}
+
+#endif
@@ -4,19 +4,18 @@ import re
 
 results = {}
 
-def parse_out(out):
-    lines = out.split(b'\n')
-    d = None
-    leakedKey = None
-    for line in lines:
+def parse_key(out):
+    #The victim prints the real key while it is recorded
+    for line in out.split(b'\n'):
         if line.startswith(b'd = '):
-            d = line.split(b'd = ')[1]
-        elif line.startswith(b'Key: '):
-            leakedKey = line.split(b'Key: ')[1]
-    assert d is not None, out
-    assert leakedKey is not None, out
-    size = len(d)
-    return d, leakedKey[-size:].zfill(size)
+            return line.split(b'd = ')[1]
+    assert False, out
+
+def parse_leaked(out, size):
+    for line in out.split(b'\n'):
+        if line.startswith(b'Key: '):
+            return line.split(b'Key: ')[1][-size:].zfill(size)
+    assert False, out
 
 def save_results(d, leaked, noise):
     #d = real key
@@ -27,15 +26,20 @@ def save_results(d, leaked, noise):
         f.write(str(results))
 
 #Compile
-os.system('make obj-intel64/pin_sharp_cache.so')
+os.system('make obj-intel64/pin_sharp_cache.so trace_replay')
 
-#Waittime = 0.  Cache noise is personalized
-RUN_CMD = ['pin', '-t', 'obj-intel64/pin_sharp_cache.so', 'ifeellucky', '0x4014e3', '0x4016dc', '0', 'CACHENOISE', '--',  './rsa']
+#The victim does not depend on the caches: run it under Pin once, then replay its trace for every noise value
+RECORD_CMD = ['pin', '-ifeellucky', '-t', 'obj-intel64/pin_sharp_cache.so', '-record', 'rsa.trace', '-square', 'square', '-multiply', 'multiply', '--',  './rsa']
+d = parse_key(subprocess.check_output(RECORD_CMD))
 
-for noise in range(1,100, 2):
-    print("Running for noise =", noise)
-    RUN_CMD[7] = str(noise) #Change cache noise argument to specified value
+#Waittime = 0. One replay simulates every noise value, each as its own instance
+NOISES = list(range(1,100, 2))
+RUN_CMD = ['./trace_replay', '-noise_grid', ','.join(str(noise) for noise in NOISES), '-wait', '0', '--', 'rsa.trace']
 
-    out = subprocess.check_output(RUN_CMD)
-    d, leaked = parse_out(out)
+print("Running for noise =", NOISES)
+out = subprocess.check_output(RUN_CMD)
+#Instances report one after the other, each starting with an "Instance <n>: cache_noise <noise>, ..." line
+for report in re.split(b'\nInstance \\d+: ', out)[1:]:
+    noise = int(re.match(b'cache_noise (\\d+)', report).group(1))
+    leaked = parse_leaked(report, len(d))
     save_results(d, leaked, noise)
@@ -0,0 +1,1138 @@
+#ifndef SHARP_SIM_H
+#define SHARP_SIM_H
+
+/*
+    The simulated cache hierarchy: private caches per core in front of a shared, inclusive,
+    sliced LLC with SHARP replacement. Knows nothing of Pin, spies or the victim, so the pintool,
+    trace_replay, sim_test and sim_bench all build on it.
+
+    Hierarchies are built from a Topology and driven with load() (latency) or observe() (latency
+    as the core times it, noise included). Concurrent hierarchies lock with PIN_LOCK: include
+    pin.H (the pintool) or pin_shim.h (everything else) before this header.
+*/
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "replacement.h"
+#include "set_lookup.h"
+#include "rng.h"
+#include "checkpoint.h"
+#include "metrics.h"
+
+using namespace std;
+
+/* Default geometry, override with -line_size, -l2_size, -l2_assoc, -l3_size and -l3_assoc */
+#define LINE_SIZE 64
+#define L2_ASSOC 4
+#define L3_ASSOC 16
+
+#define L1_CACHE_MISS_PENALTY 12
+#define L2_CACHE_MISS_PENALTY 40
+#define L3_CACHE_MISS_PENALTY 120
+
+#define CACHE_NOISE_ENABLED true /* Noise is drawn in batches from per-core streams, see rng.h */
+#define CACHE_NOISE 10 // Maximum noise in cycles introduced by the cache. times will vary between -CACHE_NOISE/2 and CACHE_NOISE/2
+#define CACHE_PAGE_BYTES 4096 /* Sets are allocated about a host page at a time, see Cache */
+
+typedef struct Cache_Answer {
+    bool miss; /* Whether it was a miss */
+    bool evicted; /* Whether a valid address was evicted */
+    unsigned long evicted_addr; /* Which addr was evicted if so */
+    unsigned int evicted_core; /* Core that the evicted addr belongs to. Only used for L3 evictions */
+    unsigned long penalty; /* Time penalty. If it was a hit, hit time. Otherwise, Miss time */
+    unsigned long line; /* set * associativity + way holding the address after the access */
+} CacheAnswer;
+
+static LookupIsa lookup_isa = detect_lookup_isa(); /* Set lookup kernel, -lookup overrides it */
+
+static inline unsigned int floor_log2(unsigned long x){
+    return 63 - __builtin_clzl(x);
+}
+
+static inline bool is_pow2(unsigned long x){
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+constexpr unsigned int cache_page_shift(unsigned long stride, unsigned long sets, unsigned int shift = 0){
+    /* log2 of the sets of a page: about CACHE_PAGE_BYTES of them, never more than the cache has */
+    return (stride << (shift + 1)) <= CACHE_PAGE_BYTES && (1UL << (shift + 1)) <= sets ? cache_page_shift(stride, sets, shift + 1) : shift;
+}
+
+class Cache {
+    /*
+        Sets live in pages of <page_sets> consecutive sets, <set_stride> bytes per set, found through
+        the <pages> directory. A page is allocated and filled with empty sets the first time one of its
+        sets is used, so sets the simulation never touches cost no memory and building a large LLC
+        only allocates the directory. Lookups of untouched sets (find_way) leave them unallocated.
+        Each set is laid out as packed per-way arrays, padded to whole host lines (set_lookup.h), so that
+        a lookup touches as few of them as the set's bytes allow (one or two up to 12 ways with LRU, three at 16):
+            unsigned long tags[associativity]   tag bits of each way (address without set and block bits)
+            unsigned char repl[...]             replacement state, see replacement.h
+            signed char   owner[associativity]  SHARP owner core, -1 if no private cache holds the line
+            unsigned int  valid                 one bit per way
+        Tags keep every address bit above the set index, so no two lines alias whatever the set count.
+
+        This class holds the state and the cold paths. load() is implemented by CacheImpl,
+        either specialized for a fixed geometry or generic. Build caches with make_cache().
+        Sets are searched with the lookup kernel chosen at startup (set_lookup.h).
+    */
+    public:
+        unsigned long accesses;
+        unsigned long misses;
+        unsigned int size;
+        unsigned int line_size;
+        unsigned int miss_penalty;
+        unsigned int hit_time; /* Set by the Hierarchy, which knows the noise level */
+        unsigned int associativity;
+
+        unsigned long block_off_mask;
+
+        unsigned long blk_bits;
+        unsigned long tag_shift;
+        unsigned long set_number;
+        bool pow2_sets; /* Otherwise sets are indexed by line number modulo set_number */
+
+        unsigned char **pages; /* NULL until one of their sets is touched */
+        unsigned long page_count;
+        unsigned int page_shift; /* log2 of <page_sets> */
+        unsigned long page_sets;
+        unsigned char *empty_set; /* No tags, fresh replacement state, no owners */
+        unsigned long set_stride;
+        unsigned long repl_offset;
+        unsigned long owner_offset;
+        unsigned long valid_offset;
+        unsigned int all_ways;
+        SetShape shape;
+        LookupKernel kernel;
+
+        ReplacementPolicy policy;
+        bool specialized;
+    
+        // SHARP data
+        bool sharp;
+        unsigned long * alarm_counter; /* Per core, allocated by the Hierarchy that knows the cores */
+        CoreRng *rngs; /* The Hierarchy's streams, step 3 victims */
+
+        /* -metrics counters, allocated by the Hierarchy. NULL when not measured */
+        CoreCounters *core_stats; /* Per core */
+        SetCounters *set_stats; /* Per set */
+
+        /*
+            Inclusion links, indexed by line (set * associativity + way). Only allocated when used:
+                backing - private caches: line of the next level holding the same address
+                sharers - shared caches: private caches holding the line, one bit per core
+        */
+        unsigned int * backing;
+        unsigned long * sharers;
+        
+        Cache(unsigned int s, unsigned int ls, unsigned int mp, unsigned int a, bool sp, ReplacementPolicy rp) {
+            size = s;
+            line_size = ls;
+            miss_penalty = mp;
+            hit_time = 1;
+            associativity = a;
+            policy = rp;
+            specialized = false;
+            accesses = 0;
+            misses = 0;
+
+            if (!is_pow2(line_size) || associativity == 0 || associativity > 32 || size * 1024UL % (line_size * associativity) != 0){
+                cerr << "Unsupported cache geometry: " << size << "KB, " << line_size << "B lines, " << associativity << " ways" << endl;
+                exit(1);
+            }
+            if (policy == REPL_PLRU && !is_pow2(associativity)){
+                cerr << "Tree PLRU needs a power of two associativity, got " << associativity << endl;
+                exit(1);
+            }
+
+            set_number = size * 1024UL / line_size / associativity;
+            pow2_sets = is_pow2(set_number);
+
+            blk_bits = floor_log2(line_size);
+            tag_shift = pow2_sets ? blk_bits + floor_log2(set_number) : 0;
+            block_off_mask = line_size - 1;
+            all_ways = associativity == 32 ? 0xffffffff : (1u << associativity) - 1;
+
+            repl_offset = layout_repl_offset(associativity);
+            owner_offset = layout_owner_offset(associativity, policy);
+            valid_offset = layout_valid_offset(associativity, policy);
+            set_stride = layout_set_stride(associativity, policy);
+
+            shape.assoc = associativity;
+            shape.all_ways = all_ways;
+            shape.owner_offset = owner_offset;
+            shape.valid_offset = valid_offset;
+            kernel = select_lookup_kernel<0>(lookup_isa);
+
+            /* Build one empty set, pages replicate it when they are first touched */
+            empty_set = (unsigned char *) malloc(set_stride);
+            memset(empty_set, 0, set_stride);
+            repl_init(empty_set + repl_offset);
+            memset(empty_set + owner_offset, 0xff, associativity);
+
+            page_shift = cache_page_shift(set_stride, set_number);
+            page_sets = 1UL << page_shift;
+            page_count = (set_number + page_sets - 1) >> page_shift;
+            pages = (unsigned char **) calloc(page_count, sizeof(unsigned char *));
+            
+            sharp = sp;
+            alarm_counter = NULL;
+            rngs = NULL;
+            core_stats = NULL;
+            set_stats = NULL;
+            backing = NULL;
+            sharers = NULL;
+        }
+
+        virtual ~Cache(){
+            for (unsigned long page = 0; page < page_count; page++) free(pages[page]);
+            free(pages);
+            free(empty_set);
+            free(alarm_counter);
+            free(core_stats);
+            free(set_stats);
+            free(backing);
+            free(sharers);
+        }
+
+        void track_backing(){
+            if (backing == NULL) backing = (unsigned int *) calloc(set_number * associativity, sizeof(unsigned int));
+        }
+
+        void track_sharers(){
+            if (sharers == NULL) sharers = (unsigned long *) calloc(set_number * associativity, sizeof(unsigned long));
+        }
+
+        virtual void load(CacheAnswer *result, unsigned long addr, int core) = 0;
+
+        __attribute__((noinline)) unsigned char *materialize(unsigned long page){
+            /* First touch of <page>: fill it with empty sets. Loads of another core may race for it, one allocation wins */
+            unsigned char *sets;
+            if (posix_memalign((void **) &sets, 64, (set_stride << page_shift) + LOOKUP_PADDING) != 0){
+                cerr << "Could not allocate " << (set_stride << page_shift) << " bytes for cache sets" << endl;
+                exit(1);
+            }
+            for (unsigned long set = 0; set < page_sets; set++){
+                memcpy(sets + set * set_stride, empty_set, set_stride);
+            }
+            memset(sets + (set_stride << page_shift), 0, LOOKUP_PADDING);
+            unsigned char *winner = __sync_val_compare_and_swap(&pages[page], (unsigned char *) NULL, sets);
+            if (winner == NULL) return sets;
+            free(sets);
+            return winner;
+        }
+
+        unsigned char *set_block(unsigned long set, unsigned long stride, unsigned int shift){
+            /* <stride> and <shift>: set_stride and page_shift, constants for fixed geometries */
+            unsigned char *page = pages[set >> shift];
+            if (__builtin_expect(page == NULL, 0)) page = materialize(set >> shift);
+            return page + (set & ((1UL << shift) - 1)) * stride;
+        }
+
+        unsigned char *resident_block(unsigned long set){
+            /* A set some line was filled in, so its page exists */
+            return pages[set >> page_shift] + (set & (page_sets - 1)) * set_stride;
+        }
+
+        unsigned long touched_sets(){
+            /* Sets of the pages allocated so far */
+            unsigned long touched = 0;
+            for (unsigned long page = 0; page < page_count; page++){
+                if (pages[page] != NULL) touched += page_sets;
+            }
+            return touched;
+        }
+
+        void count_miss(int core, unsigned long set, int step, bool replaced){
+            /*
+                <step>: SHARP step that found the way, 0 without SHARP.
+                <replaced>: the way held a valid line, even an unowned one SHARP's step 1 drops without back-invalidating
+            */
+            core_stats[core].misses++;
+            set_stats[set].misses++;
+            if (step > 0) core_stats[core].sharp_steps[step - 1]++;
+            if (replaced){
+                core_stats[core].evictions++;
+                set_stats[set].evictions++;
+            }
+        }
+
+        unsigned long *set_tags(unsigned long set){
+            return (unsigned long *) set_block(set, set_stride, page_shift);
+        }
+
+        unsigned char *set_repl(unsigned long set){
+            return set_block(set, set_stride, page_shift) + repl_offset;
+        }
+
+        signed char *set_owners(unsigned long set){
+            return (signed char *) (set_block(set, set_stride, page_shift) + owner_offset);
+        }
+
+        unsigned int *set_valid(unsigned long set){
+            return (unsigned int *) (set_block(set, set_stride, page_shift) + valid_offset);
+        }
+
+        unsigned long addr_tag(unsigned long addr){
+            if (pow2_sets) return addr >> tag_shift;
+            return (addr >> blk_bits) / set_number;
+        }
+
+        unsigned long get_set_index(unsigned long addr){
+            if (pow2_sets) return (addr >> blk_bits) & (set_number - 1);
+            return (addr >> blk_bits) % set_number;
+        }
+
+        unsigned long reconstruct_addr(unsigned long tag, unsigned long set){
+            return (tag * set_number + set) << blk_bits;
+        }
+
+        int find_way(unsigned long set, unsigned long addr){
+            /* Way holding <addr> in <set>, or -1. Does not touch replacement state */
+            unsigned char *page = pages[set >> page_shift];
+            if (page == NULL) return -1;
+            SetMatch match;
+            kernel(page + (set & (page_sets - 1)) * set_stride, &shape, addr_tag(addr), -1, &match);
+            return match.hits ? __builtin_ctz(match.hits) : -1;
+        }
+
+        void invalidate(unsigned long set, unsigned int way){
+            *set_valid(set) &= ~(1u << way);
+        }
+
+        signed char *line_owner(unsigned long line){
+            return (signed char *) (resident_block(line / associativity) + owner_offset) + line % associativity;
+        }
+
+        bool line_holds(unsigned long line, unsigned long addr){
+            unsigned char *block = resident_block(line / associativity);
+            unsigned int way = line % associativity;
+            return (*(unsigned int *) (block + valid_offset) & (1u << way)) && ((unsigned long *) block)[way] == addr_tag(addr);
+        }
+
+        void repl_init(unsigned char *state){
+            switch (policy){
+                case REPL_PLRU: TreePlru::init(state, associativity); break;
+                case REPL_SRRIP: Srrip::init(state, associativity); break;
+                default: LruList::init(state, associativity); break;
+            }
+        }
+
+        void touch(unsigned char *state, unsigned int way){
+            /* <way> was hit */
+            switch (policy){
+                case REPL_PLRU: TreePlru::touch(state, associativity, way); break;
+                case REPL_SRRIP: Srrip::touch(state, associativity, way); break;
+                default: LruList::touch(state, associativity, way); break;
+            }
+        }
+
+        void insert(unsigned char *state, unsigned int way){
+            /* <way> was just filled */
+            switch (policy){
+                case REPL_PLRU: TreePlru::insert(state, associativity, way); break;
+                case REPL_SRRIP: Srrip::insert(state, associativity, way); break;
+                default: LruList::insert(state, associativity, way); break;
+            }
+        }
+
+        unsigned int victim(unsigned char *state, unsigned int candidates){
+            /* Way to replace among <candidates>, which must not be empty */
+            switch (policy){
+                case REPL_PLRU: return TreePlru::victim(state, associativity, candidates);
+                case REPL_SRRIP: return Srrip::victim(state, associativity, candidates);
+                default: return LruList::victim(state, associativity, candidates);
+            }
+        }
+
+        unsigned int age(unsigned long set, unsigned int way){
+            unsigned char *state = set_repl(set);
+            switch (policy){
+                case REPL_PLRU: return TreePlru::age(state, associativity, way);
+                case REPL_SRRIP: return Srrip::age(state, associativity, way);
+                default: return LruList::age(state, associativity, way);
+            }
+        }
+
+        void print_contents(){
+            /* Just a debug function. Dont mind me */
+            for (unsigned long set = 0; set < set_number; set++){
+                if (pages[set >> page_shift] == NULL) continue;
+                unsigned long *tags = set_tags(set);
+                signed char *owner = set_owners(set);
+                unsigned int valid = *set_valid(set);
+
+                for (unsigned int way = 0; way < associativity; way++){
+                    if (valid & (1u << way)){
+                        unsigned long tag = reconstruct_addr(tags[way], 0);
+                        if (sharp)
+                            cout << "Set: " << set << " Way: " << way << " Tag: " << tag << " (" << age(set, way) << ")"  << "[" << (int) owner[way] << "]" << endl;
+                        else
+                            cout << "Set: " << set << " Way: " << way << " Tag: " << tag << " (" << age(set, way) << ")" << endl;
+                    }
+                }
+            }
+        }
+
+        void print_config(const char *name){
+            cout << name << ": " << size << "KB, " << line_size << "B lines, " << associativity << " ways, " << replacement_name(policy)
+                 << (sharp ? ", SHARP" : "") << (specialized ? " (specialized, " : " (generic, ") << lookup_isa_name(lookup_isa) << " lookup)" << endl;
+        }
+
+        void save(CheckpointWriter *ckpt, unsigned int cores){
+            /* Which pages are allocated, then each of them as laid out in memory, so restoring is a copy */
+            ckpt->value(accesses);
+            ckpt->value(misses);
+            vector<unsigned char> present(page_count);
+            for (unsigned long page = 0; page < page_count; page++) present[page] = pages[page] != NULL;
+            ckpt->values(present);
+            for (unsigned long page = 0; page < page_count; page++){
+                if (present[page]) ckpt->section(pages[page], set_stride << page_shift);
+            }
+            ckpt->section(alarm_counter, cores * sizeof(unsigned long));
+            if (backing != NULL) ckpt->section(backing, set_number * associativity * sizeof(unsigned int));
+            if (sharers != NULL) ckpt->section(sharers, set_number * associativity * sizeof(unsigned long));
+        }
+
+        bool restore(CheckpointReader *ckpt, unsigned int cores){
+            ckpt->value(&accesses);
+            ckpt->value(&misses);
+            vector<unsigned char> present;
+            if (!ckpt->values(&present) || present.size() != page_count){
+                ckpt->corrupt = true;
+                return false;
+            }
+            for (unsigned long page = 0; page < page_count; page++){
+                if (present[page]){
+                    if (pages[page] == NULL) materialize(page);
+                    ckpt->section(pages[page], set_stride << page_shift);
+                }
+                else{
+                    free(pages[page]);
+                    pages[page] = NULL;
+                }
+            }
+            ckpt->section(alarm_counter, cores * sizeof(unsigned long));
+            if (backing != NULL) ckpt->section(backing, set_number * associativity * sizeof(unsigned int));
+            if (sharers != NULL) ckpt->section(sharers, set_number * associativity * sizeof(unsigned long));
+            return !ckpt->corrupt;
+        }
+};
+
+struct RuntimeGeometry {
+    /* Geometry read from the Cache fields at every access. Works for any shape */
+    static unsigned int assoc(const Cache *c) { return c->associativity; }
+    static unsigned int all_ways(const Cache *c) { return c->all_ways; }
+    static bool sharp(const Cache *c) { return c->sharp; }
+    static unsigned long set_stride(const Cache *c) { return c->set_stride; }
+    static unsigned int page_shift(const Cache *c) { return c->page_shift; }
+    static unsigned long repl_offset(const Cache *c) { return c->repl_offset; }
+    static unsigned long owner_offset(const Cache *c) { return c->owner_offset; }
+    static unsigned long valid_offset(const Cache *c) { return c->valid_offset; }
+    static unsigned long set_index(Cache *c, unsigned long addr) { return c->get_set_index(addr); }
+    static unsigned long tag(Cache *c, unsigned long addr) { return c->addr_tag(addr); }
+    static unsigned long reconstruct(Cache *c, unsigned long tag, unsigned long set) { return c->reconstruct_addr(tag, set); }
+    static void touch(Cache *c, unsigned char *state, unsigned int way) { c->touch(state, way); }
+    static void insert(Cache *c, unsigned char *state, unsigned int way) { c->insert(state, way); }
+    static unsigned int victim(Cache *c, unsigned char *state, unsigned int candidates) { return c->victim(state, candidates); }
+    static LookupKernel lookup_kernel(LookupIsa isa) { return select_lookup_kernel<0>(isa); }
+};
+
+template <unsigned int SIZE, unsigned int LINE, unsigned int ASSOC, ReplacementPolicy POLICY, bool SHARP>
+struct FixedGeometry {
+    /* Everything is a compile-time constant: way loops unroll and masks fold */
+    typedef typename PolicyOf<POLICY>::type Policy;
+    static const unsigned long SETS = SIZE * 1024UL / LINE / ASSOC;
+    static_assert((LINE & (LINE - 1)) == 0 && (SETS & (SETS - 1)) == 0, "Fixed geometries need power of two lines and sets");
+    static_assert(ASSOC > 0 && ASSOC <= 32, "Associativity must fit in the valid mask");
+
+    static unsigned int assoc(const Cache * /* c */) { return ASSOC; }
+    static unsigned int all_ways(const Cache * /* c */) { return ASSOC == 32 ? 0xffffffff : (1u << ASSOC) - 1; }
+    static bool sharp(const Cache * /* c */) { return SHARP; }
+    static unsigned long set_stride(const Cache * /* c */) { return layout_set_stride(ASSOC, POLICY); }
+    static unsigned int page_shift(const Cache * /* c */) { return cache_page_shift(layout_set_stride(ASSOC, POLICY), SETS); }
+    static unsigned long repl_offset(const Cache * /* c */) { return layout_repl_offset(ASSOC); }
+    static unsigned long owner_offset(const Cache * /* c */) { return layout_owner_offset(ASSOC, POLICY); }
+    static unsigned long valid_offset(const Cache * /* c */) { return layout_valid_offset(ASSOC, POLICY); }
+    static unsigned long set_index(Cache * /* c */, unsigned long addr) { return (addr / LINE) & (SETS - 1); }
+    static unsigned long tag(Cache * /* c */, unsigned long addr) { return addr / LINE / SETS; }
+    static unsigned long reconstruct(Cache * /* c */, unsigned long tag, unsigned long set) { return (tag * SETS + set) * LINE; }
+    static void touch(Cache * /* c */, unsigned char *state, unsigned int way) { Policy::touch(state, ASSOC, way); }
+    static void insert(Cache * /* c */, unsigned char *state, unsigned int way) { Policy::insert(state, ASSOC, way); }
+    static unsigned int victim(Cache * /* c */, unsigned char *state, unsigned int candidates) { return Policy::victim(state, ASSOC, candidates); }
+    static LookupKernel lookup_kernel(LookupIsa isa) { return select_lookup_kernel<ASSOC>(isa); }
+};
+
+template <class G>
+class CacheImpl : public Cache {
+    public:
+        CacheImpl(unsigned int s, unsigned int ls, unsigned int mp, unsigned int a, bool sp, ReplacementPolicy rp) : Cache(s, ls, mp, a, sp, rp) {
+            kernel = G::lookup_kernel(lookup_isa);
+        }
+
+        void fill_way(CacheAnswer *result, unsigned char *block, unsigned long set, unsigned int way, unsigned long tag){
+            result->line = set * G::assoc(this) + way;
+            ((unsigned long *) block)[way] = tag;
+            *(unsigned int *) (block + G::valid_offset(this)) |= 1u << way;
+            G::insert(this, block + G::repl_offset(this), way);
+        }
+
+        void evict_lru_block(CacheAnswer *result, unsigned char *block, unsigned long set, unsigned long tag, const SetMatch &match){
+            /* Usual eviction policy. Invalidated ways are refilled before anything is evicted */
+            unsigned int way;
+            if (match.first_invalid >= 0) way = match.first_invalid;
+            else way = G::victim(this, block + G::repl_offset(this), G::all_ways(this));
+
+            if (match.first_invalid < 0){
+                result->evicted = true;
+                result->evicted_addr = G::reconstruct(this, ((unsigned long *) block)[way], set);
+                result->evicted_core = 0; // Not used
+            }
+
+            fill_way(result, block, set, way, tag);
+        }
+    
+        int evict_sharp_block (CacheAnswer *result, unsigned char *block, unsigned long set, unsigned long tag, int core, const SetMatch &match) {
+            /* Sharp's eviction policy. Each step picks the replacement policy's victim among its own candidates. Returns the step */
+            signed char *owner = (signed char *) (block + G::owner_offset(this));
+            unsigned int valid = *(unsigned int *) (block + G::valid_offset(this));
+            unsigned char *state = block + G::repl_offset(this);
+            unsigned int unowned = match.unowned;
+            unsigned int own = match.own;
+
+            // STEP 1: check if a way is unused
+            if (unowned) {
+                unsigned int candidate = G::victim(this, state, unowned);
+                result->evicted = false;
+                result->evicted_addr = 0;
+                result->evicted_core = 0;
+                fill_way(result, block, set, candidate, tag);
+                owner[candidate] = core;
+                return 1;
+            }
+
+            // STEP 2: check if a way is owned by calling processor
+            if (own) {
+                unsigned int candidate = G::victim(this, state, own);
+                if (valid & (1u << candidate)){
+                    result->evicted = true;
+                    result->evicted_addr = G::reconstruct(this, ((unsigned long *) block)[candidate], set);
+                    result->evicted_core = core;
+                }
+                fill_way(result, block, set, candidate, tag);
+                owner[candidate] = core;
+                return 2;
+            }
+            
+            // STEP 3: evict something randomly
+            unsigned int candidate = rngs[core].evict.below(G::assoc(this));
+            if (valid & (1u << candidate)){
+                result->evicted = true;
+                result->evicted_addr = G::reconstruct(this, ((unsigned long *) block)[candidate], set);
+                result->evicted_core = owner[candidate];
+            }
+            fill_way(result, block, set, candidate, tag);
+            owner[candidate] = core;
+            alarm_counter[core]++; // Update alarm counter
+            return 3;
+  
+        }
+
+        void load(CacheAnswer *result, unsigned long addr, int core){
+            accesses++;
+            
+            unsigned long set = G::set_index(this, addr);
+            unsigned long tag = G::tag(this, addr);
+            unsigned char *block = set_block(set, G::set_stride(this), G::page_shift(this));
+
+            /* One pass over the set gives the hit way and everything the eviction policies need */
+            SetMatch match;
+            kernel(block, &shape, tag, core, &match);
+            unsigned int hits = match.hits;
+
+            result->miss = hits == 0;
+            result->penalty = hit_time;
+            result->evicted = false;
+            result->evicted_addr = 0;
+            result->evicted_core = 0;
+
+            if (hits){
+                unsigned int way = __builtin_ctz(hits);
+                result->line = set * G::assoc(this) + way;
+                G::touch(this, block + G::repl_offset(this), way); /* Most recently used address */
+                if (core_stats != NULL){
+                    core_stats[core].hits++;
+                    set_stats[set].hits++;
+                }
+                return;
+            }
+
+            result->penalty = miss_penalty;
+            misses++;
+                
+            int step = 0;
+            unsigned int valid = core_stats != NULL ? *(unsigned int *) (block + G::valid_offset(this)) : 0; /* Before the fill */
+            if (G::sharp(this)) step = evict_sharp_block (result, block, set, tag, core, match);
+            else evict_lru_block(result, block, set, tag, match);
+            if (core_stats != NULL) count_miss(core, set, step, valid & (1u << (result->line - set * G::assoc(this))));
+        }
+};
+
+template <unsigned int SIZE, unsigned int LINE, unsigned int ASSOC>
+Cache *make_fixed_cache(unsigned int mp, bool sp, ReplacementPolicy rp){
+    switch (rp){
+        case REPL_PLRU:
+            if (sp) return new CacheImpl<FixedGeometry<SIZE, LINE, ASSOC, REPL_PLRU, true> >(SIZE, LINE, mp, ASSOC, sp, rp);
+            return new CacheImpl<FixedGeometry<SIZE, LINE, ASSOC, REPL_PLRU, false> >(SIZE, LINE, mp, ASSOC, sp, rp);
+        case REPL_SRRIP:
+            if (sp) return new CacheImpl<FixedGeometry<SIZE, LINE, ASSOC, REPL_SRRIP, true> >(SIZE, LINE, mp, ASSOC, sp, rp);
+            return new CacheImpl<FixedGeometry<SIZE, LINE, ASSOC, REPL_SRRIP, false> >(SIZE, LINE, mp, ASSOC, sp, rp);
+        default:
+            if (sp) return new CacheImpl<FixedGeometry<SIZE, LINE, ASSOC, REPL_LRU, true> >(SIZE, LINE, mp, ASSOC, sp, rp);
+            return new CacheImpl<FixedGeometry<SIZE, LINE, ASSOC, REPL_LRU, false> >(SIZE, LINE, mp, ASSOC, sp, rp);
+    }
+}
+
+/* 
+    Geometries (size in KB, line size, associativity) compiled with a specialized implementation.
+    Common L2 and L3 shapes, any other shape runs on the generic path
+*/
+#define FIXED_GEOMETRIES(X) \
+    X(32, 64, 8) \
+    X(128, 64, 4) \
+    X(256, 64, 4) \
+    X(256, 64, 8) \
+    X(512, 64, 8) \
+    X(1024, 64, 16) \
+    X(2048, 64, 16) \
+    X(4096, 64, 16) \
+    X(8192, 64, 16) \
+    X(16384, 64, 8) \
+    X(16384, 64, 16) \
+    X(32768, 64, 16)
+
+static inline Cache *make_cache(unsigned int s, unsigned int ls, unsigned int mp, unsigned int a, bool sp, ReplacementPolicy rp = REPL_LRU){
+    Cache *cache = NULL;
+#define TRY_FIXED_GEOMETRY(SIZE, LINE, ASSOC) \
+    if (cache == NULL && s == SIZE && ls == LINE && a == ASSOC) cache = make_fixed_cache<SIZE, LINE, ASSOC>(mp, sp, rp);
+    FIXED_GEOMETRIES(TRY_FIXED_GEOMETRY)
+#undef TRY_FIXED_GEOMETRY
+
+    if (cache != NULL){
+        cache->specialized = true;
+        return cache;
+    }
+    return new CacheImpl<RuntimeGeometry>(s, ls, mp, a, sp, rp);
+}
+
+#define MAX_PRIVATE_LEVELS 2
+
+enum AccessKind {
+    ACCESS_DATA, /* Also the side of unified caches */
+    ACCESS_FETCH
+};
+#define MAX_SLICE_BITS 6
+
+/*
+    Slice hash functions of an 8-slice Intel LLC (Maurice et al., RAID'15). Output bit b of the
+    slice number is the parity of the address bits selected by mask b
+*/
+const unsigned long DEFAULT_SLICE_HASH[] = {0x1b5f575440UL, 0x2eb5faa880UL, 0x3cccc93100UL};
+
+typedef struct Level_Config {
+    unsigned int size; /* KB */
+    unsigned int line_size;
+    unsigned int miss_penalty;
+    unsigned int assoc;
+    bool sharp;
+    ReplacementPolicy policy;
+} LevelConfig;
+
+typedef struct Topology_Config {
+    unsigned int cores;
+    unsigned int private_levels; /* Private caches of a core, closest to it first */
+    LevelConfig level[MAX_PRIVATE_LEVELS];
+    bool split_l1; /* The first private level is a pair of instruction and data caches, each shaped like level[0] */
+    LevelConfig llc; /* Shared by all cores, inclusive of every private cache. <size> covers all slices */
+    unsigned int llc_slices; /* Power of two, 1 for a monolithic LLC */
+    unsigned long slice_hash[MAX_SLICE_BITS]; /* One address mask per slice number bit */
+    unsigned long private_cores; /* One bit per core owning private caches. The others access the LLC directly */
+    bool concurrent; /* Several host threads load at once, take the per-core and per-slice locks */
+    unsigned long seed; /* Seeds the random streams of every core */
+    unsigned int noise; /* Timing noise added to every load, in cycles */
+    bool metrics; /* Count per core and per set (-metrics) */
+} Topology;
+
+static Cache *make_level(const LevelConfig &config){
+    return make_cache(config.size, config.line_size, config.miss_penalty, config.assoc, config.sharp, config.policy);
+}
+
+class Hierarchy {
+    /*
+        Private caches of every core in front of one shared, inclusive LLC.
+        Only the last private level of a core is linked to the LLC (backing / sharers).
+        Inner private levels are kept inclusive by invalidating them when an outer level evicts.
+        Each core remembers the line it last touched in its first level (per side when it is split),
+        and answers repeated accesses to it without a lookup.
+
+        The LLC is split in slices, each an independent Cache with its own sets and SHARP alarms.
+        An address goes to the slice selected by the XOR hash, then to the set its low bits select
+        within the slice. LLC lines are numbered slice * slice_lines + line within the slice.
+
+        Concurrent loads lock the private caches of a core and each LLC slice separately.
+        Locks are always taken slice first, then core, and a core lock is never held while waiting
+        for a slice: a load releases its core before going to the LLC, then checks that the lines
+        it links or releases still hold its address (another core may have evicted them meanwhile).
+    */
+public:
+    unsigned int cores;
+    unsigned int private_levels;
+    bool split_l1;
+    bool filter; /* Repeated hits leave the first level unchanged (not true for SRRIP) */
+    Cache **privates; /* [core][level][side], side ACCESS_FETCH only used by a split L1. NULL for cores without private caches */
+    unsigned long *last_line; /* [core][side]: line last accessed in the first level, ~0 if none */
+    unsigned long *filtered; /* Per core: accesses answered by the last line */
+    unsigned int slice_count;
+    unsigned int slice_bits;
+    unsigned long slice_lines;
+    unsigned long slice_hash[MAX_SLICE_BITS];
+    Cache **slices;
+    bool concurrent;
+    PIN_LOCK *slice_locks;
+    PIN_LOCK *core_locks;
+    CoreRng *rngs; /* Random streams of each core */
+    unsigned int noise;
+    unsigned int hit_time;
+    bool metrics;
+
+    Hierarchy(const Topology &topology){
+        cores = topology.cores;
+        metrics = topology.metrics;
+        private_levels = topology.private_levels;
+        split_l1 = topology.split_l1;
+        filter = topology.level[0].policy != REPL_SRRIP;
+        slice_count = topology.llc_slices;
+        if (cores == 0 || cores > 64){
+            cerr << "Sharer masks hold between 1 and 64 cores, got " << cores << endl;
+            exit(1);
+        }
+        if (private_levels == 0 || private_levels > MAX_PRIVATE_LEVELS){
+            cerr << "Between 1 and " << MAX_PRIVATE_LEVELS << " private levels are supported" << endl;
+            exit(1);
+        }
+        for (unsigned int level = 0; level < private_levels; level++){
+            if (topology.level[level].line_size != topology.llc.line_size){
+                cerr << "All cache levels must use the same line size" << endl;
+                exit(1);
+            }
+        }
+        if (!is_pow2(slice_count) || slice_count > (1u << MAX_SLICE_BITS) || topology.llc.size % slice_count != 0){
+            cerr << "LLC slices must be a power of two up to " << (1u << MAX_SLICE_BITS) << " dividing the LLC size, got " << slice_count << endl;
+            exit(1);
+        }
+
+        if (posix_memalign((void **) &rngs, 64, cores * sizeof(CoreRng)) != 0){
+            cerr << "Could not allocate random streams" << endl;
+            exit(1);
+        }
+        for (unsigned int core = 0; core < cores; core++){
+            rngs[core].seed(topology.seed, core, topology.noise);
+        }
+        noise = topology.noise;
+        hit_time = noise/2+1;
+
+        slice_bits = floor_log2(slice_count);
+        LevelConfig slice = topology.llc;
+        slice.size /= slice_count;
+        slices = (Cache **) malloc(slice_count * sizeof(Cache *));
+        for (unsigned int i = 0; i < slice_count; i++){
+            slices[i] = adopt(make_level(slice));
+            slices[i]->track_sharers();
+        }
+        for (unsigned int bit = 0; bit < slice_bits; bit++){
+            slice_hash[bit] = topology.slice_hash[bit];
+        }
+        slice_lines = slices[0]->set_number * slices[0]->associativity;
+
+        concurrent = topology.concurrent;
+        slice_locks = (PIN_LOCK *) malloc(slice_count * sizeof(PIN_LOCK));
+        core_locks = (PIN_LOCK *) malloc(cores * sizeof(PIN_LOCK));
+        for (unsigned int i = 0; i < slice_count; i++) PIN_InitLock(&slice_locks[i]);
+        for (unsigned int i = 0; i < cores; i++) PIN_InitLock(&core_locks[i]);
+
+        privates = (Cache **) calloc(cores * private_levels * 2, sizeof(Cache *));
+        last_line = (unsigned long *) malloc(cores * 2 * sizeof(unsigned long));
+        filtered = (unsigned long *) calloc(cores, sizeof(unsigned long));
+        memset(last_line, 0xff, cores * 2 * sizeof(unsigned long));
+        for (unsigned int core = 0; core < cores; core++){
+            if (!(topology.private_cores & (1UL << core)))
+                continue;
+            for (unsigned int level = 0; level < private_levels; level++){
+                privates[(core * private_levels + level) * 2 + ACCESS_DATA] = adopt(make_level(topology.level[level]));
+                if (level == 0 && split_l1)
+                    privates[(core * private_levels + level) * 2 + ACCESS_FETCH] = adopt(make_level(topology.level[level]));
+            }
+            last_private(core)->track_backing();
+        }
+    }
+
+    ~Hierarchy(){
+        for (unsigned int i = 0; i < cores * private_levels * 2; i++){
+            delete privates[i];
+        }
+        free(privates);
+        free(last_line);
+        free(filtered);
+        for (unsigned int i = 0; i < slice_count; i++){
+            delete slices[i];
+        }
+        free(slices);
+        free(slice_locks);
+        free(core_locks);
+        free(rngs);
+    }
+
+    Cache *adopt(Cache *cache){
+        /* Per core state a cache needs from its hierarchy */
+        cache->alarm_counter = (unsigned long *) calloc(cores, sizeof(unsigned long));
+        cache->rngs = rngs;
+        cache->hit_time = hit_time;
+        if (metrics){
+            if (posix_memalign((void **) &cache->core_stats, 64, cores * sizeof(CoreCounters)) != 0){
+                cerr << "Could not allocate metrics counters" << endl;
+                exit(1);
+            }
+            memset(cache->core_stats, 0, cores * sizeof(CoreCounters));
+            cache->set_stats = (SetCounters *) calloc(cache->set_number, sizeof(SetCounters));
+        }
+        return cache;
+    }
+
+    void lock_slice(unsigned int slice, int core){
+        if (concurrent) PIN_GetLock(&slice_locks[slice], core + 1);
+    }
+
+    void unlock_slice(unsigned int slice){
+        if (concurrent) PIN_ReleaseLock(&slice_locks[slice]);
+    }
+
+    void lock_core(int core, int locker){
+        if (concurrent) PIN_GetLock(&core_locks[core], locker + 1);
+    }
+
+    void unlock_core(int core){
+        if (concurrent) PIN_ReleaseLock(&core_locks[core]);
+    }
+
+    unsigned int side(unsigned int level, AccessKind kind){
+        return level == 0 && split_l1 ? kind : ACCESS_DATA;
+    }
+
+    Cache *private_cache(int core, unsigned int level, AccessKind kind = ACCESS_DATA){
+        return privates[(core * private_levels + level) * 2 + side(level, kind)];
+    }
+
+    Cache *last_private(int core){
+        return private_cache(core, private_levels - 1);
+    }
+
+    unsigned int slice_of(unsigned long addr){
+        unsigned int slice = 0;
+        for (unsigned int bit = 0; bit < slice_bits; bit++){
+            slice |= __builtin_parityl(addr & slice_hash[bit]) << bit;
+        }
+        return slice;
+    }
+
+    unsigned long eviction_address(unsigned long target, unsigned int i){
+        /*
+            <i>-th address (from 1) other than <target> that maps to the same LLC slice and set.
+            Steps over whole slice set arrays, so the set within the slice never changes
+        */
+        unsigned long step = slices[0]->set_number * slices[0]->line_size;
+        unsigned int slice = slice_of(target);
+        unsigned long addr = target;
+        while (i > 0){
+            addr += step;
+            if (slice_of(addr) == slice) i--;
+        }
+        return addr;
+    }
+
+    void release_line(unsigned long line, unsigned long addr, int core){
+        /* The private caches of <core> dropped <addr>, held in LLC line <line>. Lines no private cache holds lose their SHARP owner */
+        unsigned int slice_index = line / slice_lines;
+        Cache *slice = slices[slice_index];
+        line %= slice_lines;
+
+        lock_slice(slice_index, core);
+        if (slice->line_holds(line, addr)){
+            slice->sharers[line] &= ~(1UL << core);
+            if (slice->sharers[line] == 0){
+                *slice->line_owner(line) = -1;
+            }
+        }
+        unlock_slice(slice_index);
+    }
+
+    void invalidate_private(int core, unsigned int levels, unsigned long addr){
+        /* Drop <addr> from the first <levels> private caches of <core>, both sides of a split L1 */
+        for (unsigned int level = 0; level < levels; level++){
+            for (unsigned int kind = ACCESS_DATA; kind <= ACCESS_FETCH; kind++){
+                Cache *cache = privates[(core * private_levels + level) * 2 + kind];
+                if (cache == NULL)
+                    continue;
+                unsigned long set = cache->get_set_index(addr);
+                int way = cache->find_way(set, addr);
+                if (way >= 0){
+                    cache->invalidate(set, way);
+                }
+            }
+        }
+        if (levels > 0){
+            for (unsigned int kind = ACCESS_DATA; kind <= ACCESS_FETCH; kind++){
+                if (last_line[core * 2 + kind] == addr) last_line[core * 2 + kind] = ~0UL;
+            }
+        }
+    }
+
+    void back_invalidate(Cache *slice, unsigned long sharers, unsigned long addr, int locker){
+        /* Inclusion: <addr> left the LLC <slice>, drop it from every core holding it. The caller holds the slice lock */
+        while (sharers){
+            int core = __builtin_ctzl(sharers);
+            sharers &= sharers - 1;
+            if (slice->core_stats != NULL) slice->core_stats[core].back_invalidations++;
+            lock_core(core, locker);
+            invalidate_private(core, private_levels, addr);
+            unlock_core(core);
+        }
+    }
+
+    unsigned long load(unsigned long addr, int core, AccessKind kind = ACCESS_DATA){
+        /*
+            Load <addr> for <core>. Returns the hit time if any level hits, the LLC's miss penalty
+                otherwise: the spies' thresholds only tell hits from LLC misses
+        */
+        CacheAnswer answer;
+        CacheAnswer llc_answer;
+        Cache *outer = last_private(core);
+
+        /* Addresses must be aligned to the line size. All levels share it */
+        addr &= ~slices[0]->block_off_mask;
+
+        if (outer != NULL){
+            lock_core(core, core);
+            unsigned long *last = &last_line[core * 2 + side(0, kind)];
+            if (*last == addr && filter){
+                /* Still in the first level, and hitting it again would not change its replacement state */
+                filtered[core]++;
+                unlock_core(core);
+                return hit_time; /* Same as a first level hit */
+            }
+            *last = addr; /* Present in the first level once this load is done */
+
+            for (unsigned int level = 0; level < private_levels; level++){
+                Cache *cache = private_cache(core, level, kind);
+                cache->load(&answer, addr, core);
+                if (!answer.miss){
+                    unlock_core(core);
+                    return answer.penalty;
+                }
+                if (answer.evicted){
+                    invalidate_private(core, level, answer.evicted_addr);
+                }
+            }
+            /* The new line took the victim's way, so its backing entry is still the old one */
+            unsigned long released = outer->backing[answer.line];
+            unlock_core(core);
+
+            if (answer.evicted){
+                /* Update ownership in the LLC */
+                release_line(released, answer.evicted_addr, core);
+            }
+        }
+
+        unsigned int slice_index = slice_of(addr);
+        Cache *slice = slices[slice_index];
+        lock_slice(slice_index, core);
+        slice->load(&llc_answer, addr, core);
+        if (llc_answer.miss){
+            unsigned long previous = slice->sharers[llc_answer.line];
+            slice->sharers[llc_answer.line] = 0;
+            if (llc_answer.evicted){
+                back_invalidate(slice, previous, llc_answer.evicted_addr, core);
+            }
+        }
+
+        if (outer != NULL){
+            /* Link both copies. A private copy makes the line owned, even if another core brought it in */
+            lock_core(core, core);
+            if (outer->line_holds(answer.line, addr)){
+                outer->backing[answer.line] = slice_index * slice_lines + llc_answer.line;
+                slice->sharers[llc_answer.line] |= 1UL << core;
+                signed char *owner = slice->line_owner(llc_answer.line);
+                if (*owner == -1){
+                    *owner = core;
+                }
+            }
+            unlock_core(core);
+        }
+        unlock_slice(slice_index);
+        return llc_answer.penalty;
+    }
+
+    unsigned long observe(unsigned long addr, int core, AccessKind kind = ACCESS_DATA){
+        /* A load as its core times it: the latency plus the core's noise */
+        unsigned long penalty = load(addr, core, kind);
+
+        if (CACHE_NOISE_ENABLED)
+            return penalty + rngs[core].noise.draw();
+        else
+            return penalty;
+    }
+
+    unsigned long filtered_accesses(){
+        unsigned long total = 0;
+        for (unsigned int core = 0; core < cores; core++) total += filtered[core];
+        return total;
+    }
+
+    unsigned long llc_misses(){
+        unsigned long misses = 0;
+        for (unsigned int i = 0; i < slice_count; i++) misses += slices[i]->misses;
+        return misses;
+    }
+
+    unsigned long llc_accesses(){
+        unsigned long accesses = 0;
+        for (unsigned int i = 0; i < slice_count; i++) accesses += slices[i]->accesses;
+        return accesses;
+    }
+
+    void reset_cache_stats(Cache *cache){
+        cache->accesses = cache->misses = 0;
+        memset(cache->alarm_counter, 0, cores * sizeof(unsigned long));
+        if (cache->core_stats != NULL){
+            memset(cache->core_stats, 0, cores * sizeof(CoreCounters));
+            memset(cache->set_stats, 0, cache->set_number * sizeof(SetCounters));
+        }
+    }
+
+    void reset_stats(){
+        /* Counters of every cache and core, the contents stay */
+        for (unsigned int i = 0; i < slice_count; i++){
+            reset_cache_stats(slices[i]);
+        }
+        for (unsigned int i = 0; i < cores * private_levels * 2; i++){
+            if (privates[i] != NULL) reset_cache_stats(privates[i]);
+        }
+        memset(filtered, 0, cores * sizeof(unsigned long));
+    }
+
+    string cache_name(unsigned int i){
+        /* Name of privates[i], as print_config shows it */
+        unsigned int level = i / 2 % private_levels;
+        stringstream name;
+        name << "L" << level + 3 - private_levels;
+        if (level == 0 && split_l1) name << (i % 2 == ACCESS_FETCH ? "I" : "D");
+        return name.str();
+    }
+
+    void print_llc(){
+        for (unsigned int i = 0; i < slice_count; i++){
+            if (slice_count > 1) cout << "Slice: " << i << endl;
+            slices[i]->print_contents();
+        }
+    }
+
+    void print_config(){
+        cout << "Hierarchy: " << cores << " cores, " << private_levels << " private levels, private caches on cores";
+        for (unsigned int core = 0; core < cores; core++){
+            if (last_private(core) != NULL) cout << " " << core;
+        }
+        cout << endl;
+        for (unsigned int core = 0; core < cores; core++){
+            if (last_private(core) == NULL)
+                continue;
+            /* Every private cache has the same shape, the outermost one is the L2 */
+            for (unsigned int level = 0; level < private_levels; level++){
+                stringstream name;
+                name << "L" << level + 3 - private_levels;
+                if (level == 0 && split_l1){
+                    private_cache(core, level, ACCESS_FETCH)->print_config((name.str() + "I").c_str());
+                    name << "D";
+                }
+                private_cache(core, level)->print_config(name.str().c_str());
+            }
+            break;
+        }
+        if (slice_count > 1){
+            cout << "L3: " << slice_count << " slices, hash masks" << hex;
+            for (unsigned int bit = 0; bit < slice_bits; bit++) cout << " 0x" << slice_hash[bit];
+            cout << dec << endl;
+            slices[0]->print_config("L3 slice");
+        }
+        else{
+            slices[0]->print_config("L3");
+        }
+    }
+
+    void save(CheckpointWriter *ckpt){
+        for (unsigned int i = 0; i < slice_count; i++){
+            slices[i]->save(ckpt, cores);
+        }
+        for (unsigned int i = 0; i < cores * private_levels * 2; i++){
+            if (privates[i] != NULL) privates[i]->save(ckpt, cores);
+        }
+        ckpt->section(rngs, cores * sizeof(CoreRng));
+        ckpt->section(last_line, cores * 2 * sizeof(unsigned long));
+        ckpt->section(filtered, cores * sizeof(unsigned long));
+    }
+
+    bool restore(CheckpointReader *ckpt){
+        for (unsigned int i = 0; i < slice_count; i++){
+            slices[i]->restore(ckpt, cores);
+        }
+        for (unsigned int i = 0; i < cores * private_levels * 2; i++){
+            if (privates[i] != NULL) privates[i]->restore(ckpt, cores);
+        }
+        ckpt->section(rngs, cores * sizeof(CoreRng));
+        ckpt->section(last_line, cores * 2 * sizeof(unsigned long));
+        ckpt->section(filtered, cores * sizeof(unsigned long));
+        for (unsigned int core = 0; core < cores; core++){
+            /* Saved at another noise level: the streams go on, the values drawn ahead are redrawn */
+            if (rngs[core].noise.noise != noise){
+                rngs[core].noise.noise = noise;
+                rngs[core].noise.next_value = NOISE_BATCH;
+            }
+        }
+        return !ckpt->corrupt;
+    }
+};
+
+static inline bool parse_slice_hash(const string &masks, unsigned int slices, unsigned long *hash){
+    /* Comma separated hex masks, one per slice number bit. Empty picks the default Intel hash */
+    unsigned int bits = is_pow2(slices) ? floor_log2(slices) : 0;
+    if (masks.empty()){
+        if (bits > sizeof(DEFAULT_SLICE_HASH) / sizeof(DEFAULT_SLICE_HASH[0]))
+            return false;
+        for (unsigned int bit = 0; bit < bits; bit++) hash[bit] = DEFAULT_SLICE_HASH[bit];
+        return true;
+    }
+
+    stringstream list(masks);
+    string mask;
+    unsigned int bit = 0;
+    while (getline(list, mask, ',')){
+        if (bit == bits || bit == MAX_SLICE_BITS)
+            return false;
+        hash[bit++] = strtoul(mask.c_str(), NULL, 16);
+    }
+    return bit == bits;
+}
+
+#endif
@@ -0,0 +1,246 @@
+/*
+    Throughput benchmark of the cache hierarchy in sharp_sim.h. Does not need Pin.
+
+    Synthetic streams go through a few hierarchy configurations, one fresh hierarchy per run. They
+    all use the pintool's default shapes (a private L2 on the victim's core only, spies loading from
+    the LLC), except the -l1 configuration: split L1s and an L2 on every core.
+        sequential   one core walking a 64MB buffer line by line
+        strided      the same buffer with a 4KB stride (every access lands in the same few L2 sets)
+        random       uniformly random lines of the buffer
+        prime_probe  a spy priming and probing the LLC eviction set of a victim line the victim keeps touching
+        rsa          a square-and-multiply loop (code lines, bignum reads) with a spy priming and probing
+                     the LLC sets of square and multiply after every iteration
+    Streams are generated before timing. Each run reports accesses per second, ns per access, and
+    misses of the LLC and of core 0's first level (its L1D with -l1, its L2 otherwise).
+
+    Then every stream goes through sharded_sim.h with 1, 2, 4 and 8 shards, one worker thread each,
+    as the pintool drives it: core 0 (the victim) posts its loads without waiting, core 1 (the spy)
+    probes each run of its loads at once and waits for the latencies. Speed-ups are against the
+    same configuration on a single Hierarchy, and need as many free host cpus as shards plus one.
+
+    Build and run with:
+        make sim_bench && ./sim_bench [accesses per stream]
+*/
+
+#include "pin_shim.h"
+#include "sharp_sim.h"
+#include "sharded_sim.h"
+#include <iomanip>
+#include <time.h>
+
+#define BENCH_FOOTPRINT (64UL << 20)
+#define BENCH_STRIDE 4096
+#define BENCH_CORES 2
+
+typedef struct Bench_Access {
+    unsigned long addr;
+    int core;
+    AccessKind kind;
+} BenchAccess;
+
+typedef struct Bench_Config {
+    const char *name;
+    ReplacementPolicy policy; /* LLC */
+    bool sharp;
+    unsigned int slices;
+    bool l1; /* Split L1s, and private caches on every core */
+} BenchConfig;
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static Topology bench_topology(const BenchConfig &config){
+    /* The pintool's default shapes, 16MB LLC. Without -l1 and -spy_l2 only the victim (core 0) has an L2 */
+    Topology topology;
+    topology.cores = BENCH_CORES;
+    if (config.l1){
+        topology.private_levels = 2;
+        topology.level[0] = {32, LINE_SIZE, L1_CACHE_MISS_PENALTY, 8, false, REPL_LRU};
+    }
+    else topology.private_levels = 1;
+    topology.level[topology.private_levels - 1] = {256, LINE_SIZE, L2_CACHE_MISS_PENALTY, L2_ASSOC, false, REPL_LRU};
+    topology.split_l1 = config.l1;
+    topology.llc = {16384, LINE_SIZE, L3_CACHE_MISS_PENALTY, L3_ASSOC, config.sharp, config.policy};
+    topology.llc_slices = config.slices;
+    if (!parse_slice_hash("", config.slices, topology.slice_hash)){
+        cerr << "No default slice hash for " << config.slices << " slices" << endl;
+        exit(1);
+    }
+    topology.private_cores = config.l1 ? (1UL << BENCH_CORES) - 1 : 1;
+    topology.concurrent = false;
+    topology.seed = 1;
+    topology.noise = CACHE_NOISE;
+    topology.metrics = false;
+    return topology;
+}
+
+static void add(vector<BenchAccess> *stream, unsigned long addr, int core, AccessKind kind = ACCESS_DATA){
+    BenchAccess access = {addr, core, kind};
+    stream->push_back(access);
+}
+
+static void sequential(vector<BenchAccess> *stream, unsigned long count, Hierarchy * /* hierarchy */){
+    for (unsigned long i = 0; i < count; i++) add(stream, i * LINE_SIZE % BENCH_FOOTPRINT, 0);
+}
+
+static void strided(vector<BenchAccess> *stream, unsigned long count, Hierarchy * /* hierarchy */){
+    /* Wraps onto the next line once past the buffer, so lines keep changing */
+    for (unsigned long i = 0; i < count; i++){
+        unsigned long offset = i * BENCH_STRIDE;
+        add(stream, offset % BENCH_FOOTPRINT + offset / BENCH_FOOTPRINT * LINE_SIZE % BENCH_STRIDE, 0);
+    }
+}
+
+static void random_lines(vector<BenchAccess> *stream, unsigned long count, Hierarchy * /* hierarchy */){
+    Xoshiro256 rng;
+    rng.seed(1, STREAM_NOISE, 0);
+    for (unsigned long i = 0; i < count; i++) add(stream, (unsigned long) rng.below(BENCH_FOOTPRINT / LINE_SIZE) * LINE_SIZE, 0);
+}
+
+static void prime_probe(vector<BenchAccess> *stream, unsigned long count, Hierarchy *hierarchy){
+    /* Spy on core 1: prime the set, the victim touches its line, probe the set */
+    unsigned long target = 0x401680;
+    vector<unsigned long> evset;
+    for (unsigned int i = 1; i < L3_ASSOC + 1; i++) evset.push_back(hierarchy->eviction_address(target, i));
+    while (stream->size() < count){
+        for (unsigned int i = 0; i < evset.size(); i++) add(stream, evset[i], 1);
+        add(stream, target, 0);
+        for (unsigned int i = 0; i < evset.size(); i++) add(stream, evset[i], 1);
+    }
+    stream->resize(count);
+}
+
+static void rsa(vector<BenchAccess> *stream, unsigned long count, Hierarchy *hierarchy){
+    /* Code of square and multiply (a few lines each), 4KB operands, and a spy probing both LLC sets */
+    unsigned long square = 0x401680, multiply = 0x4016c0, operands = 0x10000000;
+    vector<unsigned long> square_evset, multiply_evset;
+    for (unsigned int i = 1; i < L3_ASSOC + 1; i++){
+        square_evset.push_back(hierarchy->eviction_address(square, i));
+        multiply_evset.push_back(hierarchy->eviction_address(multiply, i));
+    }
+    Xoshiro256 rng;
+    rng.seed(2, STREAM_NOISE, 0);
+    while (stream->size() < count){
+        bool bit = rng.below(2);
+        for (unsigned int line = 0; line < 4; line++) add(stream, square + line * LINE_SIZE, 0, ACCESS_FETCH);
+        for (unsigned long offset = 0; offset < 4096; offset += LINE_SIZE) add(stream, operands + offset, 0);
+        if (bit){
+            for (unsigned int line = 0; line < 4; line++) add(stream, multiply + line * LINE_SIZE, 0, ACCESS_FETCH);
+            for (unsigned long offset = 0; offset < 4096; offset += LINE_SIZE) add(stream, operands + 4096 + offset, 0);
+        }
+        for (unsigned int i = 0; i < L3_ASSOC; i++){
+            add(stream, square_evset[i], 1);
+            add(stream, multiply_evset[i], 1);
+        }
+    }
+    stream->resize(count);
+}
+
+typedef void (*BenchStream)(vector<BenchAccess> *stream, unsigned long count, Hierarchy *hierarchy);
+
+static double run(const BenchConfig &config, const char *name, BenchStream generate, unsigned long count){
+    Hierarchy *hierarchy = new Hierarchy(bench_topology(config));
+    vector<BenchAccess> stream;
+    stream.reserve(count);
+    generate(&stream, count, hierarchy);
+
+    /* Fold every latency into a checksum so the compiler cannot drop the loads */
+    unsigned long sum = 0;
+    double start = now();
+    for (unsigned long i = 0; i < stream.size(); i++){
+        sum += hierarchy->observe(stream[i].addr, stream[i].core, stream[i].kind);
+    }
+    double elapsed = now() - start;
+
+    Cache *first = hierarchy->private_cache(0, 0);
+    cout << setw(16) << config.name << setw(13) << name << setw(10) << fixed << setprecision(1) << count / elapsed / 1e6 << " M/s"
+         << setw(9) << setprecision(1) << elapsed * 1e9 / count << " ns" << setw(12) << hierarchy->llc_misses()
+         << setw(14) << first->misses << "   (checksum " << sum << ")" << endl;
+    delete hierarchy;
+    return elapsed;
+}
+
+static void run_sharded(const BenchConfig &config, const char *name, BenchStream generate, unsigned long count,
+                        unsigned int shards, double serial){
+    Topology topology = bench_topology(config);
+    Hierarchy *layout = new Hierarchy(topology); /* Eviction sets of the generators */
+    vector<BenchAccess> stream;
+    stream.reserve(count);
+    generate(&stream, count, layout);
+    delete layout;
+    ShardedHierarchy *sharded = new ShardedHierarchy(topology, shards);
+    if (!sharded->start()){
+        cerr << "Could not start " << shards << " shard workers" << endl;
+        exit(1);
+    }
+
+    vector<unsigned long> probe, latencies(stream.size());
+    unsigned long sum = 0;
+    double start = now();
+    for (unsigned long i = 0; i < stream.size(); ){
+        if (stream[i].core == 0){
+            sharded->post(stream[i].addr, 0, stream[i].kind, true);
+            i++;
+            continue;
+        }
+        probe.clear();
+        for (; i < stream.size() && stream[i].core != 0; i++) probe.push_back(stream[i].addr);
+        sharded->observe_all(probe.data(), probe.size(), 1, latencies.data());
+        for (unsigned int p = 0; p < probe.size(); p++) sum += latencies[p];
+    }
+    sharded->quiesce();
+    double elapsed = now() - start;
+
+    cout << setw(16) << config.name << setw(13) << name << setw(8) << shards << setw(10) << fixed << setprecision(1)
+         << count / elapsed / 1e6 << " M/s" << setw(9) << setprecision(2) << serial / elapsed << "x" << setw(12)
+         << sharded->llc_misses() << "   (probe checksum " << sum << ")" << endl;
+    delete sharded;
+}
+
+int main(int argc, char **argv){
+    unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 10) : 5000000;
+    BenchConfig configs[] = {
+        {"sharp-lru", REPL_LRU, true, 1, false},
+        {"lru", REPL_LRU, false, 1, false},
+        {"sharp-srrip", REPL_SRRIP, true, 1, false},
+        {"sharp-lru-8sl", REPL_LRU, true, 8, false},
+        {"sharp-lru-l1", REPL_LRU, true, 1, true},
+    };
+    struct {
+        const char *name;
+        BenchStream generate;
+    } streams[] = {
+        {"sequential", sequential},
+        {"strided", strided},
+        {"random", random_lines},
+        {"prime_probe", prime_probe},
+        {"rsa", rsa},
+    };
+
+    const unsigned int stream_count = sizeof(streams) / sizeof(streams[0]);
+    double serial[stream_count]; /* Of the first configuration */
+
+    cout << lookup_isa_name(lookup_isa) << " lookup, " << count << " accesses per stream" << endl;
+    cout << setw(16) << "config" << setw(13) << "stream" << setw(14) << "rate" << setw(12) << "per access"
+         << setw(12) << "LLC misses" << setw(14) << "first misses" << endl;
+    for (unsigned int c = 0; c < sizeof(configs) / sizeof(configs[0]); c++){
+        for (unsigned int s = 0; s < stream_count; s++){
+            double elapsed = run(configs[c], streams[s].name, streams[s].generate, count);
+            if (c == 0) serial[s] = elapsed;
+        }
+    }
+
+    unsigned int shard_counts[] = {1, 2, 4, 8};
+    cout << endl << "Sharded, " << sysconf(_SC_NPROCESSORS_ONLN) << " host cpus" << endl;
+    cout << setw(16) << "config" << setw(13) << "stream" << setw(8) << "shards" << setw(14) << "rate" << setw(10) << "speed-up"
+         << setw(12) << "LLC misses" << endl;
+    for (unsigned int s = 0; s < stream_count; s++){
+        for (unsigned int n = 0; n < sizeof(shard_counts) / sizeof(shard_counts[0]); n++){
+            run_sharded(configs[0], streams[s].name, streams[s].generate, count, shard_counts[n], serial[s]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,558 @@
+/*
+    Regression tests of the cache hierarchy in sharp_sim.h. Does not need Pin.
+
+    The scenarios the pintool used to run by commenting out main: the second attack step by step,
+    ownership and back-invalidation, SHARP's three eviction steps and private cache conflicts.
+    The stack distance profile is checked against LRU caches simulated one by one, sets are
+    checked to be allocated only once used, shards on worker threads against one hierarchy, and
+    key bits to need corroborating observations, one per victim iteration however many rounds the
+    spies probe in it. trace_replay runs a checkpoint round trip.
+    Each one checks the contents, owners and latencies it used to print. With noise 0 and fixed
+    seeds every result is deterministic.
+
+    Build and run with:
+        make test
+*/
+
+#include "pin_shim.h"
+#include "sharp_sim.h"
+#include "sharded_sim.h"
+#include "stack_distance.h"
+#include "key.h"
+#include "trace.h"
+#include <fstream>
+
+unsigned int failures = 0;
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+static void check(bool ok, const char *condition, int line){
+    if (ok) return;
+    cout << "    line " << line << ": " << condition << " failed" << endl;
+    failures++;
+}
+
+Topology test_topology(unsigned int cores){
+    /* Default shapes, only core 0 (victim and the spy sharing its core) has a private L2 */
+    Topology topology;
+    topology.cores = cores;
+    topology.private_levels = 1;
+    topology.level[0] = {256, LINE_SIZE, L2_CACHE_MISS_PENALTY, L2_ASSOC, false, REPL_LRU};
+    topology.llc = {16384, LINE_SIZE, L3_CACHE_MISS_PENALTY, L3_ASSOC, true, REPL_LRU}; // l3 uses SHARP
+    topology.llc_slices = 1;
+    topology.concurrent = false;
+    topology.split_l1 = false;
+    topology.seed = 1;
+    topology.private_cores = 1;
+    topology.noise = 0;
+    topology.metrics = false;
+    return topology;
+}
+
+static bool in_l2(Hierarchy *hierarchy, unsigned long addr){
+    Cache *l2 = hierarchy->private_cache(0, 0);
+    return l2->find_way(l2->get_set_index(addr), addr) >= 0;
+}
+
+static bool in_llc(Hierarchy *hierarchy, unsigned long addr){
+    Cache *llc = hierarchy->slices[hierarchy->slice_of(addr)];
+    return llc->find_way(llc->get_set_index(addr), addr) >= 0;
+}
+
+static int llc_owner(Hierarchy *hierarchy, unsigned long addr){
+    /* SHARP owner of <addr> in the LLC, -1 if unowned, -2 if not there */
+    Cache *llc = hierarchy->slices[hierarchy->slice_of(addr)];
+    unsigned long set = llc->get_set_index(addr);
+    int way = llc->find_way(set, addr);
+    return way < 0 ? -2 : llc->set_owners(set)[way];
+}
+
+static unsigned int owned_by(Hierarchy *hierarchy, unsigned long set, int core){
+    /* Valid lines of LLC <set> owned by <core> (-1: unowned) */
+    Cache *llc = hierarchy->slices[0];
+    unsigned int count = 0;
+    for (unsigned int way = 0; way < llc->associativity; way++){
+        if ((*llc->set_valid(set) & (1u << way)) && llc->set_owners(set)[way] == core) count++;
+    }
+    return count;
+}
+
+static unsigned int slow_probes(Hierarchy *hierarchy, unsigned long target, unsigned long stride, int core){
+    /* Probe the <L3_ASSOC> addresses colliding with <target>, count the LLC misses */
+    unsigned int slow = 0;
+    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
+        if (hierarchy->observe(target + stride*i, core) >= L3_CACHE_MISS_PENALTY) slow++;
+    }
+    return slow;
+}
+
+void test_second_atk_simplified(){
+    /* Second attack: spy 1 primes the LLC sets of square and multiply, spy 0 shares the victim's L2 and flushes it */
+    unsigned long set_number_l2 = 256 * 1024 / LINE_SIZE / L2_ASSOC;
+    unsigned long set_number_l3 = 16384 * 1024 / LINE_SIZE / L3_ASSOC;
+    unsigned long square_addr = 0x401697 & ~(LINE_SIZE - 1UL);
+    unsigned long multiply_addr = 0x4016dc & ~(LINE_SIZE - 1UL);
+
+    Hierarchy *hierarchy = new Hierarchy(test_topology(2));
+
+    for (unsigned int i = 1; i < L3_ASSOC+1; i++){
+        hierarchy->observe(square_addr + LINE_SIZE*set_number_l3*i, 1);
+        hierarchy->observe(multiply_addr + LINE_SIZE*set_number_l3*i, 1);
+    }
+    /* Spy 1 fills up the sets of square and multiply, and its own lines hit */
+    CHECK(owned_by(hierarchy, hierarchy->slices[0]->get_set_index(square_addr), 1) == L3_ASSOC);
+    CHECK(slow_probes(hierarchy, square_addr, LINE_SIZE*set_number_l3, 1) == 0);
+
+    /* Victim calls square: it takes a way of spy 1 and owns it */
+    hierarchy->observe(square_addr, 0);
+    CHECK(in_l2(hierarchy, square_addr));
+    CHECK(llc_owner(hierarchy, square_addr) == 0);
+
+    /* Spy 0 evicts square from the L2, its LLC line loses its owner */
+    for (unsigned int i = 1; i < L2_ASSOC+1; i++){
+        hierarchy->observe(square_addr + LINE_SIZE*set_number_l2*i, 0);
+        hierarchy->observe(multiply_addr + LINE_SIZE*set_number_l2*i, 0);
+    }
+    CHECK(!in_l2(hierarchy, square_addr));
+    CHECK(llc_owner(hierarchy, square_addr) == -1);
+
+    /* Spy 1 sees the victim's access once, then its set is primed again */
+    CHECK(slow_probes(hierarchy, square_addr, LINE_SIZE*set_number_l3, 1) == 1);
+    CHECK(!in_llc(hierarchy, square_addr));
+    CHECK(slow_probes(hierarchy, square_addr, LINE_SIZE*set_number_l3, 1) == 0);
+
+    for (unsigned int i = 1; i < L2_ASSOC+1; i++){
+        hierarchy->observe(square_addr + LINE_SIZE*set_number_l2*i, 0);
+        hierarchy->observe(multiply_addr + LINE_SIZE*set_number_l2*i, 0);
+    }
+    CHECK(slow_probes(hierarchy, square_addr, LINE_SIZE*set_number_l3, 1) == 0);
+
+    /* Victim calls multiply: nothing shows in the set of square */
+    hierarchy->observe(multiply_addr, 0);
+    CHECK(in_l2(hierarchy, multiply_addr));
+    CHECK(llc_owner(hierarchy, multiply_addr) == 0);
+    for (unsigned int i = 1; i < L2_ASSOC+1; i++){
+        hierarchy->observe(square_addr + LINE_SIZE*set_number_l2*i, 0);
+        hierarchy->observe(multiply_addr + LINE_SIZE*set_number_l2*i, 0);
+    }
+    CHECK(slow_probes(hierarchy, square_addr, LINE_SIZE*set_number_l3, 1) == 0);
+
+    /* Victim calls square again, spy 0 flushes the L2 and spy 1 sees it */
+    hierarchy->observe(square_addr, 0);
+    CHECK(in_l2(hierarchy, square_addr));
+    for (unsigned int i = 1; i < L2_ASSOC+1; i++){
+        hierarchy->observe(square_addr + LINE_SIZE*set_number_l2*i, 0);
+        hierarchy->observe(multiply_addr + LINE_SIZE*set_number_l2*i, 0);
+    }
+    CHECK(!in_l2(hierarchy, square_addr));
+    CHECK(slow_probes(hierarchy, square_addr, LINE_SIZE*set_number_l3, 1) == 1);
+
+    delete hierarchy;
+}
+
+void test_evict_and_ownership(){
+    /* Ownership is released when a line leaves the L2, and inclusion drops lines the LLC evicts */
+    unsigned long set_number_l2 = 256 * 1024 / LINE_SIZE / L2_ASSOC;
+    unsigned long set_number_l3 = 16384 * 1024 / LINE_SIZE / L3_ASSOC;
+
+    Topology topology = test_topology(17);
+    topology.seed = 20; /* Made on purpose so the core 16th evicts the address at set 4096 and way 0 */
+    Hierarchy *hierarchy = new Hierarchy(topology);
+
+    /* Initially load <L2_ASSOC> blocks from core 0: they fill a set of the L2 and are owned by core 0 */
+    for (unsigned int i = 0; i < L2_ASSOC; i++){
+        hierarchy->observe(LINE_SIZE*set_number_l2*i, 0);
+    }
+    for (unsigned int i = 0; i < L2_ASSOC; i++){
+        CHECK(in_l2(hierarchy, LINE_SIZE*set_number_l2*i));
+        CHECK(llc_owner(hierarchy, LINE_SIZE*set_number_l2*i) == 0);
+    }
+
+    /* One more: the least recently used block leaves the L2, and its LLC line is owned by no one */
+    unsigned long address_to_invalidate = LINE_SIZE*set_number_l2*L2_ASSOC;
+    hierarchy->observe(address_to_invalidate, 0);
+    CHECK(!in_l2(hierarchy, 0));
+    CHECK(llc_owner(hierarchy, 0) == -1);
+    CHECK(in_l2(hierarchy, address_to_invalidate));
+    CHECK(llc_owner(hierarchy, address_to_invalidate) == 0);
+
+    /* Now, using 16 attackers, evict the added block from the L3 cache. Cores 1 to 15 take the free ways */
+    for (int core = 1; core < 16; core++){
+        hierarchy->observe(address_to_invalidate + LINE_SIZE*set_number_l3*L3_ASSOC*core, core);
+        CHECK(llc_owner(hierarchy, address_to_invalidate) == 0);
+    }
+    CHECK(owned_by(hierarchy, hierarchy->slices[0]->get_set_index(address_to_invalidate), -1) == 0);
+
+    /* Core 16 owns nothing in a full set: SHARP evicts randomly and raises its alarm */
+    hierarchy->observe(address_to_invalidate + LINE_SIZE*set_number_l3*L3_ASSOC*16, 16);
+    CHECK(hierarchy->slices[0]->alarm_counter[16] == 1);
+    CHECK(!in_llc(hierarchy, address_to_invalidate));
+
+    /* L2 cache should now have that block invalidated */
+    CHECK(!in_l2(hierarchy, address_to_invalidate));
+    for (unsigned int i = 1; i < L2_ASSOC; i++){
+        CHECK(in_l2(hierarchy, LINE_SIZE*set_number_l2*i));
+    }
+
+    delete hierarchy;
+}
+
+void test_sharp(){
+    /* SHARP: unowned ways first, then the requesting core's own ways, then a random way and an alarm */
+    unsigned long set_number_l3 = 16384 * 1024 / LINE_SIZE / L3_ASSOC;
+    unsigned long stride = LINE_SIZE*set_number_l3;
+
+    Topology topology = test_topology(4);
+    topology.metrics = true;
+    Hierarchy *hierarchy = new Hierarchy(topology);
+    Cache *llc = hierarchy->slices[0];
+
+    /* Initially load <L3_ASSOC> blocks from core 0. Only those its L2 still holds stay owned */
+    for (unsigned int i = 0; i < L3_ASSOC; i++){
+        hierarchy->observe(stride*i, 0);
+    }
+    CHECK(owned_by(hierarchy, 0, 0) == L2_ASSOC);
+    CHECK(owned_by(hierarchy, 0, -1) == L3_ASSOC - L2_ASSOC);
+
+    /* Step 1: core 1 replaces the least recently used unowned block, a valid line it counts as evicted */
+    hierarchy->observe(stride*L3_ASSOC, 1);
+    CHECK(!in_llc(hierarchy, 0));
+    CHECK(llc_owner(hierarchy, stride*L3_ASSOC) == 1);
+    CHECK(owned_by(hierarchy, 0, 0) == L2_ASSOC);
+    CHECK(llc->core_stats[1].sharp_steps[0] == 1 && llc->core_stats[1].evictions == 1);
+
+    hierarchy->observe(stride*(L3_ASSOC+1), 1);
+    CHECK(!in_llc(hierarchy, stride));
+    CHECK(owned_by(hierarchy, 0, 1) == 2);
+
+    hierarchy->observe(stride*(L3_ASSOC+2), 2);
+    CHECK(!in_llc(hierarchy, stride*2));
+    CHECK(llc_owner(hierarchy, stride*(L3_ASSOC+2)) == 2);
+
+    /* Core 1 takes every unowned way left */
+    unsigned int unowned = owned_by(hierarchy, 0, -1);
+    for (unsigned int i = 0; i < unowned; i++){
+        hierarchy->observe(stride*(L3_ASSOC+3+i), 1);
+    }
+    CHECK(owned_by(hierarchy, 0, -1) == 0);
+    CHECK(owned_by(hierarchy, 0, 1) == 2 + unowned);
+
+    /* Step 2: core 2 replaces its own block, no alarm */
+    unsigned long next = stride*(L3_ASSOC+3+unowned);
+    hierarchy->observe(next, 2);
+    CHECK(!in_llc(hierarchy, stride*(L3_ASSOC+2)));
+    CHECK(llc_owner(hierarchy, next) == 2);
+    CHECK(llc->alarm_counter[2] == 0);
+
+    /* Step 3: core 3 owns nothing, a random way goes and the alarm counts */
+    hierarchy->observe(next + stride, 3);
+    CHECK(llc_owner(hierarchy, next + stride) == 3);
+    CHECK(llc->alarm_counter[3] == 1);
+    CHECK(llc->misses == L3_ASSOC + 5 + unowned);
+
+    delete hierarchy;
+}
+
+void test_caches(){
+    /* Conflicts in a private cache: the L2 keeps the last <L2_ASSOC> blocks, the inclusive LLC all of them */
+    unsigned long set_number_l2 = 256 * 1024 / LINE_SIZE / L2_ASSOC;
+
+    Hierarchy *hierarchy = new Hierarchy(test_topology(4));
+
+    for (unsigned int i = 0; i < 2 * L2_ASSOC; i++){
+        hierarchy->observe(LINE_SIZE*set_number_l2*i, 0);
+    }
+    for (unsigned int i = 0; i < 2 * L2_ASSOC; i++){
+        CHECK(in_l2(hierarchy, LINE_SIZE*set_number_l2*i) == (i >= L2_ASSOC));
+        CHECK(in_llc(hierarchy, LINE_SIZE*set_number_l2*i));
+        CHECK(llc_owner(hierarchy, LINE_SIZE*set_number_l2*i) == (i >= L2_ASSOC ? 0 : -1));
+    }
+
+    /* The L2 hits now, the first blocks come from the LLC: a hit as well, only LLC misses are slow */
+    CHECK(hierarchy->observe(LINE_SIZE*set_number_l2*(2 * L2_ASSOC - 1), 0) == hierarchy->hit_time);
+    CHECK(hierarchy->observe(0, 0) == hierarchy->hit_time);
+    CHECK(hierarchy->observe(LINE_SIZE*set_number_l2*(2 * L2_ASSOC), 0) == L3_CACHE_MISS_PENALTY);
+
+    delete hierarchy;
+}
+
+void test_stack_distance(){
+    /* Every (sets, ways) point of the profile is the miss count of an LRU cache of that shape */
+    StackProfile profile;
+    profile.init(LINE_SIZE, 256);
+    Xoshiro256 rng;
+    rng.seed(3, STREAM_NOISE, 0);
+    vector<unsigned long> stream;
+    for (unsigned int i = 0; i < 200000; i++){
+        /* Mostly a hot working set, sometimes a wider one, enough to compact and grow the trees */
+        unsigned int lines = rng.below(4) == 0 ? 8192 : 512;
+        stream.push_back((unsigned long) rng.below(lines) * LINE_SIZE);
+    }
+    for (unsigned int i = 0; i < stream.size(); i++) profile.access(stream[i]);
+
+    unsigned int shapes[][2] = {{1, 16}, {16, 16}, {64, 4}, {64, 8}, {256, 4}, {256, 16}}; /* Sets, ways */
+    for (unsigned int i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++){
+        unsigned int sets = shapes[i][0], ways = shapes[i][1];
+        Cache *cache = make_cache(sets * ways * LINE_SIZE / 1024, LINE_SIZE, L3_CACHE_MISS_PENALTY, ways, false);
+        CacheAnswer answer;
+        for (unsigned int a = 0; a < stream.size(); a++) cache->load(&answer, stream[a], 0);
+        CHECK(profile.accesses - profile.hits(floor_log2(sets), ways) == cache->misses);
+        delete cache;
+    }
+    CHECK(profile.family[0].cold == profile.lines.size());
+
+    /* Reuse of a target line: A B C A is distance 2 fully associative, 0 once B and C map elsewhere */
+    StackProfile targets;
+    targets.init(LINE_SIZE, 4);
+    targets.aim(0, LINE_SIZE);
+    unsigned long sequence[] = {0, LINE_SIZE * 1, LINE_SIZE * 2, 0, LINE_SIZE * 5, 0};
+    for (unsigned int i = 0; i < sizeof(sequence) / sizeof(sequence[0]); i++) targets.access(sequence[i]);
+    CHECK(targets.family[0].target_cold[0] == 1 && targets.family[0].target_cold[1] == 1);
+    CHECK(targets.family[0].target_histogram[0].size() == 3);
+    CHECK(targets.family[0].target_histogram[0][2] == 1 && targets.family[0].target_histogram[0][1] == 1);
+    CHECK(targets.family[2].target_histogram[0].size() == 1 && targets.family[2].target_histogram[0][0] == 2);
+    CHECK(targets.family[1].target_histogram[0][1] == 1 && targets.family[1].target_histogram[0][0] == 1);
+}
+
+void test_sparse_sets(){
+    /* Sets are allocated a page at a time on first use, lookups alone allocate nothing */
+    Cache *llc = make_cache(65536, LINE_SIZE, L3_CACHE_MISS_PENALTY, L3_ASSOC, true);
+    llc->alarm_counter = (unsigned long *) calloc(1, sizeof(unsigned long));
+    CHECK(llc->touched_sets() == 0);
+    CHECK(llc->find_way(llc->get_set_index(0x401680), 0x401680) == -1);
+    CHECK(llc->touched_sets() == 0);
+
+    CacheAnswer answer;
+    llc->load(&answer, 0x401680, 0);
+    CHECK(answer.miss && llc->touched_sets() == llc->page_sets);
+    CHECK(llc->find_way(llc->get_set_index(0x401680), 0x401680) >= 0);
+    /* A fresh set of the same page starts empty and unowned */
+    unsigned long neighbour = llc->get_set_index(0x401680) ^ 1;
+    CHECK(*llc->set_valid(neighbour) == 0 && llc->set_owners(neighbour)[0] == -1);
+    CHECK(llc->touched_sets() == llc->page_sets);
+    delete llc;
+}
+
+void test_high_tags(){
+    /* Stack lines (0x7ffd...) and their aliases below bit 44 are different lines, in fixed and runtime geometries */
+    unsigned long stack = 0x7ffd12345000UL, alias = stack & ((1UL << 44) - 1);
+    unsigned int shapes[][2] = {{32, 8}, {16, 4}}; /* KB, ways: the default L1 is specialized, the other is not */
+    for (unsigned int i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++){
+        Cache *l1 = make_cache(shapes[i][0], LINE_SIZE, L1_CACHE_MISS_PENALTY, shapes[i][1], false);
+        CHECK(l1->specialized == (i == 0));
+        CacheAnswer answer;
+        l1->load(&answer, stack, 0);
+        CHECK(answer.miss);
+        CHECK(l1->find_way(l1->get_set_index(alias), alias) == -1);
+        l1->load(&answer, alias, 0);
+        CHECK(answer.miss && !answer.evicted);
+        CHECK(l1->line_holds(answer.line, alias) && !l1->line_holds(answer.line, stack));
+
+        /* Evicted lines come back with their high bits */
+        unsigned long step = l1->set_number * LINE_SIZE;
+        for (unsigned int way = 2; way < l1->associativity; way++) l1->load(&answer, stack + way * step, 0);
+        l1->load(&answer, stack + l1->associativity * step, 0);
+        CHECK(answer.evicted && answer.evicted_addr == stack);
+        delete l1;
+    }
+}
+
+void test_sharded(){
+    /* Without SHARP's random victims, 4 shards give every latency and miss of a single hierarchy */
+    Topology topology = test_topology(2);
+    topology.private_levels = 2;
+    topology.split_l1 = true;
+    topology.level[1] = topology.level[0];
+    topology.level[0] = {32, LINE_SIZE, L1_CACHE_MISS_PENALTY, 8, false, REPL_LRU};
+    topology.llc.size = 1024; /* Small enough to evict and back-invalidate */
+    topology.llc.sharp = false;
+    topology.private_cores = 3;
+    topology.noise = 10;
+    Hierarchy *hierarchy = new Hierarchy(topology);
+    ShardedHierarchy *sharded = new ShardedHierarchy(topology, 4);
+    CHECK(sharded->start());
+
+    Xoshiro256 rng;
+    rng.seed(4, STREAM_NOISE, 0);
+    unsigned long probe[L3_ASSOC], latencies[L3_ASSOC];
+    for (unsigned int i = 0; i < 20000; i++){
+        unsigned long addr = (unsigned long) rng.below(32768) * LINE_SIZE;
+        int core = rng.below(2);
+        AccessKind kind = rng.below(4) == 0 ? ACCESS_FETCH : ACCESS_DATA;
+        if (i % 3 == 0){
+            /* The victim's loads are not timed */
+            sharded->post(addr, core, kind, true);
+            hierarchy->observe(addr, core, kind);
+        }
+        else if (i % 100 == 1){
+            /* A probe of an LLC eviction set, all in one shard */
+            for (unsigned int w = 0; w < L3_ASSOC; w++) probe[w] = hierarchy->eviction_address(addr, w + 1);
+            sharded->observe_all(probe, L3_ASSOC, 1, latencies);
+            for (unsigned int w = 0; w < L3_ASSOC; w++) CHECK(latencies[w] == hierarchy->observe(probe[w], 1));
+        }
+        else CHECK(sharded->observe(addr, core, kind) == hierarchy->observe(addr, core, kind));
+    }
+    sharded->quiesce();
+    CHECK(sharded->llc_misses() == hierarchy->llc_misses() && sharded->llc_accesses() == hierarchy->llc_accesses());
+    CHECK(hierarchy->llc_misses() > 0);
+
+    /* Stopped, the caller simulates: contents went on where the workers left them */
+    sharded->stop();
+    CHECK(sharded->load(LINE_SIZE * 7, 0) == hierarchy->load(LINE_SIZE * 7, 0));
+    delete sharded;
+    delete hierarchy;
+}
+
+void test_key_inference(){
+    /* With the default 80% accuracy and 99% confidence no single observation makes a bit known */
+    KeyInference key;
+    key.init(80, 99, std::vector<double>());
+    key.observe(0, 1);
+    CHECK(!key.is_known(0) && key.bit_char(0) == '?');
+    for (int i = 0; i < 3; i++) key.observe(0, 1);
+    CHECK(key.is_known(0) && key.bit_char(0) == '1' && key.known == 1);
+
+    /* One conflicting observation among four keeps a bit unknown */
+    for (int i = 0; i < 4; i++) key.observe(1, 0);
+    key.observe(1, 1);
+    CHECK(!key.is_known(1) && key.known == 1);
+
+    /* A known bit a conflicting observation contradicts is unknown again */
+    key.observe(0, 0);
+    CHECK(!key.is_known(0) && key.known == 0);
+}
+
+void test_key_rounds(){
+    /* Rounds of one victim iteration, as the spies report them, make a single observation of its bit */
+    KeyInference key;
+    key.init(80, 99, std::vector<double>());
+    int first[] = {0, 0, 1, -1, 0}, second[] = {0, 0, 0, 0};
+    for (unsigned int r = 0; r < sizeof(first) / sizeof(first[0]); r++) key.fold(0, first[r]);
+    CHECK(key.log_odds.empty()); /* Open until the next iteration starts */
+    for (unsigned int r = 0; r < sizeof(second) / sizeof(second[0]); r++) key.fold(1, second[r]);
+    key.fold(2, -1);
+    key.flush();
+    CHECK(key.log_odds.size() == 3 && key.log_odds[0] == key.weight && key.log_odds[1] == -key.weight && key.log_odds[2] == 0);
+
+    /* Many rounds of one iteration never make its bit known, four runs agreeing do */
+    for (int r = 0; r < 10; r++) key.fold(1, 0);
+    key.flush();
+    CHECK(!key.is_known(1) && key.reachable() == 0);
+    for (int run = 0; run < 2; run++){
+        key.fold(1, 0);
+        key.flush();
+    }
+    CHECK(key.is_known(1) && key.bit_char(1) == '0' && key.known == 1);
+
+    /* With observations as sure as the confidence every bit can settle in one run */
+    key.init(99, 95, std::vector<double>());
+    CHECK(key.reachable() == ~0UL);
+}
+
+static string run_replay(const string &args){
+    /* Output of trace_replay, built next to sim_test by make test */
+    string output;
+    FILE *pipe = popen(("./trace_replay " + args + " 2>&1").c_str(), "r");
+    if (pipe == NULL) return output;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), pipe)) > 0) output.append(buf, n);
+    pclose(pipe);
+    return output;
+}
+
+static string output_line(const string &output, const string &prefix){
+    size_t start = output.find("\n" + prefix);
+    if (start == string::npos) return "";
+    start++;
+    return output.substr(start, output.find('\n', start) - start);
+}
+
+static vector<unsigned long> json_counts(const string &path, const string &field){
+    /* Every "<field>": value in a -metrics json, in order */
+    vector<unsigned long> counts;
+    ifstream file(path.c_str());
+    string json((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    string key = "\"" + field + "\": ";
+    for (size_t pos = json.find(key); pos != string::npos; pos = json.find(key, pos + 1))
+        counts.push_back(strtoul(json.c_str() + pos + key.size(), NULL, 10));
+    return counts;
+}
+
+void test_checkpoint_resume(){
+    /*
+        A run saving a checkpoint at sign and one restoring it end with the same victim clock and
+            cache accesses: the restored victim runs sign's block again, it must not be charged twice
+    */
+    char dir[] = "/tmp/sim_test.XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    string base = dir;
+    unsigned long square = 0x4014c0, multiply = 0x4016c0, sign = 0x401800;
+    TraceWriter trace;
+    CHECK(trace.open((base + "/victim.trace").c_str()));
+    trace.block(0x400000, 4, 1000, 0);
+    trace.block(sign, 2, 40, 0);
+    trace.probe(sign, 0);
+    trace.access(TRACE_READ, 0x7000000, 0);
+    for (unsigned int i = 0; i < 64; i++){
+        trace.probe(square, 0);
+        for (unsigned int k = 0; k < 100; k++){
+            trace.block(square + k % 4 * LINE_SIZE, 1, 25, 0);
+            trace.access(TRACE_READ, 0x7000000 + k % 16 * 8, 0);
+        }
+        if (i % 3 == 0) continue;
+        trace.probe(multiply, 0);
+        for (unsigned int k = 0; k < 100; k++){
+            trace.block(multiply + k % 4 * LINE_SIZE, 1, 25, 0);
+            trace.access(TRACE_WRITE, 0x7100000 + k % 16 * 8, 0);
+        }
+    }
+    trace.header.square_addr = square;
+    trace.header.multiply_addr = multiply;
+    trace.header.sign_addr = sign;
+    CHECK(trace.close());
+
+    string saving = run_replay("-save_checkpoint " + base + "/state.ckpt -metrics " + base + "/saving -- " + base + "/victim.trace");
+    string restored = run_replay("-restore_checkpoint " + base + "/state.ckpt -metrics " + base + "/restored -- " + base + "/victim.trace");
+    CHECK(saving.find("Saved checkpoint") != string::npos && restored.find("Restored checkpoint") != string::npos);
+    CHECK(!output_line(saving, "Timestamp:").empty() && output_line(saving, "Timestamp:") == output_line(restored, "Timestamp:"));
+    CHECK(json_counts(base + "/saving.json", "instructions") == json_counts(base + "/restored.json", "instructions"));
+    vector<unsigned long> accesses = json_counts(base + "/saving.json", "accesses");
+    CHECK(accesses.size() == 2 && accesses == json_counts(base + "/restored.json", "accesses")); /* L3 and L2 */
+
+    const char *files[] = {"victim.trace", "state.ckpt", "saving.csv", "saving.json", "saving.sets.csv",
+                           "restored.csv", "restored.json", "restored.sets.csv"};
+    for (unsigned int f = 0; f < sizeof(files) / sizeof(files[0]); f++) unlink((base + "/" + files[f]).c_str());
+    rmdir(dir);
+}
+
+int main(int argc, char **argv){
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"second_atk_simplified", test_second_atk_simplified},
+        {"evict_and_ownership", test_evict_and_ownership},
+        {"sharp", test_sharp},
+        {"caches", test_caches},
+        {"stack_distance", test_stack_distance},
+        {"sparse_sets", test_sparse_sets},
+        {"high_tags", test_high_tags},
+        {"sharded", test_sharded},
+        {"key_inference", test_key_inference},
+        {"key_rounds", test_key_rounds},
+        {"checkpoint_resume", test_checkpoint_resume},
+    };
+    unsigned int failed_tests = 0;
+    for (unsigned int t = 0; t < sizeof(tests) / sizeof(tests[0]); t++){
+        unsigned int before = failures;
+        tests[t].run();
+        cout << (failures == before ? "ok     " : "FAILED ") << tests[t].name << endl;
+        if (failures != before) failed_tests++;
+    }
+    if (failed_tests > 0){
+        cout << failed_tests << " tests failed" << endl;
+        return 1;
+    }
+    return 0;
+}
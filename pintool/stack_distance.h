@@ -0,0 +1,189 @@
+#ifndef STACK_DISTANCE_H
+#define STACK_DISTANCE_H
+
+/*
+    Mattson stack distances (-stack_distance). One pass over the victim's accesses gives the hits
+    of an LRU cache of every associativity, for every number of sets 1, 2, 4, ... up to a maximum
+    (a family): an access hits a <ways>-way cache of <sets> sets iff fewer than <ways> other lines
+    of its set were touched since its previous access. That count is its stack distance.
+
+    Per family and set, a Fenwick tree over the set's own access times holds a mark on the last
+    access of each line, so a distance is the number of marks after the line's previous access.
+    A set whose tree fills renumbers its live accesses from 0 (and grows if they fill half of it).
+    Sets are indexed by the low line address bits like a monolithic cache, slice hashing is ignored.
+
+    <prefix>.csv        sets, ways, capacity, hits and misses of every family up to <ways> ways
+    <prefix>.reuse.csv  per target line (square, multiply) and family: how often each distance
+                        occurred, -1 for the first access
+*/
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#define STACK_TARGETS 2 /* square_addr and multiply_addr */
+#define STACK_MIN_TIMES 64 /* Tree size of a set when first touched */
+
+typedef struct Stack_Set {
+    std::vector<unsigned int> tree; /* Fenwick tree, 1-based: time t is entry t + 1 */
+    std::vector<unsigned int> ids; /* Line accessed at each time, ids[time] */
+} StackSet;
+
+typedef struct Stack_Family {
+    unsigned long sets;
+    std::vector<StackSet> set;
+    std::vector<unsigned long> histogram; /* Accesses by distance */
+    unsigned long cold; /* First accesses of a line */
+    std::vector<unsigned long> target_histogram[STACK_TARGETS];
+    unsigned long target_cold[STACK_TARGETS];
+} StackFamily;
+
+class StackProfile {
+public:
+    unsigned int line_size;
+    unsigned int families; /* Set counts 1 << 0 ... 1 << (families - 1) */
+    std::vector<StackFamily> family;
+    std::unordered_map<unsigned long, unsigned int> line_ids; /* Line -> dense id */
+    std::vector<unsigned long> lines; /* Id -> line */
+    std::vector<unsigned int> stamps; /* [id * families + family]: time of the line's last access in its set */
+    unsigned long targets[STACK_TARGETS]; /* Lines, ~0 if none */
+    unsigned long accesses;
+
+    void init(unsigned int line, unsigned long max_sets){
+        /* <max_sets> a power of two */
+        line_size = line;
+        families = 0;
+        while ((1UL << families) <= max_sets) families++;
+        family.resize(families);
+        for (unsigned int f = 0; f < families; f++){
+            family[f].sets = 1UL << f;
+            family[f].set.resize(family[f].sets);
+            family[f].cold = 0;
+            for (unsigned int t = 0; t < STACK_TARGETS; t++) family[f].target_cold[t] = 0;
+        }
+        targets[0] = targets[1] = ~0UL;
+        accesses = 0;
+    }
+
+    void aim(unsigned long square, unsigned long multiply){
+        targets[0] = square / line_size;
+        targets[1] = multiply / line_size;
+    }
+
+    static unsigned int prefix(const std::vector<unsigned int> &tree, unsigned long count){
+        /* Marks on the first <count> times */
+        unsigned int sum = 0;
+        for (; count > 0; count &= count - 1) sum += tree[count];
+        return sum;
+    }
+
+    static void mark(std::vector<unsigned int> &tree, unsigned long time, int delta){
+        for (unsigned long i = time + 1; i < tree.size(); i += i & -i) tree[i] += delta;
+    }
+
+    void compact(StackSet *s, unsigned int f){
+        /* The tree is full: keep the last access of each line, in order, at times 0 ... live - 1 */
+        unsigned long live = 0;
+        for (unsigned long time = 0; time < s->ids.size(); time++){
+            unsigned int id = s->ids[time];
+            if (stamps[id * families + f] != time) continue;
+            stamps[id * families + f] = live;
+            s->ids[live++] = id;
+        }
+        s->ids.resize(live);
+        unsigned long size = STACK_MIN_TIMES;
+        while (size < 2 * live) size *= 2;
+        s->tree.assign(size + 1, 0);
+        /* Linear build: every entry adds itself to its parent */
+        for (unsigned long i = 1; i <= size; i++){
+            if (i <= live) s->tree[i]++;
+            unsigned long parent = i + (i & -i);
+            if (parent <= size) s->tree[parent] += s->tree[i];
+        }
+    }
+
+    static void count(std::vector<unsigned long> &histogram, unsigned long distance){
+        if (distance >= histogram.size()) histogram.resize(distance + 1, 0);
+        histogram[distance]++;
+    }
+
+    void access(unsigned long addr){
+        unsigned long line = addr / line_size;
+        int target = line == targets[0] ? 0 : line == targets[1] ? 1 : -1;
+        accesses++;
+
+        std::pair<std::unordered_map<unsigned long, unsigned int>::iterator, bool> found =
+            line_ids.insert(std::make_pair(line, (unsigned int) lines.size()));
+        unsigned int id = found.first->second;
+        bool cold = found.second;
+        if (cold){
+            lines.push_back(line);
+            stamps.resize(stamps.size() + families);
+        }
+
+        for (unsigned int f = 0; f < families; f++){
+            StackFamily *fam = &family[f];
+            StackSet *s = &fam->set[line & (fam->sets - 1)];
+            if (s->ids.size() + 1 >= s->tree.size()) compact(s, f);
+            unsigned long now = s->ids.size();
+            unsigned int *stamp = &stamps[id * families + f];
+            if (cold){
+                fam->cold++;
+                if (target >= 0) fam->target_cold[target]++;
+            }
+            else{
+                unsigned long distance = prefix(s->tree, now) - prefix(s->tree, *stamp + 1);
+                count(fam->histogram, distance);
+                if (target >= 0) count(fam->target_histogram[target], distance);
+                mark(s->tree, *stamp, -1);
+            }
+            mark(s->tree, now, 1);
+            s->ids.push_back(id);
+            *stamp = now;
+        }
+    }
+
+    unsigned long hits(unsigned int f, unsigned int ways){
+        /* Of an LRU cache with <ways> ways and the sets of family <f> */
+        const std::vector<unsigned long> &histogram = family[f].histogram;
+        unsigned long sum = 0;
+        for (unsigned int d = 0; d < ways && d < histogram.size(); d++) sum += histogram[d];
+        return sum;
+    }
+
+    bool write(const char *prefix, unsigned int max_ways){
+        std::string base(prefix);
+        FILE *curves = fopen((base + ".csv").c_str(), "w");
+        FILE *reuse = fopen((base + ".reuse.csv").c_str(), "w");
+        if (curves == NULL || reuse == NULL){
+            if (curves != NULL) fclose(curves);
+            if (reuse != NULL) fclose(reuse);
+            return false;
+        }
+        fprintf(curves, "sets,ways,capacity_bytes,accesses,hits,misses,miss_ratio\n");
+        for (unsigned int f = 0; f < families; f++){
+            for (unsigned int ways = 1; ways <= max_ways; ways++){
+                unsigned long hit = hits(f, ways);
+                fprintf(curves, "%lu,%u,%lu,%lu,%lu,%lu,%.6f\n", family[f].sets, ways, family[f].sets * ways * line_size,
+                        accesses, hit, accesses - hit, accesses ? (double) (accesses - hit) / accesses : 0.0);
+            }
+        }
+        fprintf(reuse, "target,sets,distance,count\n");
+        for (unsigned int t = 0; t < STACK_TARGETS; t++){
+            const char *name = t == 0 ? "square" : "multiply";
+            for (unsigned int f = 0; f < families; f++){
+                fprintf(reuse, "%s,%lu,-1,%lu\n", name, family[f].sets, family[f].target_cold[t]);
+                const std::vector<unsigned long> &histogram = family[f].target_histogram[t];
+                for (unsigned long d = 0; d < histogram.size(); d++){
+                    if (histogram[d] > 0) fprintf(reuse, "%s,%lu,%lu,%lu\n", name, family[f].sets, d, histogram[d]);
+                }
+            }
+        }
+        bool ok = !ferror(curves) && !ferror(reuse);
+        ok = fclose(curves) == 0 && ok;
+        return fclose(reuse) == 0 && ok;
+    }
+};
+
+#endif
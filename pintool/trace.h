@@ -0,0 +1,305 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+    Recorded victim streams. The pintool writes them with -record, trace_replay feeds them
+    through the simulator without Pin, so one Pin run serves a whole sweep of noise levels,
+    wait times or cache shapes.
+
+    File:   a TraceHeader, then chunks. A chunk is a TraceChunk followed by <bytes> of records.
+            Every chunk starts with cleared delta state and thread 0, so it decodes on its own.
+    Record: a tag byte (TraceKind), then LEB128 varints:
+        TRACE_BLOCK   zigzag delta of the first fetch address from the previous block, lines, instructions
+        TRACE_READ    zigzag delta of the data address from the previous read or write
+        TRACE_WRITE   same as TRACE_READ
+        TRACE_PROBE   probe instruction address (square, multiply or sign)
+        TRACE_THREAD  victim thread of the records that follow
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC "SHARPTRC"
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_BYTES 65536
+#define TRACE_RECORD_MAX 32 /* Tag and three varints of at most 10 bytes, rounded up */
+
+enum TraceKind {
+    TRACE_BLOCK,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_PROBE,
+    TRACE_THREAD
+};
+
+typedef struct Trace_Header {
+    char magic[8];
+    unsigned int version;
+    unsigned int chunk_bytes; /* Largest chunk payload */
+    unsigned long square_addr; /* Probe points as resolved in the recorded run */
+    unsigned long multiply_addr;
+    unsigned long sign_addr;
+    unsigned long records;
+    unsigned long instructions;
+} TraceHeader;
+
+typedef struct Trace_Chunk {
+    unsigned int bytes;
+    unsigned int records;
+} TraceChunk;
+
+typedef struct Trace_Record {
+    TraceKind kind;
+    unsigned int thread;
+    unsigned long addr; /* First fetch address, data address or probe address */
+    unsigned int lines; /* TRACE_BLOCK only */
+    unsigned int instructions;
+} TraceRecord;
+
+static inline unsigned char *put_varint(unsigned char *p, unsigned long v){
+    while (v >= 0x80){
+        *p++ = (unsigned char) v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (unsigned char) v;
+    return p;
+}
+
+static inline const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, unsigned long *v){
+    /* NULL if the varint runs past <end> */
+    unsigned long result = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7){
+        unsigned char byte = *p++;
+        result |= (unsigned long) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)){
+            *v = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline unsigned long zigzag(unsigned long to, unsigned long from){
+    /* Signed distance folded so small moves either way stay small */
+    long delta = (long) (to - from);
+    return ((unsigned long) delta << 1) ^ (unsigned long) (delta >> 63);
+}
+
+static inline unsigned long unzigzag(unsigned long v, unsigned long from){
+    return from + ((v >> 1) ^ (0UL - (v & 1)));
+}
+
+class TraceWriter {
+public:
+    FILE *file;
+    TraceHeader header;
+    unsigned char chunk[TRACE_CHUNK_BYTES];
+    unsigned char *pos;
+    unsigned int chunk_records;
+    unsigned long last_block, last_data; /* Delta bases, cleared with every chunk */
+    unsigned int thread; /* Thread the reader assumes for the next record */
+    bool failed;
+
+    bool open(const char *path){
+        file = fopen(path, "wb");
+        if (file == NULL) return false;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_VERSION;
+        failed = fwrite(&header, sizeof(header), 1, file) != 1;
+        start_chunk();
+        return !failed;
+    }
+
+    void start_chunk(){
+        pos = chunk;
+        chunk_records = 0;
+        last_block = last_data = 0;
+        thread = 0;
+    }
+
+    void flush(){
+        if (chunk_records == 0) return;
+        TraceChunk head = {(unsigned int) (pos - chunk), chunk_records};
+        if (head.bytes > header.chunk_bytes) header.chunk_bytes = head.bytes;
+        if (fwrite(&head, sizeof(head), 1, file) != 1 || fwrite(chunk, head.bytes, 1, file) != 1) failed = true;
+        start_chunk();
+    }
+
+    void begin(TraceKind kind, unsigned int tid){
+        /* Room for a thread switch and the record itself */
+        if (pos + 2 * TRACE_RECORD_MAX > chunk + TRACE_CHUNK_BYTES) flush();
+        if (tid != thread){
+            *pos++ = TRACE_THREAD;
+            pos = put_varint(pos, tid);
+            thread = tid;
+            chunk_records++;
+            header.records++;
+        }
+        *pos++ = kind;
+        chunk_records++;
+        header.records++;
+    }
+
+    void block(unsigned long first_line, unsigned int lines, unsigned int instructions, unsigned int tid){
+        begin(TRACE_BLOCK, tid);
+        pos = put_varint(pos, zigzag(first_line, last_block));
+        pos = put_varint(pos, lines);
+        pos = put_varint(pos, instructions);
+        last_block = first_line;
+        header.instructions += instructions;
+    }
+
+    void access(TraceKind kind, unsigned long addr, unsigned int tid){
+        begin(kind, tid);
+        pos = put_varint(pos, zigzag(addr, last_data));
+        last_data = addr;
+    }
+
+    void probe(unsigned long ip, unsigned int tid){
+        begin(TRACE_PROBE, tid);
+        pos = put_varint(pos, ip);
+    }
+
+    bool close(){
+        /* The header goes last, once the probe points are resolved and the counts known */
+        flush();
+        if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) failed = true;
+        if (fclose(file) != 0) failed = true;
+        file = NULL;
+        return !failed;
+    }
+};
+
+class TraceReader {
+public:
+    int fd;
+    const unsigned char *map;
+    size_t size;
+    TraceHeader header;
+    const unsigned char *next_chunk; /* Start of the TraceChunk after the current one */
+    const unsigned char *chunk_start; /* Current chunk, released once decoded */
+    const unsigned char *pos, *end;
+    unsigned int chunk_records, decoded;
+    unsigned long last_block, last_data;
+    unsigned int thread;
+    bool corrupt;
+
+    bool open(const char *path){
+        map = NULL;
+        corrupt = false;
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(TraceHeader)){
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED){
+            ::close(fd);
+            return false;
+        }
+        map = (const unsigned char *) m;
+        madvise(m, size, MADV_SEQUENTIAL);
+        memcpy(&header, map, sizeof(header));
+        if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION){
+            close();
+            return false;
+        }
+        next_chunk = map + sizeof(header);
+        chunk_start = pos = end = next_chunk;
+        chunk_records = decoded = 0;
+        return true;
+    }
+
+    void release_chunk(){
+        /* Replays stream: pages of decoded chunks are dropped instead of piling up */
+        unsigned long page = sysconf(_SC_PAGESIZE);
+        unsigned long from = ((unsigned long) chunk_start + page - 1) & ~(page - 1);
+        unsigned long to = (unsigned long) end & ~(page - 1);
+        if (to > from) madvise((void *) from, to - from, MADV_DONTNEED);
+    }
+
+    bool load_chunk(){
+        if (decoded != chunk_records){
+            corrupt = true;
+            return false;
+        }
+        release_chunk();
+        if (next_chunk == map + size) return false;
+        TraceChunk head;
+        if ((size_t) (map + size - next_chunk) < sizeof(head)){
+            corrupt = true;
+            return false;
+        }
+        memcpy(&head, next_chunk, sizeof(head));
+        chunk_start = pos = next_chunk + sizeof(head);
+        if ((size_t) (map + size - pos) < head.bytes){
+            corrupt = true;
+            return false;
+        }
+        end = pos + head.bytes;
+        next_chunk = end;
+        chunk_records = head.records;
+        decoded = 0;
+        last_block = last_data = 0;
+        thread = 0;
+        return true;
+    }
+
+    bool next(TraceRecord *record){
+        /* False at the end of the trace, or on a damaged one (corrupt is set) */
+        unsigned long v[3];
+        while (true){
+            if (pos == end && !load_chunk()) return false;
+            if (pos == end) continue;
+            record->kind = (TraceKind) *pos++;
+            decoded++;
+            int fields = record->kind == TRACE_BLOCK ? 3 : record->kind <= TRACE_THREAD ? 1 : 0;
+            if (fields == 0){
+                corrupt = true;
+                return false;
+            }
+            for (int i = 0; i < fields; i++){
+                pos = get_varint(pos, end, &v[i]);
+                if (pos == NULL){
+                    corrupt = true;
+                    return false;
+                }
+            }
+            switch (record->kind){
+                case TRACE_THREAD:
+                    thread = v[0];
+                    continue;
+                case TRACE_BLOCK:
+                    record->addr = last_block = unzigzag(v[0], last_block);
+                    record->lines = v[1];
+                    record->instructions = v[2];
+                    break;
+                case TRACE_READ:
+                case TRACE_WRITE:
+                    record->addr = last_data = unzigzag(v[0], last_data);
+                    break;
+                default:
+                    record->addr = v[0];
+                    break;
+            }
+            record->thread = thread;
+            return true;
+        }
+    }
+
+    void close(){
+        if (map != NULL) munmap((void *) map, size);
+        ::close(fd);
+        map = NULL;
+    }
+};
+
+#endif